@@ -1,7 +1,31 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#ifdef BENZ_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef BENZ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BENZ_HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "bcachefs.h"
 
@@ -201,67 +225,91 @@ const struct bkey *benz_bch_next_bkey(const struct bset *p, const struct bkey *c
     return c;
 }
 
-struct bkey_local benz_bch_parse_bkey(const struct bkey *bkey, const struct bkey_format *format)
+// Packed fields are stored from the most significant bit of the key down, in
+// the order of enum bch_bkey_fields, and the u64s, format and type bytes of
+// the header take the least significant bits of the first u64
+void benz_bch_compile_bkey_format(struct bkey_unpack_plan *plan, const struct bkey_format *format)
+{
+    uint32_t high_bit = format->key_u64s * 64;
+    *plan = (struct bkey_unpack_plan){.kernel = BKEY_UNPACK_GENERIC,
+                                      .key_u64s = format->key_u64s};
+    if (memcmp(format, &BKEY_FORMAT_SHORT, sizeof(struct bkey_format)) == 0)
+    {
+        plan->kernel = BKEY_UNPACK_SHORT;
+    }
+    for (int i = 0; i < BKEY_NR_FIELDS; ++i)
+    {
+        struct bkey_unpack_field *field = &plan->fields[i];
+        const uint8_t bits = format->bits_per_field[i] < 64 ? format->bits_per_field[i] : 64;
+        field->offset = format->field_offset[i];
+        field->bits = bits;
+        if (bits == 0 || bits > high_bit)
+        {
+            continue;
+        }
+        high_bit -= bits;
+        field->word = (uint8_t)(high_bit / 64);
+        field->shift = (uint8_t)(high_bit % 64);
+        field->mask = bits == 64 ? (uint64_t)-1 : ((uint64_t)1 << bits) - 1;
+    }
+}
+
+static inline uint64_t _bkey_unpack_field(const uint64_t *words, const struct bkey_unpack_field *field)
+{
+    if (field->bits == 0)
+    {
+        return field->offset;
+    }
+    uint64_t value = words[field->word] >> field->shift;
+    if (field->shift + field->bits > 64)
+    {
+        // The field straddles two u64s
+        value |= words[field->word + 1] << (64 - field->shift);
+    }
+    return (value & field->mask) + field->offset;
+}
+
+struct bkey_local benz_bch_unpack_bkey(const struct bkey *bkey, const struct bkey_unpack_plan *plan)
 {
     struct bkey_local ret = {.u64s = bkey->u64s,
                              .format = bkey->format,
                              .needs_whiteout = bkey->needs_whiteout,
                              .type = bkey->type};
-    if (bkey->format == KEY_FORMAT_LOCAL_BTREE &&
-            memcmp(format, &BKEY_FORMAT_SHORT, sizeof(struct bkey_format)) == 0)
+    if (bkey->format == KEY_FORMAT_CURRENT)
+    {
+        memcpy(&ret, bkey, sizeof(*bkey));
+        ret.key_u64s = BKEY_U64s;
+    }
+    else if (bkey->format == KEY_FORMAT_LOCAL_BTREE && plan->kernel == BKEY_UNPACK_SHORT)
     {
         const struct bkey_short *bkey_short = (const void*)bkey;
         ret.p = bkey_short->p;
-        ret.key_u64s = format->key_u64s;
+        ret.key_u64s = plan->key_u64s;
     }
     else if (bkey->format == KEY_FORMAT_LOCAL_BTREE)
     {
-        const uint8_t *bytes = (const void*)bkey;
-        bytes += format->key_u64s * BCH_U64S_SIZE;
-        for (int i = 0; i < BKEY_NR_FIELDS ; ++i)
-        {
-            uint64_t value = format->field_offset[i];
-            if (value + format->bits_per_field[i] == 0)
-            {
-                continue;
-            }
-            bytes -= format->bits_per_field[i] / 8;
-            if (format->bits_per_field[i])
-            {
-                value += benz_uintXX_as_uint64(bytes, format->bits_per_field[i]);
-            }
-            switch (i)
-            {
-            case BKEY_FIELD_INODE:
-                ret.p.inode = value;
-                break;
-            case BKEY_FIELD_OFFSET:
-                ret.p.offset = value;
-                break;
-            case BKEY_FIELD_SNAPSHOT:
-                ret.p.snapshot = (uint32_t)value;
-                break;
-            case BKEY_FIELD_SIZE:
-                ret.size = (uint32_t)value;
-                break;
-            case BKEY_FIELD_VERSION_HI:
-                ret.version.hi = (uint32_t)value;
-                break;
-            case BKEY_FIELD_VERSION_LO:
-                ret.version.lo = value;
-                break;
-            }
-        }
-        ret.key_u64s = format->key_u64s;
-    }
-    else if (bkey->format == KEY_FORMAT_CURRENT)
-    {
-        memcpy(&ret, bkey, sizeof(*bkey));
-        ret.key_u64s = BKEY_U64s;
+        // Keys are u64 aligned inside bsets
+        const uint64_t *words = (const void*)bkey;
+        ret.p.inode = _bkey_unpack_field(words, &plan->fields[BKEY_FIELD_INODE]);
+        ret.p.offset = _bkey_unpack_field(words, &plan->fields[BKEY_FIELD_OFFSET]);
+        ret.p.snapshot = (uint32_t)_bkey_unpack_field(words, &plan->fields[BKEY_FIELD_SNAPSHOT]);
+        ret.size = (uint32_t)_bkey_unpack_field(words, &plan->fields[BKEY_FIELD_SIZE]);
+        ret.version.hi = (uint32_t)_bkey_unpack_field(words, &plan->fields[BKEY_FIELD_VERSION_HI]);
+        ret.version.lo = _bkey_unpack_field(words, &plan->fields[BKEY_FIELD_VERSION_LO]);
+        ret.key_u64s = plan->key_u64s;
     }
     return ret;
 }
 
+// Prefer compiling the format once with benz_bch_compile_bkey_format and
+// unpacking with benz_bch_unpack_bkey when parsing many keys of a node
+struct bkey_local benz_bch_parse_bkey(const struct bkey *bkey, const struct bkey_format *format)
+{
+    struct bkey_unpack_plan plan;
+    benz_bch_compile_bkey_format(&plan, format);
+    return benz_bch_unpack_bkey(bkey, &plan);
+}
+
 #pragma GCC push_options
 #pragma GCC optimize ("O2")
 
@@ -358,16 +406,178 @@ inline uint64_t benz_bch_get_extent_offset(const struct bch_extent_ptr *bch_exte
     return bch_extent_ptr->offset * BCH_SECTOR_SIZE;
 }
 
+// Size of an extent entry, the type of an entry is the position of the lowest
+// set bit of its first word. Returns 0 for unknown types
+uint32_t benz_bch_extent_entry_bytes(const union bch_extent_entry *entry)
+{
+    uint64_t type = 0;
+    memcpy(&type, entry, sizeof(type));
+    switch (type ? __builtin_ctzll(type) : BCH_EXTENT_ENTRY_MAX)
+    {
+    case BCH_EXTENT_ENTRY_ptr:
+        return sizeof(struct bch_extent_ptr);
+    case BCH_EXTENT_ENTRY_crc32:
+        return sizeof(struct bch_extent_crc32);
+    case BCH_EXTENT_ENTRY_crc64:
+        return sizeof(struct bch_extent_crc64);
+    case BCH_EXTENT_ENTRY_crc128:
+        return sizeof(struct bch_extent_crc128);
+    case BCH_EXTENT_ENTRY_stripe_ptr:
+        return sizeof(struct bch_extent_stripe_ptr);
+    }
+    return 0;
+}
+
+// Next entry of an extent value after `c`, or its first entry if `c` is NULL.
+// Returns NULL past the last entry or at an entry of unknown type
+const union bch_extent_entry *benz_bch_next_extent_entry(const struct bch_val *bch_val, const void *p_end,
+                                                        const union bch_extent_entry *c)
+{
+    const uint8_t *entry = c ? (const uint8_t*)c + benz_bch_extent_entry_bytes(c) : (const uint8_t*)bch_val;
+    if (entry + sizeof(uint64_t) > (const uint8_t*)p_end)
+    {
+        return NULL;
+    }
+    const uint32_t bytes = benz_bch_extent_entry_bytes((const void*)entry);
+    if (bytes == 0 || entry + bytes > (const uint8_t*)p_end)
+    {
+        return NULL;
+    }
+    return (const void*)entry;
+}
+
+// Unpacks a crc entry, whichever its size. Extents without crc entry, when
+// `entry` is NULL, are plain data of `size` sectors
+void benz_bch_extent_crc_unpack(const union bch_extent_entry *entry, uint32_t size, struct bch_extent_crc_unpacked *crc)
+{
+    switch (entry ? __builtin_ctzll(entry->type) : BCH_EXTENT_ENTRY_ptr)
+    {
+    case BCH_EXTENT_ENTRY_crc32:
+        *crc = (struct bch_extent_crc_unpacked){.compressed_size = entry->crc32._compressed_size + 1,
+                                                .uncompressed_size = entry->crc32._uncompressed_size + 1,
+                                                .offset = entry->crc32.offset,
+                                                .csum_type = entry->crc32.csum_type,
+                                                .compression_type = entry->crc32.compression_type,
+                                                .csum = {.lo = entry->crc32.csum}};
+        break;
+    case BCH_EXTENT_ENTRY_crc64:
+        *crc = (struct bch_extent_crc_unpacked){.compressed_size = entry->crc64._compressed_size + 1,
+                                                .uncompressed_size = entry->crc64._uncompressed_size + 1,
+                                                .offset = entry->crc64.offset,
+                                                .nonce = entry->crc64.nonce,
+                                                .csum_type = entry->crc64.csum_type,
+                                                .compression_type = entry->crc64.compression_type,
+                                                .csum = {.lo = entry->crc64.csum_lo, .hi = entry->crc64.csum_hi}};
+        break;
+    case BCH_EXTENT_ENTRY_crc128:
+        *crc = (struct bch_extent_crc_unpacked){.compressed_size = entry->crc128._compressed_size + 1,
+                                                .uncompressed_size = entry->crc128._uncompressed_size + 1,
+                                                .offset = entry->crc128.offset,
+                                                .nonce = entry->crc128.nonce,
+                                                .csum_type = entry->crc128.csum_type,
+                                                .compression_type = entry->crc128.compression_type,
+                                                .csum = entry->crc128.csum};
+        break;
+    default:
+        *crc = (struct bch_extent_crc_unpacked){.compressed_size = size, .uncompressed_size = size};
+        break;
+    }
+}
+
+// Walks the entries of an extent value up to its first pointer, unpacking the
+// crc entry which applies to it in `crc`. Returns NULL if the value holds no
+// pointer
+const struct bch_extent_ptr *benz_bch_extent_first_ptr(const struct bch_val *bch_val, const void *p_end,
+                                                       uint32_t size, struct bch_extent_crc_unpacked *crc)
+{
+    benz_bch_extent_crc_unpack(NULL, size, crc);
+    for (const union bch_extent_entry *entry = benz_bch_next_extent_entry(bch_val, p_end, NULL); entry;
+         entry = benz_bch_next_extent_entry(bch_val, p_end, entry))
+    {
+        switch (__builtin_ctzll(entry->type))
+        {
+        case BCH_EXTENT_ENTRY_ptr:
+            return &entry->ptr;
+        case BCH_EXTENT_ENTRY_crc32:
+        case BCH_EXTENT_ENTRY_crc64:
+        case BCH_EXTENT_ENTRY_crc128:
+            benz_bch_extent_crc_unpack(entry, size, crc);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Pointers of the extent entries starting at `bch_val`, each with the crc
+// entry applying to it. Returns the number of pointers, which can be larger
+// than `max` in which case only the first `max` are filled
+static uint32_t _benz_bch_extent_ptrs(const struct bch_val *bch_val, const void *p_end, uint32_t size,
+                                      Bcachefs_extent_ptr *ptrs, uint32_t max)
+{
+    struct bch_extent_crc_unpacked crc;
+    uint32_t nr_ptrs = 0;
+    benz_bch_extent_crc_unpack(NULL, size, &crc);
+    for (const union bch_extent_entry *entry = benz_bch_next_extent_entry(bch_val, p_end, NULL); entry;
+         entry = benz_bch_next_extent_entry(bch_val, p_end, entry))
+    {
+        switch (__builtin_ctzll(entry->type))
+        {
+        case BCH_EXTENT_ENTRY_ptr:
+            if (nr_ptrs < max)
+            {
+                ptrs[nr_ptrs] = (Bcachefs_extent_ptr){.offset = benz_bch_get_extent_offset(&entry->ptr),
+                                                      .dev = entry->ptr.dev,
+                                                      .gen = entry->ptr.gen,
+                                                      .cached = entry->ptr.cached,
+                                                      .crc = crc};
+            }
+            ++nr_ptrs;
+            break;
+        case BCH_EXTENT_ENTRY_crc32:
+        case BCH_EXTENT_ENTRY_crc64:
+        case BCH_EXTENT_ENTRY_crc128:
+            benz_bch_extent_crc_unpack(entry, size, &crc);
+            break;
+        case BCH_EXTENT_ENTRY_stripe_ptr:
+            // Follows the pointer it applies to
+            if (nr_ptrs && nr_ptrs <= max)
+            {
+                ptrs[nr_ptrs - 1].stripe = 1;
+            }
+            break;
+        }
+    }
+    return nr_ptrs;
+}
+
+// Compression type of the data addressed by an extent, extents which did not
+// compress are stored as is
+static inline uint8_t _benz_bch_crc_compression(const struct bch_extent_crc_unpacked *crc)
+{
+    return crc->compression_type == BCH_COMPRESSION_TYPE_incompressible ? BCH_COMPRESSION_TYPE_none :
+                                                                          crc->compression_type;
+}
+
+// The data of an extent starts `crc.offset` sectors into the region its
+// pointer addresses, which only differs from the pointer for checksummed
+// extents trimmed at the front. The offset of a compressed extent is the
+// location of its compressed data, `crc.offset` then applies once it is
+// decompressed
 const struct bkey *benz_bch_file_offset_size(const struct bkey *bkey,
                                              const struct bch_val *bch_val,
+                                             const void *p_end,
                                              uint64_t *file_offset,
                                              uint64_t *offset,
                                              uint64_t *size)
 {
-    if (bch_val && bkey->type == KEY_TYPE_extent)
+    struct bch_extent_crc_unpacked crc;
+    const struct bch_extent_ptr *ptr = NULL;
+    if (bch_val && bkey->type == KEY_TYPE_extent &&
+            (ptr = benz_bch_extent_first_ptr(bch_val, p_end, bkey->size, &crc)))
     {
         *file_offset = (bkey->p.offset - bkey->size) * BCH_SECTOR_SIZE;
-        *offset = benz_bch_get_extent_offset((const struct bch_extent_ptr*)bch_val);
+        *offset = benz_bch_get_extent_offset(ptr) +
+                  (_benz_bch_crc_compression(&crc) ? 0 : crc.offset * BCH_SECTOR_SIZE);
         *size = bkey->size * BCH_SECTOR_SIZE;
     }
     else if (bch_val && bkey->type == KEY_TYPE_inline_data)
@@ -411,6 +621,12 @@ struct bch_sb *benz_bch_realloc_sb(struct bch_sb *sb, uint64_t size)
     {
         size = benz_bch_get_sb_size(sb);
     }
+    if (size == 0)
+    {
+        // Not a superblock, realloc would free it and return NULL
+        free(sb);
+        return NULL;
+    }
     struct bch_sb *ret = realloc(sb, size);
     if (ret == NULL && sb)
     {
@@ -424,349 +640,4299 @@ inline struct btree_node *benz_bch_malloc_btree_node(const struct bch_sb *sb)
     return malloc(benz_bch_get_btree_node_size(sb));
 }
 
-uint64_t benz_bch_fread_sb(struct bch_sb *sb, uint64_t size, FILE *fp)
+// Reads `size` bytes at `offset` without touching the file position, so a
+// single descriptor can be shared between threads and forked processes.
+// Returns the number of bytes read, which is only short at the end of file or
+// on error
+uint64_t benz_pread(int fd, void *buf, uint64_t size, uint64_t offset)
+{
+    uint64_t done = 0;
+    while (done < size)
+    {
+        ssize_t ret = pread(fd, (uint8_t*)buf + done, size - done, (off_t)(offset + done));
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        done += (uint64_t)ret;
+    }
+    return done;
+}
+
+uint64_t benz_bch_pread_sb(struct bch_sb *sb, uint64_t size, int fd)
 {
     if (size == 0)
     {
         size = benz_bch_get_sb_size(NULL);
     }
-    fseek(fp, BCH_SB_SECTOR * BCH_SECTOR_SIZE, SEEK_SET);
-    return fread(sb, size, 1, fp);
+    return benz_pread(fd, sb, size, BCH_SB_SECTOR * BCH_SECTOR_SIZE) == size;
 }
 
-uint64_t benz_bch_fread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr, FILE *fp)
+uint64_t benz_bch_pread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr,
+                                   const struct bch_extent_ptr *ptr, int fd)
 {
-    uint64_t offset = benz_bch_get_extent_offset(btree_ptr->start);
-    fseek(fp, (long)offset, SEEK_SET);
+    uint64_t offset = benz_bch_get_extent_offset(ptr);
+    uint64_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
     memset(btree_node, 0, benz_bch_get_btree_node_size(sb));
-    return fread(btree_node, btree_ptr->sectors_written * BCH_SECTOR_SIZE, 1, fp);
+    return benz_pread(fd, btree_node, size, offset) == size;
 }
 
-// Filesystem and iterator abstraction layer
-// -----------------------------------------
-int Bcachefs_fini(Bcachefs *this)
-{
-    return Bcachefs_close(this);
-}
+// io_uring engine
+// ---------------
+//
+// Only what the batched reads need: a single ring shared by the readers of a
+// Bcachefs, serialized by a lock, and read requests retried with pread when
+// they fail or come back short, which also covers kernels without
+// IORING_OP_READ.
+#ifdef __NR_io_uring_setup
 
-int Bcachefs_open(Bcachefs *this, const char *path)
-{
-    *this = (Bcachefs){0};
+struct benz_uring {
+    int fd;
+    uint32_t sq_entries;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    pthread_mutex_t lock;
+    pid_t pid;                                  //! process which created the ring
+    int disabled;                               //! set once the ring could not be entered
+};
 
-    int ret = 0;
-    this->fp = fopen(path, "rb");
-    if (this->fp)
+// Returns NULL if the kernel does not support io_uring or forbids it
+struct benz_uring *benz_uring_new(uint32_t entries)
+{
+    struct io_uring_params params = {0};
+    struct benz_uring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 || pthread_mutex_init(&ring->lock, NULL))
     {
-        fseek(this->fp, 0L, SEEK_END);
-        this->size = ftell(this->fp);
-        fseek(this->fp, 0L, SEEK_SET);
-        this->sb = benz_bch_realloc_sb(NULL, 0);
+        if (ring->fd >= 0)
+        {
+            close(ring->fd);
+        }
+        free(ring);
+        return NULL;
     }
-    if (this->sb && benz_bch_fread_sb(this->sb, 0, this->fp))
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
     {
-        this->sb = benz_bch_realloc_sb(this->sb, 0);
-        ret = this->sb && benz_bch_fread_sb(this->sb, benz_bch_get_sb_size(this->sb),
-                                            this->fp);
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
     }
-    if (!ret)
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
     {
-        Bcachefs_fini(this);
+        ring->cq_ring = ring->sq_ring;
     }
-    return ret;
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        benz_uring_free(ring);
+        return NULL;
+    }
+    ring->sq_head = (void*)((uint8_t*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (void*)((uint8_t*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (void*)((uint8_t*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (void*)((uint8_t*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (void*)((uint8_t*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (void*)((uint8_t*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (void*)((uint8_t*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (void*)((uint8_t*)ring->cq_ring + params.cq_off.cqes);
+    ring->pid = getpid();
+    return ring;
 }
 
-int Bcachefs_close(Bcachefs *this)
+// The rings are shared with forked children, which would corrupt the queues
+// of their parent, only the process which created the ring uses it. Rings
+// which failed are not used anymore either
+int benz_uring_usable(const struct benz_uring *ring)
+{
+    return ring && !__atomic_load_n(&ring->disabled, __ATOMIC_RELAXED) && ring->pid == getpid();
+}
+
+void benz_uring_free(struct benz_uring *ring)
 {
-    if (this->fp && !fclose(this->fp))
+    if (ring == NULL)
     {
-        this->fp = NULL;
-        this->size = 0;
+        return;
     }
-    if (this->sb)
+    if (ring->sqes != MAP_FAILED)
     {
-        free(this->sb);
-        this->sb = NULL;
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
-    return this->fp == NULL && this->sb == NULL;
+    if (ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
 }
 
-int Bcachefs_iter(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type)
+// Replaces the buffers registered with the ring. Requests reading into a
+// registered buffer set its index in `buf_index` and skip the page pinning
+// done on every read otherwise
+int benz_uring_register_buffers(struct benz_uring *ring, const struct iovec *iovecs, uint32_t nr_iovecs)
 {
-    *iter = (Bcachefs_iterator){0};
-
-    iter->type = type;
-    iter->btree_node = benz_bch_malloc_btree_node(this->sb);
-    iter->jset_entry = Bcachefs_iter_next_jset_entry(this, iter);
-    iter->btree_ptr = Bcachefs_iter_next_btree_ptr(this, iter);
-    if (iter->btree_ptr && !benz_bch_fread_btree_node(iter->btree_node,
-                                                      this->sb,
-                                                      iter->btree_ptr,
-                                                      this->fp))
+    if (!benz_uring_usable(ring))
     {
-        iter->btree_ptr = NULL;
+        return 0;
     }
-    return iter->jset_entry && iter->btree_node && iter->btree_ptr;
+    pthread_mutex_lock(&ring->lock);
+    syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    int ret = nr_iovecs == 0 ||
+              syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, nr_iovecs) == 0;
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
 }
 
-int Bcachefs_next_iter(const Bcachefs *this, Bcachefs_iterator *iter, const struct bch_btree_ptr_v2 *btree_ptr)
+// Keeps up to the ring size of reads in flight until every request completed.
+// `fds` holds the file of each of the BCH_SB_MEMBERS_MAX devices, reads of
+// different devices are in flight together. Returns 1 if all the requests
+// were read in full. If the ring can not be entered anymore, the reads in
+// flight are still waited for, the ring is disabled and the remaining
+// requests are read with pread
+int benz_uring_pread_many(struct benz_uring *ring, const int *fds, Bcachefs_read_req *reqs, uint32_t nr_reqs)
 {
-    Bcachefs_iterator *next_it = malloc(sizeof(Bcachefs_iterator));
-
-    *next_it = (Bcachefs_iterator){
-        .type = iter->type,
-        .btree_node = benz_bch_malloc_btree_node(this->sb),
-        .btree_ptr = btree_ptr
-    };
+    uint32_t next = 0;
+    uint32_t unsubmitted = 0;
+    uint32_t inflight = 0;
+    int broken = 0;
+    int ret = 1;
 
-    if (next_it->btree_ptr && !benz_bch_fread_btree_node(next_it->btree_node,
-                                                         this->sb,
-                                                         next_it->btree_ptr,
-                                                         this->fp))
+    for (uint32_t i = 0; i < nr_reqs; ++i)
     {
-        next_it->btree_ptr = NULL;
+        reqs[i].result = 0;
     }
-
-    if (next_it->btree_node && next_it->btree_ptr)
+    if (!benz_uring_usable(ring))
     {
-        iter->next_it = next_it;
-        return 1;
+        goto pread;
     }
-    else
+    pthread_mutex_lock(&ring->lock);
+    // Checked again under the lock, another thread may have disabled the ring
+    broken = ring->disabled;
+    while ((next < nr_reqs && !broken) || inflight)
     {
-        Bcachefs_iter_fini(this, next_it);
-        free(next_it);
-        next_it = NULL;
-        return 0;
+        uint32_t tail = *ring->sq_tail;
+        const uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        for (; !broken && next < nr_reqs && inflight + unsubmitted < ring->sq_entries &&
+               tail - head < ring->sq_entries; ++next, ++tail, ++unsubmitted)
+        {
+            const Bcachefs_read_req *req = &reqs[next];
+            const uint32_t index = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = req->dev < BCH_SB_MEMBERS_MAX ? fds[req->dev] : -1;
+            sqe->off = req->offset;
+            sqe->addr = (uint64_t)(uintptr_t)req->buf;
+            sqe->len = (uint32_t)req->size;
+            sqe->buf_index = (uint16_t)(req->buf_index >= 0 ? req->buf_index : 0);
+            sqe->user_data = next;
+            ring->sq_array[index] = index;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        long submitted = -1;
+        if (!broken || inflight)
+        {
+            submitted = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, inflight + unsubmitted ? 1 : 0,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        if (submitted >= 0)
+        {
+            unsubmitted -= (uint32_t)submitted;
+            inflight += (uint32_t)submitted;
+        }
+        else if (broken)
+        {
+            // The kernel still completes the reads in flight into the
+            // buffers of the requests, poll the completions until they
+            // are all reaped
+            sched_yield();
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            // Take the queued entries back, they are read with pread below
+            broken = 1;
+            __atomic_store_n(&ring->disabled, 1, __ATOMIC_RELAXED);
+            next -= unsubmitted;
+            __atomic_store_n(ring->sq_tail, tail - unsubmitted, __ATOMIC_RELEASE);
+            unsubmitted = 0;
+        }
+
+        uint32_t cq_head = *ring->cq_head;
+        const uint32_t cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; cq_head != cq_tail; ++cq_head, --inflight)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[cq_head & *ring->cq_mask];
+            if (cqe->res > 0)
+            {
+                reqs[cqe->user_data].result = (uint64_t)cqe->res;
+            }
+        }
+        __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+pread:
+    for (uint32_t i = 0; ret && i < nr_reqs; ++i)
+    {
+        Bcachefs_read_req *req = &reqs[i];
+        if (req->result < req->size && req->dev < BCH_SB_MEMBERS_MAX)
+        {
+            req->result += benz_pread(fds[req->dev], (uint8_t*)req->buf + req->result, req->size - req->result,
+                                      req->offset + req->result);
+        }
+        ret = ret && req->result == req->size;
     }
+    return ret;
 }
 
-int Bcachefs_iter_fini(const Bcachefs *this, Bcachefs_iterator *iter)
+#else
+
+struct benz_uring *benz_uring_new(uint32_t entries)
 {
-    (void)this;
-    if (iter == NULL)
+    (void)entries;
+    return NULL;
+}
+
+void benz_uring_free(struct benz_uring *ring)
+{
+    (void)ring;
+}
+
+int benz_uring_usable(const struct benz_uring *ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int benz_uring_register_buffers(struct benz_uring *ring, const struct iovec *iovecs, uint32_t nr_iovecs)
+{
+    (void)ring;
+    (void)iovecs;
+    (void)nr_iovecs;
+    return 0;
+}
+
+int benz_uring_pread_many(struct benz_uring *ring, const int *fds, Bcachefs_read_req *reqs, uint32_t nr_reqs)
+{
+    (void)ring;
+    (void)fds;
+    (void)reqs;
+    (void)nr_reqs;
+    return 0;
+}
+
+#endif
+
+// Filesystem and iterator abstraction layer
+// -----------------------------------------
+int Bcachefs_fini(Bcachefs *this)
+{
+    return Bcachefs_close(this);
+}
+
+static uint64_t _Bcachefs_device_pread(Bcachefs_device device, void *buf, uint64_t size, uint64_t offset);
+
+// Reads the superblock of a device through its mapping or its file, returns
+// NULL if it can not be read
+static struct bch_sb *_Bcachefs_read_device_sb(Bcachefs_device device)
+{
+    const uint64_t offset = BCH_SB_SECTOR * BCH_SECTOR_SIZE;
+    uint64_t size = benz_bch_get_sb_size(NULL);
+    struct bch_sb *sb = benz_bch_realloc_sb(NULL, size);
+    if (sb && _Bcachefs_device_pread(device, sb, size, offset) == size)
     {
-        return 1;
+        sb = benz_bch_realloc_sb(sb, 0);
+        size = sb ? benz_bch_get_sb_size(sb) : 0;
+        if (sb && _Bcachefs_device_pread(device, sb, size, offset) == size)
+        {
+            return sb;
+        }
     }
-    if (iter->next_it && Bcachefs_iter_fini(this, iter->next_it))
+    free(sb);
+    return NULL;
+}
+
+static void _Bcachefs_close_device(Bcachefs_device *device)
+{
+    if (device->map)
     {
-        free(iter->next_it);
-        iter->next_it = NULL;
+        munmap((void*)device->map, (size_t)device->size);
     }
-    if (iter->btree_node)
+    if (device->fd >= 0)
     {
-        free(iter->btree_node);
-        iter->btree_node = NULL;
+        close(device->fd);
     }
-    *iter = (Bcachefs_iterator){
-        .type = BTREE_ID_NR,
-        .btree_node = iter->btree_node,
-        .next_it = iter->next_it
-    };
-    return iter->next_it == NULL && iter->btree_node == NULL;
+    *device = (Bcachefs_device){.fd = -1};
 }
 
-const struct bch_val *_Bcachefs_iter_next_bch_val(const struct bkey *bkey, const struct bkey_format* format)
+// Size of the image in `fd`. st_size is 0 for block devices, their size is
+// asked to the device, which unlike seeking leaves the file position alone
+static int _benz_fd_size(int fd, long *size)
 {
-    uint8_t key_u64s = 0;
-    if (bkey == NULL)
+    struct stat st;
+    uint64_t bytes = 0;
+    if (fstat(fd, &st) != 0)
     {
-        return NULL;
+        return 0;
     }
-    if (bkey->format == KEY_FORMAT_LOCAL_BTREE)
+    if (!S_ISBLK(st.st_mode))
     {
-        key_u64s = format->key_u64s;
+        *size = (long)st.st_size;
+        return 1;
     }
-    else
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0)
     {
-        key_u64s = BKEY_U64s;
+        return 0;
     }
-    return benz_bch_first_bch_val(bkey, key_u64s);
+    *size = (long)bytes;
+    return 1;
 }
 
-const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator *iter)
+// Sets up one image of the filesystem from its file `fd`, which the device
+// takes over, optionally mapped in memory, and reads its superblock. An image
+// which can't be mapped, like under an address space limit, is read with
+// pread instead. Returns the superblock, or NULL with nothing left open
+static struct bch_sb *_Bcachefs_open_device_fd(Bcachefs_device *device, int fd, int map)
 {
-    const struct bkey *bkey = NULL;
-    const struct bch_val *bch_val = NULL;
-
-    // Wind to current iterator
-    if (iter->next_it)
+    struct bch_sb *sb = NULL;
+    *device = (Bcachefs_device){.fd = fd};
+    if (device->fd >= 0 && _benz_fd_size(device->fd, &device->size))
     {
-        bch_val = Bcachefs_iter_next(this, iter->next_it);
-        if (bch_val)
-        {
-            return bch_val;
-        }
-        else
+        if (map)
         {
-            Bcachefs_iter_fini(this, iter->next_it);
-            free(iter->next_it);
-            iter->next_it = NULL;
+            void *addr = mmap(NULL, (size_t)device->size, PROT_READ, MAP_SHARED,
+                              device->fd, 0);
+            device->map = addr == MAP_FAILED ? NULL : addr;
         }
+        sb = _Bcachefs_read_device_sb(*device);
     }
-    if (iter->bset == NULL && iter->btree_ptr)
+    if (sb == NULL)
     {
-        iter->bset = Bcachefs_iter_next_bset(this, iter);
+        _Bcachefs_close_device(device);
     }
-    if (iter->btree_ptr && iter->bset) {}
-    else
+    return sb;
+}
+
+// Opens one image of the filesystem, optionally mapped in memory, and reads
+// its superblock. Returns the superblock, or NULL with nothing left open
+static struct bch_sb *_Bcachefs_open_device(Bcachefs_device *device, const char *path, int map)
+{
+    return _Bcachefs_open_device_fd(device, open(path, O_RDONLY | O_CLOEXEC), map);
+}
+
+// Takes over `device` as the image holding the btrees, `sb` being its
+// superblock. Fails with nothing left open if `sb` is NULL
+static int _Bcachefs_init(Bcachefs *this, struct bch_sb *sb, Bcachefs_device device)
+{
+    *this = (Bcachefs){.fd = device.fd, .size = device.size, .sb = sb, .map = device.map,
+                       .readahead = BCACHEFS_READAHEAD};
+    int ret = this->sb != NULL;
+    if (ret && this->map == NULL)
     {
-        return NULL;
+        this->cache = benz_bch_node_cache_new(benz_bch_get_btree_node_size(this->sb),
+                                              BCACHEFS_NODE_CACHE_SIZE);
+        ret = this->cache != NULL;
     }
-    do
+    if (ret)
     {
-        iter->bkey = benz_bch_next_bkey(iter->bset, iter->bkey, KEY_TYPE_MAX);
-        bch_val = _Bcachefs_iter_next_bch_val(iter->bkey, &iter->btree_node->format);
-    } while (iter->bkey && bch_val == NULL);
-    bkey = iter->bkey;
-    switch ((int)iter->type)
+        this->load = calloc(1, sizeof(Bcachefs_read_load));
+        this->reflink = benz_bch_reflink_cache_new(BCACHEFS_REFLINK_CACHE_SIZE);
+        ret = this->load != NULL && this->reflink != NULL;
+    }
+    if (!ret)
     {
-    case BTREE_ID_extents:
-    case BTREE_ID_inodes:
-    case BTREE_ID_dirents:
-        iter->bch_val = bch_val;
-        if (bch_val && bkey->type == KEY_TYPE_btree_ptr_v2 &&
-                Bcachefs_next_iter(this, iter, (const struct bch_btree_ptr_v2*)bch_val))
-        {
-            return Bcachefs_iter_next(this, iter);
+        Bcachefs_fini(this);
+    }
+    return ret;
+}
+
+int _Bcachefs_open(Bcachefs *this, const char *path, int map)
+{
+    Bcachefs_device device;
+    struct bch_sb *sb = _Bcachefs_open_device(&device, path, map);
+    return _Bcachefs_init(this, sb, device);
+}
+
+int Bcachefs_open(Bcachefs *this, const char *path)
+{
+    return _Bcachefs_open(this, path, 0);
+}
+
+// Open the image and map it in memory. Btree nodes are then accessed in place
+// by the iterators instead of being copied into a buffer, so the node cache
+// is not used. Falls back to pread if the image can't be mapped
+int Bcachefs_open_mmap(Bcachefs *this, const char *path)
+{
+    return _Bcachefs_open(this, path, 1);
+}
+
+// The filesystem reads through a duplicate of `fd`, which stays the caller's
+static int _Bcachefs_open_fd(Bcachefs *this, int fd, int map)
+{
+    Bcachefs_device device;
+    struct bch_sb *sb = _Bcachefs_open_device_fd(&device, fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1, map);
+    return _Bcachefs_init(this, sb, device);
+}
+
+// Open the image from a file the caller already opened, like a memfd or a
+// file of a tmpfs. The position of `fd` is never used
+int Bcachefs_open_fd(Bcachefs *this, int fd)
+{
+    return _Bcachefs_open_fd(this, fd, 0);
+}
+
+int Bcachefs_open_fd_mmap(Bcachefs *this, int fd)
+{
+    return _Bcachefs_open_fd(this, fd, 1);
+}
+
+// Open an image which is already in memory. It is accessed in place like a
+// mapped image, the memory must outlive the filesystem and is left to the
+// caller by Bcachefs_close
+int Bcachefs_open_memory(Bcachefs *this, const void *data, uint64_t size)
+{
+    const Bcachefs_device device = {.fd = -1, .size = (long)size, .map = data};
+    return _Bcachefs_init(this, _Bcachefs_read_device_sb(device), device);
+}
+
+// Number of members listed in the members field of a superblock
+static uint32_t _benz_bch_nr_members(const struct bch_sb_field_members *members)
+{
+    if (members == NULL || members->field.u64s * BCH_U64S_SIZE < sizeof(*members))
+    {
+        return 0;
+    }
+    return (uint32_t)((members->field.u64s * BCH_U64S_SIZE - sizeof(*members)) / sizeof(struct bch_member));
+}
+
+// A device is a member of the filesystem if it carries the filesystem UUID
+// and the UUID of its member slot is the one the filesystem knows
+static int _Bcachefs_is_member(const Bcachefs *this, const struct bch_sb *sb)
+{
+    static const struct uuid zero_uuid = {{0}};
+    const struct bch_sb_field_members *members =
+        (const void*)benz_bch_next_sb_field(this->sb, NULL, BCH_SB_FIELD_members);
+    const struct bch_sb_field_members *sb_members =
+        (const void*)benz_bch_next_sb_field(sb, NULL, BCH_SB_FIELD_members);
+    const uint8_t dev = sb->dev_idx;
+    return memcmp(&sb->uuid, &this->sb->uuid, sizeof(struct uuid)) == 0 &&
+           dev < BCH_SB_MEMBERS_MAX && dev < _benz_bch_nr_members(members) &&
+           dev < _benz_bch_nr_members(sb_members) &&
+           memcmp(&members->members[dev].uuid, &zero_uuid, sizeof(struct uuid)) != 0 &&
+           memcmp(&members->members[dev].uuid, &sb_members->members[dev].uuid, sizeof(struct uuid)) == 0;
+}
+
+// Opens a filesystem spread over several images, one per member device, in
+// any order. The first image provides the superblock and the btrees, the
+// others are matched to their member slot by UUID. Missing members are
+// allowed, their extents are read from the other replicas
+static int _Bcachefs_open_multi(Bcachefs *this, const char *const *paths, uint32_t nr_paths, int map)
+{
+    if (nr_paths == 0 || !_Bcachefs_open(this, paths[0], map))
+    {
+        return 0;
+    }
+
+    int ret = this->sb->dev_idx < BCH_SB_MEMBERS_MAX;
+    if (ret)
+    {
+        this->devices = malloc(BCH_SB_MEMBERS_MAX * sizeof(Bcachefs_device));
+        ret = this->devices != NULL;
+    }
+    for (uint32_t dev = 0; ret && dev < BCH_SB_MEMBERS_MAX; ++dev)
+    {
+        this->devices[dev] = (Bcachefs_device){.fd = -1};
+    }
+    if (ret)
+    {
+        // Borrowed from the image, it is closed with it
+        this->devices[this->sb->dev_idx] = (Bcachefs_device){.fd = this->fd, .size = this->size, .map = this->map};
+    }
+    for (uint32_t i = 1; ret && i < nr_paths; ++i)
+    {
+        Bcachefs_device device;
+        struct bch_sb *sb = _Bcachefs_open_device(&device, paths[i], map);
+        ret = sb && _Bcachefs_is_member(this, sb) && this->devices[sb->dev_idx].fd < 0;
+        if (ret)
+        {
+            this->devices[sb->dev_idx] = device;
+        }
+        else
+        {
+            _Bcachefs_close_device(&device);
+        }
+        free(sb);
+    }
+    if (!ret)
+    {
+        Bcachefs_fini(this);
+    }
+    return ret;
+}
+
+int Bcachefs_open_multi(Bcachefs *this, const char *const *paths, uint32_t nr_paths)
+{
+    return _Bcachefs_open_multi(this, paths, nr_paths, 0);
+}
+
+int Bcachefs_open_multi_mmap(Bcachefs *this, const char *const *paths, uint32_t nr_paths)
+{
+    return _Bcachefs_open_multi(this, paths, nr_paths, 1);
+}
+
+int Bcachefs_close(Bcachefs *this)
+{
+    for (uint32_t dev = 0; this->devices && dev < BCH_SB_MEMBERS_MAX; ++dev)
+    {
+        if (this->devices[dev].fd != this->fd)
+        {
+            _Bcachefs_close_device(&this->devices[dev]);
+        }
+    }
+    free(this->devices);
+    this->devices = NULL;
+    benz_uring_free(this->uring);
+    this->uring = NULL;
+    // Images opened from memory have no file and were not mapped here
+    if (this->map && (this->fd < 0 || !munmap((void*)this->map, (size_t)this->size)))
+    {
+        this->map = NULL;
+    }
+    if (this->fd >= 0 && !close(this->fd))
+    {
+        this->fd = -1;
+        this->size = 0;
+    }
+    if (this->sb)
+    {
+        free(this->sb);
+        this->sb = NULL;
+    }
+    benz_bch_node_cache_free(this->cache);
+    this->cache = NULL;
+    free(this->load);
+    this->load = NULL;
+    benz_bch_reflink_cache_free(this->reflink);
+    this->reflink = NULL;
+    return this->fd < 0 && this->sb == NULL && this->map == NULL;
+}
+
+// Member holding device `dev`, only the image itself unless the filesystem
+// was opened with Bcachefs_open_multi
+static inline Bcachefs_device _Bcachefs_device(const Bcachefs *this, uint8_t dev)
+{
+    if (this->devices == NULL)
+    {
+        return this->sb == NULL || dev == this->sb->dev_idx ?
+               (Bcachefs_device){.fd = this->fd, .size = this->size, .map = this->map} :
+               (Bcachefs_device){.fd = -1};
+    }
+    return dev < BCH_SB_MEMBERS_MAX ? this->devices[dev] : (Bcachefs_device){.fd = -1};
+}
+
+// Whether the data of device `dev` can be read
+int Bcachefs_has_dev(const Bcachefs *this, uint8_t dev)
+{
+    if (this->devices == NULL)
+    {
+        return this->sb && dev == this->sb->dev_idx;
+    }
+    return dev < BCH_SB_MEMBERS_MAX && this->devices[dev].fd >= 0;
+}
+
+static const void *_Bcachefs_device_map_range(Bcachefs_device device, uint64_t offset, uint64_t size)
+{
+    if (device.map == NULL || offset > (uint64_t)device.size ||
+            size > (uint64_t)device.size - offset)
+    {
+        return NULL;
+    }
+    return device.map + offset;
+}
+
+// Returns a pointer to `size` bytes located at `offset` in the image mapping,
+// or NULL if the image is not mapped or the range is out of bounds
+const void *Bcachefs_map_range(const Bcachefs *this, uint64_t offset, uint64_t size)
+{
+    return _Bcachefs_device_map_range((Bcachefs_device){.fd = this->fd, .size = this->size, .map = this->map},
+                                      offset, size);
+}
+
+// Same as Bcachefs_map_range in the mapping of device `dev`
+const void *Bcachefs_map_range_dev(const Bcachefs *this, uint8_t dev, uint64_t offset, uint64_t size)
+{
+    return _Bcachefs_device_map_range(_Bcachefs_device(this, dev), offset, size);
+}
+
+static uint64_t _Bcachefs_device_pread(Bcachefs_device device, void *buf, uint64_t size, uint64_t offset)
+{
+    if (device.map)
+    {
+        if (offset >= (uint64_t)device.size)
+        {
+            return 0;
+        }
+        if (size > (uint64_t)device.size - offset)
+        {
+            size = (uint64_t)device.size - offset;
+        }
+        memcpy(buf, device.map + offset, size);
+        return size;
+    }
+    return device.fd >= 0 ? benz_pread(device.fd, buf, size, offset) : 0;
+}
+
+// Positional read from the image, served from the mapping when there is one.
+// Safe to call concurrently from any number of threads
+uint64_t Bcachefs_pread(const Bcachefs *this, void *buf, uint64_t size, uint64_t offset)
+{
+    return _Bcachefs_device_pread((Bcachefs_device){.fd = this->fd, .size = this->size, .map = this->map},
+                                  buf, size, offset);
+}
+
+// Same as Bcachefs_pread from device `dev`
+uint64_t Bcachefs_pread_dev(const Bcachefs *this, uint8_t dev, void *buf, uint64_t size, uint64_t offset)
+{
+    return _Bcachefs_device_pread(_Bcachefs_device(this, dev), buf, size, offset);
+}
+
+typedef struct {
+    const Bcachefs *fs;
+    Bcachefs_read_req *reqs;
+    uint32_t nr_reqs;
+    uint8_t dev;                                //! only the requests of this device are read
+    int ret;
+} _Bcachefs_device_reads;
+
+static void *_Bcachefs_device_reads_worker(void *arg)
+{
+    _Bcachefs_device_reads *reads = arg;
+    reads->ret = 1;
+    for (uint32_t i = 0; i < reads->nr_reqs; ++i)
+    {
+        Bcachefs_read_req *req = &reads->reqs[i];
+        if (req->dev == reads->dev)
+        {
+            req->result = Bcachefs_pread_dev(reads->fs, req->dev, req->buf, req->size, req->offset);
+            reads->ret = reads->ret && req->result == req->size;
+        }
+    }
+    return NULL;
+}
+
+// Reads the requests of each device of the `devs` mask on a thread of its own
+// so the devices serve their share of the batch concurrently
+static int _Bcachefs_pread_many_devices(const Bcachefs *this, Bcachefs_read_req *reqs, uint32_t nr_reqs, uint64_t devs)
+{
+    _Bcachefs_device_reads reads[BCH_SB_MEMBERS_MAX] = {{0}};
+    pthread_t threads[BCH_SB_MEMBERS_MAX];
+    int started[BCH_SB_MEMBERS_MAX] = {0};
+    uint32_t nr_reads = 0;
+    int ret = 1;
+    for (; devs; devs &= devs - 1)
+    {
+        reads[nr_reads++] = (_Bcachefs_device_reads){.fs = this, .reqs = reqs, .nr_reqs = nr_reqs,
+                                                     .dev = (uint8_t)__builtin_ctzll(devs)};
+    }
+    for (uint32_t i = 1; i < nr_reads; ++i)
+    {
+        started[i] = pthread_create(&threads[i], NULL, _Bcachefs_device_reads_worker, &reads[i]) == 0;
+    }
+    _Bcachefs_device_reads_worker(&reads[0]);
+    for (uint32_t i = 1; i < nr_reads; ++i)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        else
+        {
+            // Fallback to reading on the calling thread
+            _Bcachefs_device_reads_worker(&reads[i]);
+        }
+    }
+    for (uint32_t i = 0; i < nr_reads; ++i)
+    {
+        ret = ret && reads[i].ret;
+    }
+    for (uint32_t i = 0; i < nr_reqs; ++i)
+    {
+        if (reqs[i].dev >= BCH_SB_MEMBERS_MAX)
+        {
+            reqs[i].result = 0;
+            ret = 0;
+        }
+    }
+    return ret;
+}
+
+// Reads a batch of ranges of the image, or of the member devices, through
+// io_uring when enabled so the reads are in flight together. Without io_uring
+// each member device is read by a thread of its own. Returns 1 if all the
+// requests were read in full, `result` holds what was read for each of them
+int Bcachefs_pread_many(const Bcachefs *this, Bcachefs_read_req *reqs, uint32_t nr_reqs)
+{
+    int ret = 1;
+    if (benz_uring_usable(this->uring) && !this->map)
+    {
+        int fds[BCH_SB_MEMBERS_MAX];
+        for (uint32_t dev = 0; dev < BCH_SB_MEMBERS_MAX; ++dev)
+        {
+            fds[dev] = _Bcachefs_device(this, (uint8_t)dev).fd;
+        }
+        return benz_uring_pread_many(this->uring, fds, reqs, nr_reqs);
+    }
+    if (this->devices && nr_reqs > 1)
+    {
+        uint64_t devs = 0;
+        for (uint32_t i = 0; i < nr_reqs; ++i)
+        {
+            devs |= reqs[i].dev < BCH_SB_MEMBERS_MAX ? 1ULL << reqs[i].dev : 0;
+        }
+        if (__builtin_popcountll(devs) > 1)
+        {
+            return _Bcachefs_pread_many_devices(this, reqs, nr_reqs, devs);
+        }
+    }
+    for (uint32_t i = 0; i < nr_reqs; ++i)
+    {
+        reqs[i].result = Bcachefs_pread_dev(this, reqs[i].dev, reqs[i].buf, reqs[i].size, reqs[i].offset);
+        ret = ret && reqs[i].result == reqs[i].size;
+    }
+    return ret;
+}
+
+// Switches the batched reads to an io_uring of `entries` entries. Returns 0,
+// and keeps reading with pread, if io_uring is not available
+int Bcachefs_enable_uring(Bcachefs *this, uint32_t entries)
+{
+    if (this->uring == NULL)
+    {
+        this->uring = benz_uring_new(entries ? entries : BCACHEFS_URING_ENTRIES);
+    }
+    return this->uring != NULL;
+}
+
+int Bcachefs_register_buffers(Bcachefs *this, const struct iovec *iovecs, uint32_t nr_iovecs)
+{
+    return this->uring && benz_uring_register_buffers(this->uring, iovecs, nr_iovecs);
+}
+
+// Btree node cache
+// ----------------
+//
+// Entries are chained in hash buckets and in a circular LRU list. Entries in
+// use by an iterator are pinned (refs > 0) and never evicted, unpinned
+// entries are recycled from the least recently used end once the budget is
+// reached, so a warm cache does not allocate anymore.
+struct Bcachefs_cache_entry {
+    uint64_t offset;
+    uint64_t seq;
+    uint64_t refs;
+    struct Bcachefs_cache_entry *hash_next;
+    struct Bcachefs_cache_entry *lru_prev;
+    struct Bcachefs_cache_entry *lru_next;
+    uint64_t _data[];                           //! btree node
+};
+
+static struct Bcachefs_cache_entry *_cache_entry_of(const struct btree_node *btree_node)
+{
+    return (void*)((const uint8_t*)btree_node - offsetof(struct Bcachefs_cache_entry, _data));
+}
+
+// Mixes two keys into a hash whose high bits are well distributed
+static inline uint64_t _hash_mix(uint64_t a, uint64_t b)
+{
+    return ((a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL) >> 32;
+}
+
+static uint64_t _cache_bucket(const Bcachefs_node_cache *cache, uint64_t offset, uint64_t seq)
+{
+    return _hash_mix(offset, seq) & (cache->nr_buckets - 1);
+}
+
+static void _cache_lru_unlink(Bcachefs_node_cache *cache, struct Bcachefs_cache_entry *entry)
+{
+    if (entry->lru_next == entry)
+    {
+        cache->lru = NULL;
+    }
+    else
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+        entry->lru_next->lru_prev = entry->lru_prev;
+        if (cache->lru == entry)
+        {
+            cache->lru = entry->lru_next;
+        }
+    }
+    entry->lru_prev = entry->lru_next = entry;
+}
+
+// Inserts at the most recently used end of the list
+static void _cache_lru_push(Bcachefs_node_cache *cache, struct Bcachefs_cache_entry *entry)
+{
+    if (cache->lru == NULL)
+    {
+        entry->lru_prev = entry->lru_next = entry;
+        cache->lru = entry;
+    }
+    else
+    {
+        entry->lru_next = cache->lru;
+        entry->lru_prev = cache->lru->lru_prev;
+        entry->lru_prev->lru_next = entry;
+        cache->lru->lru_prev = entry;
+    }
+}
+
+static void _cache_hash_unlink(Bcachefs_node_cache *cache, struct Bcachefs_cache_entry *entry)
+{
+    struct Bcachefs_cache_entry **c = &cache->buckets[_cache_bucket(cache, entry->offset, entry->seq)];
+    for (; *c && *c != entry; c = &(*c)->hash_next) {}
+    if (*c)
+    {
+        *c = entry->hash_next;
+    }
+    entry->hash_next = NULL;
+}
+
+// Removes the least recently used unpinned entry from the cache and returns
+// it, or NULL if every entry is pinned
+static struct Bcachefs_cache_entry *_cache_evict(Bcachefs_node_cache *cache)
+{
+    struct Bcachefs_cache_entry *entry = cache->lru;
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    do
+    {
+        if (entry->refs == 0)
+        {
+            _cache_lru_unlink(cache, entry);
+            _cache_hash_unlink(cache, entry);
+            cache->size -= cache->node_size;
+            return entry;
+        }
+        entry = entry->lru_next;
+    } while (entry != cache->lru);
+    return NULL;
+}
+
+static int _cache_resize_buckets(Bcachefs_node_cache *cache)
+{
+    uint64_t nr_buckets = 256;
+    while (nr_buckets * cache->node_size < cache->capacity)
+    {
+        nr_buckets <<= 1;
+    }
+    if (nr_buckets <= cache->nr_buckets)
+    {
+        return 1;
+    }
+    struct Bcachefs_cache_entry **buckets = calloc(nr_buckets, sizeof(*buckets));
+    if (buckets == NULL)
+    {
+        return 0;
+    }
+    struct Bcachefs_cache_entry **old_buckets = cache->buckets;
+    uint64_t old_nr_buckets = cache->nr_buckets;
+    cache->buckets = buckets;
+    cache->nr_buckets = nr_buckets;
+    for (uint64_t i = 0; i < old_nr_buckets; ++i)
+    {
+        struct Bcachefs_cache_entry *entry = old_buckets[i];
+        while (entry)
+        {
+            struct Bcachefs_cache_entry *next = entry->hash_next;
+            uint64_t bucket = _cache_bucket(cache, entry->offset, entry->seq);
+            entry->hash_next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+    return 1;
+}
+
+Bcachefs_node_cache *benz_bch_node_cache_new(uint64_t node_size, uint64_t capacity)
+{
+    Bcachefs_node_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->node_size = node_size;
+    cache->capacity = capacity;
+    if (pthread_mutex_init(&cache->lock, NULL) || !_cache_resize_buckets(cache))
+    {
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void benz_bch_node_cache_free(Bcachefs_node_cache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    while (cache->lru)
+    {
+        struct Bcachefs_cache_entry *entry = cache->lru;
+        _cache_lru_unlink(cache, entry);
+        free(entry);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+// Replica a btree node is read from: the first of its pointers on a device
+// which is present. `end` is the end of the value of the key holding
+// `btree_ptr`, which bounds its pointers. Returns NULL if none of the devices
+// is present
+const struct bch_extent_ptr *Bcachefs_node_replica(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                                                   const void *end)
+{
+    for (const struct bch_extent_ptr *ptr = btree_ptr->start;
+         (const void*)(ptr + 1) <= end && ptr->type;
+         ++ptr)
+    {
+        if (Bcachefs_has_dev(this, ptr->dev))
+        {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+// Returns the btree node referenced by `btree_ptr`, read from its replica
+// `ptr`. The node is taken from the image mapping or the node cache when
+// possible, otherwise it is read in `*buffer`, which is allocated on first use
+// and owned by the caller. Every node must be released with `Bcachefs_node_put`
+const struct btree_node *Bcachefs_node_get(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                                           const struct bch_extent_ptr *ptr, struct btree_node **buffer)
+{
+    uint64_t offset = benz_bch_get_extent_offset(ptr);
+    uint64_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    Bcachefs_node_cache *cache = this->cache;
+
+    const int fd = _Bcachefs_device(this, ptr->dev).fd;
+
+    if (this->map)
+    {
+        return Bcachefs_map_range_dev(this, ptr->dev, offset, size);
+    }
+    if (cache == NULL || cache->capacity == 0)
+    {
+        if (*buffer == NULL)
+        {
+            *buffer = benz_bch_malloc_btree_node(this->sb);
+        }
+        if (*buffer && benz_bch_pread_btree_node(*buffer, this->sb, btree_ptr, ptr, fd))
+        {
+            return *buffer;
+        }
+        return NULL;
+    }
+
+    struct Bcachefs_cache_entry *entry = NULL;
+    pthread_mutex_lock(&cache->lock);
+    for (entry = cache->buckets[_cache_bucket(cache, offset, btree_ptr->seq)];
+         entry && (entry->offset != offset || entry->seq != btree_ptr->seq);
+         entry = entry->hash_next) {}
+    if (entry)
+    {
+        cache->hits += 1;
+        entry->refs += 1;
+        _cache_lru_unlink(cache, entry);
+        _cache_lru_push(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        return (const void*)entry->_data;
+    }
+    cache->misses += 1;
+    if (cache->size + cache->node_size > cache->capacity)
+    {
+        entry = _cache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Read outside of the lock so other readers are not held by the I/O
+    if (entry == NULL)
+    {
+        entry = malloc(sizeof(*entry) + cache->node_size);
+    }
+    if (entry == NULL || !benz_bch_pread_btree_node((void*)entry->_data, this->sb, btree_ptr, ptr, fd))
+    {
+        free(entry);
+        return NULL;
+    }
+    *entry = (struct Bcachefs_cache_entry){.offset = offset, .seq = btree_ptr->seq, .refs = 1};
+
+    pthread_mutex_lock(&cache->lock);
+    struct Bcachefs_cache_entry **bucket = &cache->buckets[_cache_bucket(cache, offset, btree_ptr->seq)];
+    struct Bcachefs_cache_entry *other = *bucket;
+    for (; other && (other->offset != offset || other->seq != btree_ptr->seq);
+         other = other->hash_next) {}
+    if (other)
+    {
+        // Another reader loaded the same node in the meantime
+        other->refs += 1;
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+        return (const void*)other->_data;
+    }
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    _cache_lru_push(cache, entry);
+    cache->size += cache->node_size;
+    pthread_mutex_unlock(&cache->lock);
+    return (const void*)entry->_data;
+}
+
+// Releases a node returned by `Bcachefs_node_get`. `buffer` is the caller
+// buffer that was passed to `Bcachefs_node_get`
+void Bcachefs_node_put(const Bcachefs *this, const struct btree_node *btree_node, const struct btree_node *buffer)
+{
+    Bcachefs_node_cache *cache = this->cache;
+    if (btree_node == NULL || btree_node == buffer || this->map || cache == NULL)
+    {
+        return;
+    }
+    struct Bcachefs_cache_entry *entry = _cache_entry_of(btree_node);
+    pthread_mutex_lock(&cache->lock);
+    entry->refs -= 1;
+    // Shrink back to the budget once nodes pinned over it are released
+    while (cache->size > cache->capacity && (entry = _cache_evict(cache)))
+    {
+        free(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Loads the nodes missing from the cache with a single batch of reads, the
+// nodes are left unpinned in the cache for the iterators to pick up. Each
+// node is read from the replica of the same index in `ptrs`. Only nodes
+// fitting in the cache budget are loaded. Returns 0 when there is no cache to
+// load the nodes into
+int Bcachefs_node_prefetch(const Bcachefs *this, const struct bch_btree_ptr_v2 *const *btree_ptrs,
+                           const struct bch_extent_ptr *const *ptrs, uint32_t nr_ptrs)
+{
+    Bcachefs_node_cache *cache = this->cache;
+    struct Bcachefs_cache_entry *entries[BCACHEFS_PREFETCH_MAX];
+    const struct bch_btree_ptr_v2 *to_read[BCACHEFS_PREFETCH_MAX];
+    const struct bch_extent_ptr *replicas[BCACHEFS_PREFETCH_MAX];
+    Bcachefs_read_req reqs[BCACHEFS_PREFETCH_MAX];
+    uint32_t nr = 0;
+    if (this->map || cache == NULL)
+    {
+        return 0;
+    }
+    if (nr_ptrs > BCACHEFS_PREFETCH_MAX)
+    {
+        nr_ptrs = BCACHEFS_PREFETCH_MAX;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->capacity == 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    for (uint32_t i = 0; i < nr_ptrs; ++i)
+    {
+        const struct bch_btree_ptr_v2 *btree_ptr = btree_ptrs[i];
+        const uint64_t offset = benz_bch_get_extent_offset(ptrs[i]);
+        struct Bcachefs_cache_entry *entry = cache->buckets[_cache_bucket(cache, offset, btree_ptr->seq)];
+        for (; entry && (entry->offset != offset || entry->seq != btree_ptr->seq); entry = entry->hash_next) {}
+        if (entry)
+        {
+            continue;
+        }
+        if (cache->size + (nr + 1) * cache->node_size > cache->capacity &&
+                (entry = _cache_evict(cache)) == NULL)
+        {
+            break;
+        }
+        entries[nr] = entry;
+        replicas[nr] = ptrs[i];
+        to_read[nr++] = btree_ptr;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    for (uint32_t i = 0; i < nr; ++i)
+    {
+        if (entries[i] == NULL)
+        {
+            entries[i] = malloc(sizeof(struct Bcachefs_cache_entry) + cache->node_size);
+        }
+        reqs[i] = (Bcachefs_read_req){.buf = entries[i] ? (void*)entries[i]->_data : NULL,
+                                      .size = entries[i] ? to_read[i]->sectors_written * BCH_SECTOR_SIZE : 0,
+                                      .offset = benz_bch_get_extent_offset(replicas[i]),
+                                      .buf_index = -1,
+                                      .dev = replicas[i]->dev};
+        if (entries[i])
+        {
+            memset(entries[i]->_data, 0, cache->node_size);
+        }
+    }
+    Bcachefs_pread_many(this, reqs, nr);
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < nr; ++i)
+    {
+        struct Bcachefs_cache_entry *entry = entries[i];
+        const uint64_t offset = reqs[i].offset;
+        const uint64_t seq = to_read[i]->seq;
+        if (entry == NULL)
+        {
+            continue;
+        }
+        struct Bcachefs_cache_entry **bucket = &cache->buckets[_cache_bucket(cache, offset, seq)];
+        struct Bcachefs_cache_entry *other = *bucket;
+        for (; other && (other->offset != offset || other->seq != seq); other = other->hash_next) {}
+        // Drop failed reads and nodes a reader loaded in the meantime
+        if (other || reqs[i].result != reqs[i].size || reqs[i].size == 0)
+        {
+            free(entry);
+            continue;
+        }
+        *entry = (struct Bcachefs_cache_entry){.offset = offset, .seq = seq};
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        _cache_lru_push(cache, entry);
+        cache->size += cache->node_size;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+// Changes the memory budget of the node cache, 0 disables caching. Unpinned
+// nodes over the new budget are released right away
+int Bcachefs_set_cache_size(Bcachefs *this, uint64_t capacity)
+{
+    Bcachefs_node_cache *cache = this->cache;
+    if (cache == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache->capacity = capacity;
+    int ret = _cache_resize_buckets(cache);
+    struct Bcachefs_cache_entry *entry = NULL;
+    while (cache->size > cache->capacity && (entry = _cache_evict(cache)))
+    {
+        free(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+Bcachefs_cache_stats Bcachefs_get_cache_stats(const Bcachefs *this)
+{
+    Bcachefs_cache_stats stats = {0};
+    Bcachefs_node_cache *cache = this->cache;
+    if (cache)
+    {
+        pthread_mutex_lock(&cache->lock);
+        stats = (Bcachefs_cache_stats){.hits = cache->hits,
+                                       .misses = cache->misses,
+                                       .size = cache->size,
+                                       .capacity = cache->capacity};
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return stats;
+}
+
+// Reflink cache
+// -------------
+
+// Part of the range referenced by a reflink_p key covered by one indirect
+// extent, holes of the range have no piece
+typedef struct {
+    uint64_t start;                             //! sectors from the start of the reflink_p key
+    uint64_t size;                              //! sectors
+    uint32_t first_ptr;                         //! index of the first pointer of the piece in the entry
+    uint32_t nr_ptrs;                           //! 0 for indirect inline data
+    uint64_t inline_offset;                     //! location of indirect inline data in its device
+    uint64_t inline_size;                       //! bytes of indirect inline data
+    uint8_t inline_dev;
+} _Bcachefs_reflink_piece;
+
+// Pointers of the pieces are trimmed to the part of the indirect extent they
+// reference, the same way a key trimmed at the front is
+struct Bcachefs_reflink_entry {
+    uint64_t idx;
+    uint64_t size;
+    uint64_t bytes;                             //! memory held by the entry
+    struct Bcachefs_reflink_entry *hash_next;
+    uint32_t nr_pieces;
+    uint32_t nr_ptrs;
+    _Bcachefs_reflink_piece *pieces;
+    Bcachefs_extent_ptr *ptrs;
+};
+
+static uint64_t _reflink_bucket(const Bcachefs_reflink_cache *cache, uint64_t idx, uint64_t size)
+{
+    return _hash_mix(idx, size) & (cache->nr_buckets - 1);
+}
+
+Bcachefs_reflink_cache *benz_bch_reflink_cache_new(uint64_t capacity)
+{
+    Bcachefs_reflink_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->capacity = capacity;
+    // About one bucket per KiB of entries, which hold a piece or two
+    for (cache->nr_buckets = 64; cache->nr_buckets < capacity >> 10; cache->nr_buckets <<= 1) {}
+    cache->buckets = calloc(cache->nr_buckets, sizeof(struct Bcachefs_reflink_entry*));
+    if (cache->buckets == NULL || pthread_mutex_init(&cache->lock, NULL))
+    {
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void benz_bch_reflink_cache_free(Bcachefs_reflink_cache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (uint64_t i = 0; i < cache->nr_buckets; ++i)
+    {
+        while (cache->buckets[i])
+        {
+            struct Bcachefs_reflink_entry *entry = cache->buckets[i];
+            cache->buckets[i] = entry->hash_next;
+            free(entry);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+Bcachefs_cache_stats Bcachefs_get_reflink_cache_stats(const Bcachefs *this)
+{
+    Bcachefs_cache_stats stats = {0};
+    Bcachefs_reflink_cache *cache = this->reflink;
+    if (cache)
+    {
+        pthread_mutex_lock(&cache->lock);
+        stats = (Bcachefs_cache_stats){.hits = cache->hits,
+                                       .misses = cache->misses,
+                                       .size = cache->size,
+                                       .capacity = cache->capacity};
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return stats;
+}
+
+// Resolves the `size` sectors referenced from `idx` through the reflink btree
+// into an entry holding the pointers in a single allocation
+static struct Bcachefs_reflink_entry *_Bcachefs_reflink_resolve(const Bcachefs *this, uint64_t idx, uint64_t size)
+{
+    Bcachefs_iterator iter = {0};
+    _Bcachefs_reflink_piece *pieces = NULL;
+    Bcachefs_extent_ptr *ptrs = NULL;
+    uint32_t nr_pieces = 0, nr_ptrs = 0;
+    struct Bcachefs_reflink_entry *entry = NULL;
+    const struct bch_val *bch_val = NULL;
+    int ret = Bcachefs_iter(this, &iter, BTREE_ID_reflink) &&
+              Bcachefs_iter_seek(this, &iter, SPOS(0, idx + 1, 0), SPOS(0, (uint64_t)-1, (uint32_t)-1));
+    while (ret && (bch_val = Bcachefs_iter_next(this, &iter)))
+    {
+        const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(&iter);
+        const struct bkey_local bkey = benz_bch_unpack_bkey(leaf->bkey, &leaf->unpack_plan);
+        const void *p_end = (const uint8_t*)leaf->bkey + bkey.u64s * BCH_U64S_SIZE;
+        const uint64_t start = bkey.p.offset - bkey.size;
+        if (start >= idx + size)
+        {
+            break;
+        }
+        if (bkey.type != KEY_TYPE_reflink_v && bkey.type != KEY_TYPE_indirect_inline_data)
+        {
+            continue;
+        }
+        const uint64_t from = start > idx ? start : idx;
+        const uint64_t to = bkey.p.offset < idx + size ? bkey.p.offset : idx + size;
+        Bcachefs_extent_ptr found[BCH_BKEY_PTRS_MAX];
+        uint32_t nr_found = 0;
+        _Bcachefs_reflink_piece piece = {.start = from - idx, .size = to - from, .first_ptr = nr_ptrs};
+        if (bkey.type == KEY_TYPE_reflink_v)
+        {
+            nr_found = _benz_bch_extent_ptrs((const void*)((const struct bch_reflink_v*)bch_val)->start, p_end,
+                                             bkey.size, found, BCH_BKEY_PTRS_MAX);
+            nr_found = nr_found < BCH_BKEY_PTRS_MAX ? nr_found : BCH_BKEY_PTRS_MAX;
+            for (uint32_t i = 0; i < nr_found; ++i)
+            {
+                found[i].crc.offset += (uint32_t)(from - start);
+            }
+            piece.nr_ptrs = nr_found;
+        }
+        else
+        {
+            const struct bch_indirect_inline_data *inline_data = (const void*)bch_val;
+            const uint64_t skip = (from - start) * BCH_SECTOR_SIZE;
+            const uint64_t available = (uint64_t)((const uint8_t*)p_end - inline_data->data);
+            piece.inline_offset = benz_bch_inline_data_offset(leaf->btree_node, (const void*)inline_data->data,
+                                                              benz_bch_get_extent_offset(leaf->node_ptr)) + skip;
+            piece.inline_size = available > skip ? available - skip : 0;
+            piece.inline_size = piece.inline_size < piece.size * BCH_SECTOR_SIZE ? piece.inline_size :
+                                                                                   piece.size * BCH_SECTOR_SIZE;
+            piece.inline_dev = leaf->node_ptr->dev;
+        }
+        _Bcachefs_reflink_piece *grown_pieces = realloc(pieces, (nr_pieces + 1) * sizeof(*pieces));
+        Bcachefs_extent_ptr *grown_ptrs = nr_found ? realloc(ptrs, (nr_ptrs + nr_found) * sizeof(*ptrs)) : ptrs;
+        pieces = grown_pieces ? grown_pieces : pieces;
+        ptrs = grown_ptrs ? grown_ptrs : ptrs;
+        ret = grown_pieces && (nr_found == 0 || grown_ptrs);
+        if (ret)
+        {
+            pieces[nr_pieces++] = piece;
+            memcpy(ptrs + nr_ptrs, found, nr_found * sizeof(*ptrs));
+            nr_ptrs += nr_found;
+        }
+    }
+    Bcachefs_iter_fini(this, &iter);
+
+    const uint64_t bytes = sizeof(*entry) + nr_pieces * sizeof(*pieces) + nr_ptrs * sizeof(*ptrs);
+    entry = ret ? malloc(bytes) : NULL;
+    if (entry)
+    {
+        *entry = (struct Bcachefs_reflink_entry){.idx = idx, .size = size, .bytes = bytes,
+                                                 .nr_pieces = nr_pieces, .nr_ptrs = nr_ptrs};
+        entry->pieces = (void*)(entry + 1);
+        entry->ptrs = (void*)(entry->pieces + nr_pieces);
+        memcpy(entry->pieces, pieces, nr_pieces * sizeof(*pieces));
+        memcpy(entry->ptrs, ptrs, nr_ptrs * sizeof(*ptrs));
+    }
+    free(pieces);
+    free(ptrs);
+    return entry;
+}
+
+// Returns the indirect extents of the `size` sectors referenced from `idx`,
+// from the cache when they were already resolved. `*owned` is set when the
+// entry did not fit in the cache, the caller then frees it
+static struct Bcachefs_reflink_entry *_Bcachefs_reflink_get(const Bcachefs *this, uint64_t idx, uint64_t size,
+                                                            int *owned)
+{
+    Bcachefs_reflink_cache *cache = this->reflink;
+    struct Bcachefs_reflink_entry *entry = NULL;
+    *owned = 0;
+    if (cache)
+    {
+        pthread_mutex_lock(&cache->lock);
+        for (entry = cache->buckets[_reflink_bucket(cache, idx, size)];
+             entry && (entry->idx != idx || entry->size != size);
+             entry = entry->hash_next) {}
+        cache->hits += entry != NULL;
+        cache->misses += entry == NULL;
+        pthread_mutex_unlock(&cache->lock);
+        if (entry)
+        {
+            // Entries are never modified nor freed before the cache
+            return entry;
+        }
+    }
+
+    // Resolved outside of the lock, a concurrent reader may resolve it too
+    entry = _Bcachefs_reflink_resolve(this, idx, size);
+    if (entry == NULL || cache == NULL)
+    {
+        *owned = entry != NULL;
+        return entry;
+    }
+    pthread_mutex_lock(&cache->lock);
+    struct Bcachefs_reflink_entry **bucket = &cache->buckets[_reflink_bucket(cache, idx, size)];
+    struct Bcachefs_reflink_entry *other = *bucket;
+    for (; other && (other->idx != idx || other->size != size); other = other->hash_next) {}
+    if (other == NULL && cache->size + entry->bytes <= cache->capacity)
+    {
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        cache->size += entry->bytes;
+    }
+    else if (other)
+    {
+        free(entry);
+        entry = other;
+    }
+    else
+    {
+        *owned = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+static void _Bcachefs_iter_put_reflink(Bcachefs_iterator *iter)
+{
+    if (iter->reflink_owned)
+    {
+        free(iter->reflink);
+    }
+    iter->reflink = NULL;
+    iter->reflink_owned = 0;
+    iter->piece = 0;
+}
+
+// Resolves the indirect extents of the reflink_p key the iterator stands on
+static void _Bcachefs_iter_get_reflink(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    const struct bkey_local bkey = benz_bch_unpack_bkey(leaf->bkey, &leaf->unpack_plan);
+    const struct bch_reflink_p *reflink_p = (const void*)leaf->bch_val;
+    _Bcachefs_iter_put_reflink(iter);
+    if (bkey.type == KEY_TYPE_reflink_p && reflink_p)
+    {
+        iter->reflink = _Bcachefs_reflink_get(this, reflink_p->idx & REFLINK_P_IDX_MASK, bkey.size,
+                                              &iter->reflink_owned);
+    }
+}
+
+int Bcachefs_set_readahead(Bcachefs *this, uint32_t readahead)
+{
+    this->readahead = readahead;
+    return 1;
+}
+
+// Hints the kernel that a btree node is about to be read from its replica
+// `ptr` so the read is issued in the background, either into the page cache
+// or into the mapping
+void Bcachefs_readahead_node(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                             const struct bch_extent_ptr *ptr)
+{
+    uint64_t offset = benz_bch_get_extent_offset(ptr);
+    uint64_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    const Bcachefs_device device = _Bcachefs_device(this, ptr->dev);
+    if (offset >= (uint64_t)device.size)
+    {
+        return;
+    }
+    if (device.map)
+    {
+        const uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+        const uint64_t start = offset & ~(page_size - 1);
+        madvise((void*)(device.map + start), size + offset - start, MADV_WILLNEED);
+    }
+    else if (device.fd >= 0)
+    {
+        posix_fadvise(device.fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+    }
+}
+
+const struct bset *_Bcachefs_iter_frame_next_bset(const Bcachefs *this, const Bcachefs_iter_frame *frame)
+{
+    const void *btree_node_end = (const uint8_t*)frame->btree_node + frame->btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    return benz_bch_next_bset(frame->btree_node, btree_node_end, frame->bset, this->sb);
+}
+
+void _Bcachefs_bset_cursor_next(Bcachefs_bset_cursor *cursor, const struct bkey_unpack_plan *plan)
+{
+    cursor->bkey = benz_bch_next_bkey(cursor->bset, cursor->bkey, KEY_TYPE_MAX);
+    if (cursor->bkey)
+    {
+        cursor->p = benz_bch_unpack_bkey(cursor->bkey, plan).p;
+    }
+}
+
+// Points a cursor to the first key positioned at or after the start of the
+// iterator in each bset of the frame node
+int _Bcachefs_iter_frame_init_cursors(const Bcachefs *this, const Bcachefs_iterator *iter, Bcachefs_iter_frame *frame)
+{
+    // A bset takes at least a block
+    const uint64_t max_cursors = benz_bch_get_btree_node_size(this->sb) / benz_bch_get_block_size(this->sb);
+    if (frame->cursors == NULL)
+    {
+        frame->cursors = malloc(2 * max_cursors * sizeof(Bcachefs_bset_cursor));
+        if (frame->cursors == NULL)
+        {
+            return 0;
+        }
+    }
+    frame->readahead_cursors = frame->cursors + max_cursors;
+    frame->nr_cursors = 0;
+    for (frame->bset = _Bcachefs_iter_frame_next_bset(this, frame);
+         frame->bset && frame->nr_cursors < max_cursors;
+         frame->bset = _Bcachefs_iter_frame_next_bset(this, frame))
+    {
+        Bcachefs_bset_cursor *cursor = &frame->cursors[frame->nr_cursors++];
+        *cursor = (Bcachefs_bset_cursor){.bset = frame->bset};
+        do
+        {
+            _Bcachefs_bset_cursor_next(cursor, &frame->unpack_plan);
+        } while (cursor->bkey && bpos_cmp(cursor->p, iter->start) < 0);
+    }
+    memcpy(frame->readahead_cursors, frame->cursors, frame->nr_cursors * sizeof(Bcachefs_bset_cursor));
+    frame->bset = NULL;
+    return 1;
+}
+
+// End of the value of a key, packed or not, both start with the size of the
+// key in u64s
+static inline const void *_Bcachefs_bkey_end(const void *bkey)
+{
+    return (const uint64_t*)bkey + ((const struct bkey*)bkey)->u64s;
+}
+
+// End of the value of the btree root key of the journal entry of the iterator
+static inline const void *_Bcachefs_iter_root_end(const Bcachefs_iterator *iter)
+{
+    return _Bcachefs_bkey_end(&iter->jset_entry->start->k);
+}
+
+// Points the frame to the node referenced by `btree_ptr`, whose key value
+// ends at `end`, the buffer and the cursors of the frame are reused for the
+// new node
+int _Bcachefs_iter_load_frame(const Bcachefs *this, const Bcachefs_iterator *iter, Bcachefs_iter_frame *frame,
+                              const struct bch_btree_ptr_v2 *btree_ptr, const void *end)
+{
+    Bcachefs_node_put(this, frame->btree_node, frame->buffer);
+    *frame = (Bcachefs_iter_frame){.buffer = frame->buffer, .cursors = frame->cursors};
+    const struct bch_extent_ptr *ptr = btree_ptr ? Bcachefs_node_replica(this, btree_ptr, end) : NULL;
+    if (ptr)
+    {
+        frame->btree_node = Bcachefs_node_get(this, btree_ptr, ptr, &frame->buffer);
+    }
+    if (frame->btree_node)
+    {
+        frame->btree_ptr = btree_ptr;
+        frame->node_ptr = ptr;
+        benz_bch_compile_bkey_format(&frame->unpack_plan, &frame->btree_node->format);
+        if (!_Bcachefs_iter_frame_init_cursors(this, iter, frame))
+        {
+            Bcachefs_node_put(this, frame->btree_node, frame->buffer);
+            frame->btree_node = NULL;
+            frame->btree_ptr = NULL;
+            frame->node_ptr = NULL;
+        }
+    }
+    return frame->btree_node != NULL;
+}
+
+// Releases the nodes of the frames deeper than `depth`
+void _Bcachefs_iter_unwind(const Bcachefs *this, Bcachefs_iterator *iter, int depth)
+{
+    for (; iter->depth > depth; iter->depth--)
+    {
+        Bcachefs_iter_frame *frame = &iter->frames[iter->depth - 1];
+        Bcachefs_node_put(this, frame->btree_node, frame->buffer);
+        *frame = (Bcachefs_iter_frame){.buffer = frame->buffer, .cursors = frame->cursors};
+    }
+}
+
+int Bcachefs_iter(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type)
+{
+    *iter = (Bcachefs_iterator){0};
+
+    iter->type = type;
+    iter->start = POS_MIN;
+    iter->end = POS_MAX;
+    iter->jset_entry = Bcachefs_iter_next_jset_entry(this, iter);
+    iter->btree_ptr = Bcachefs_iter_next_btree_ptr(this, iter);
+    if (iter->btree_ptr && _Bcachefs_iter_load_frame(this, iter, &iter->frames[0], iter->btree_ptr,
+                                                     _Bcachefs_iter_root_end(iter)))
+    {
+        iter->depth = 1;
+    }
+    else
+    {
+        iter->btree_ptr = NULL;
+    }
+    return iter->jset_entry && iter->depth && iter->btree_ptr;
+}
+
+// Restarts the iteration at the first key positioned at or after `start` and
+// stops it after the last key positioned at or before `end`. The descent only
+// enters the children whose [min_key, max key] range intersects [start, end]
+// so reaching the first key costs O(depth) node reads.
+//
+// Note that extent keys are positioned at the end of the extent, so the
+// extents of an inode are found in [(inode, 0), (inode, U64_MAX)]
+int Bcachefs_iter_seek(const Bcachefs *this, Bcachefs_iterator *iter, struct bpos start, struct bpos end)
+{
+    _Bcachefs_iter_unwind(this, iter, 0);
+    _Bcachefs_iter_put_reflink(iter);
+    iter->pending = 0;
+    iter->start = start;
+    iter->end = end;
+    iter->btree_ptr = NULL;
+    iter->btree_ptr = Bcachefs_iter_next_btree_ptr(this, iter);
+    if (iter->btree_ptr && _Bcachefs_iter_load_frame(this, iter, &iter->frames[0], iter->btree_ptr,
+                                                     _Bcachefs_iter_root_end(iter)))
+    {
+        iter->depth = 1;
+    }
+    else
+    {
+        iter->btree_ptr = NULL;
+    }
+    return iter->btree_ptr != NULL;
+}
+
+int Bcachefs_iter_fini(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    if (iter == NULL)
+    {
+        return 1;
+    }
+    _Bcachefs_iter_unwind(this, iter, 0);
+    _Bcachefs_iter_put_reflink(iter);
+    for (int i = 0; i < BCH_BTREE_MAX_DEPTH; i++)
+    {
+        free(iter->frames[i].buffer);
+        free(iter->frames[i].cursors);
+    }
+    *iter = (Bcachefs_iterator){.type = BTREE_ID_NR};
+    return 1;
+}
+
+const struct bch_val *_Bcachefs_iter_next_bch_val(const struct bkey *bkey, const struct bkey_unpack_plan *plan)
+{
+    uint8_t key_u64s = 0;
+    if (bkey == NULL)
+    {
+        return NULL;
+    }
+    if (bkey->format == KEY_FORMAT_LOCAL_BTREE)
+    {
+        key_u64s = plan->key_u64s;
+    }
+    else
+    {
+        key_u64s = BKEY_U64s;
+    }
+    return benz_bch_first_bch_val(bkey, key_u64s);
+}
+
+// Compares the position of a key to the iterator range. Returns -1 if the key
+// is before the range, 1 if it is after and 0 if it is inside. Interior keys
+// are positioned at the max key of their child, which is entered as long as
+// its min key is not after the range
+int _Bcachefs_iter_cmp_range(const Bcachefs_iterator *iter, struct bpos p, const struct bkey *bkey, const struct bch_val *bch_val)
+{
+    if (bpos_cmp(p, iter->start) < 0)
+    {
+        return -1;
+    }
+    if (bkey->type == KEY_TYPE_btree_ptr_v2)
+    {
+        const struct bch_btree_ptr_v2 *btree_ptr = (const void*)bch_val;
+        return bpos_cmp(btree_ptr->min_key, iter->end) > 0;
+    }
+    return bpos_cmp(p, iter->end) > 0;
+}
+
+// Pops the smallest key across the bset cursors. Each bset is sorted but a
+// node accumulates a new bset on every write, so a key found at the same
+// position in multiple bsets has been overwritten and only the version of the
+// newest bset, the last one in the node, is returned. Nodes hold a handful of
+// bsets so the smallest cursor is found with a linear scan
+const struct bkey *_Bcachefs_merge_next(Bcachefs_bset_cursor *cursors, uint32_t nr_cursors,
+                                        const struct bkey_unpack_plan *plan,
+                                        const struct bset **bset, struct bpos *p)
+{
+    const Bcachefs_bset_cursor *min = NULL;
+    for (uint32_t i = 0; i < nr_cursors; i++)
+    {
+        const Bcachefs_bset_cursor *cursor = &cursors[i];
+        // On ties the later, newer, bset wins
+        if (cursor->bkey && (min == NULL || bpos_cmp(cursor->p, min->p) <= 0))
+        {
+            min = cursor;
+        }
+    }
+    if (min == NULL)
+    {
+        return NULL;
+    }
+    const struct bkey *bkey = min->bkey;
+    *p = min->p;
+    *bset = min->bset;
+    for (uint32_t i = 0; i < nr_cursors; i++)
+    {
+        Bcachefs_bset_cursor *cursor = &cursors[i];
+        if (cursor->bkey && bpos_cmp(cursor->p, *p) == 0)
+        {
+            _Bcachefs_bset_cursor_next(cursor, plan);
+        }
+    }
+    return bkey;
+}
+
+// Moves the frame to its next key inside the iterator range. Returns NULL once
+// all the bsets of the node are consumed. Deleted keys are dropped once they
+// have shadowed the older versions, as are hash_whiteout keys unless the
+// iterator asks for them
+const struct bch_val *_Bcachefs_iter_frame_next(const Bcachefs *this, const Bcachefs_iterator *iter, Bcachefs_iter_frame *frame)
+{
+    (void)this;
+    const struct bkey_unpack_plan *plan = &frame->unpack_plan;
+    const struct bkey *bkey = NULL;
+    struct bpos p;
+    while ((bkey = _Bcachefs_merge_next(frame->cursors, frame->nr_cursors, plan, &frame->bset, &p)))
+    {
+        const struct bch_val *bch_val = NULL;
+        frame->bkey = bkey;
+        switch ((int)bkey->type)
+        {
+        case KEY_TYPE_deleted:
+        case KEY_TYPE_discard:
+            continue;
+        case KEY_TYPE_hash_whiteout:
+            if (!iter->whiteouts)
+            {
+                continue;
+            }
+            // Whiteouts have no value, point to the end of the key
+            bch_val = (const void*)((const uint8_t*)bkey + bkey->u64s * BCH_U64S_SIZE);
+            break;
+        default:
+            bch_val = _Bcachefs_iter_next_bch_val(bkey, plan);
+            if (bch_val == NULL)
+            {
+                continue;
+            }
+        }
+        if (_Bcachefs_iter_cmp_range(iter, p, bkey, bch_val) > 0)
+        {
+            // All the remaining keys are after this one
+            break;
+        }
+        frame->bch_val = bch_val;
+        return bch_val;
+    }
+    frame->bset = NULL;
+    frame->bkey = NULL;
+    frame->bch_val = NULL;
+    return NULL;
+}
+
+// Keeps the reads of the next children of an interior frame in flight. The
+// readahead cursors walk the node ahead of the iteration, the child being
+// entered was read ahead by a previous call unless the window was empty.
+//
+// With io_uring the children are loaded in the node cache, a window at a
+// time so its reads are submitted together. Otherwise the kernel is hinted to
+// read them in the background
+void _Bcachefs_iter_frame_readahead(const Bcachefs *this, const Bcachefs_iterator *iter, Bcachefs_iter_frame *frame)
+{
+    const struct bkey_unpack_plan *plan = &frame->unpack_plan;
+    const struct bch_btree_ptr_v2 *batch[BCACHEFS_PREFETCH_MAX];
+    const struct bch_extent_ptr *replicas[BCACHEFS_PREFETCH_MAX];
+    const int batched = this->uring && this->cache && !this->map;
+    const struct bset *bset = NULL;
+    const struct bkey *bkey = NULL;
+    uint32_t nr = 0;
+    struct bpos p;
+    if (batched && frame->readahead > 1)
+    {
+        frame->readahead--;
+        return;
+    }
+    while (frame->readahead <= this->readahead &&
+           (bkey = _Bcachefs_merge_next(frame->readahead_cursors, frame->nr_cursors, plan, &bset, &p)))
+    {
+        const struct bch_val *bch_val = _Bcachefs_iter_next_bch_val(bkey, plan);
+        if (bkey->type != KEY_TYPE_btree_ptr_v2 || bch_val == NULL)
+        {
+            continue;
+        }
+        if (_Bcachefs_iter_cmp_range(iter, p, bkey, bch_val) > 0)
+        {
+            // Past the end of the iteration, stop reading ahead in this node
+            for (uint32_t i = 0; i < frame->nr_cursors; i++)
+            {
+                frame->readahead_cursors[i].bkey = NULL;
+            }
+            break;
+        }
+        const struct bch_extent_ptr *ptr = Bcachefs_node_replica(this, (const void*)bch_val, _Bcachefs_bkey_end(bkey));
+        if (ptr == NULL)
+        {
+            continue;
+        }
+        if (batched)
+        {
+            replicas[nr] = ptr;
+            batch[nr++] = (const void*)bch_val;
+        }
+        else
+        {
+            Bcachefs_readahead_node(this, (const void*)bch_val, ptr);
+        }
+        if (nr == BCACHEFS_PREFETCH_MAX)
+        {
+            Bcachefs_node_prefetch(this, batch, replicas, nr);
+            nr = 0;
+        }
+        frame->readahead++;
+    }
+    if (nr)
+    {
+        Bcachefs_node_prefetch(this, batch, replicas, nr);
+    }
+    if (frame->readahead)
+    {
+        frame->readahead--;
+    }
+}
+
+// Walks the btree depth first with an explicit stack of frames, one per level,
+// so advancing never allocates nor recurses. The node buffers of the frames
+// are kept until Bcachefs_iter_fini
+const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    switch ((int)iter->type)
+    {
+    case BTREE_ID_extents:
+    case BTREE_ID_inodes:
+    case BTREE_ID_dirents:
+    case BTREE_ID_reflink:
+        break;
+    default:
+        return NULL;
+    }
+    if (iter->pending)
+    {
+        iter->pending = 0;
+        return Bcachefs_iter_leaf(iter)->bch_val;
+    }
+    // A reflink_p key is handed out once per indirect extent it references
+    if (iter->reflink && iter->piece + 1 < iter->reflink->nr_pieces)
+    {
+        iter->piece++;
+        return Bcachefs_iter_leaf(iter)->bch_val;
+    }
+    _Bcachefs_iter_put_reflink(iter);
+    while (iter->depth > 0)
+    {
+        Bcachefs_iter_frame *frame = &iter->frames[iter->depth - 1];
+        const struct bch_val *bch_val = _Bcachefs_iter_frame_next(this, iter, frame);
+        if (bch_val == NULL)
+        {
+            _Bcachefs_iter_unwind(this, iter, iter->depth - 1);
+            continue;
+        }
+        if (((const struct bkey*)frame->bkey)->type == KEY_TYPE_reflink_p && iter->type == BTREE_ID_extents)
+        {
+            _Bcachefs_iter_get_reflink(this, iter);
+        }
+        if (((const struct bkey*)frame->bkey)->type != KEY_TYPE_btree_ptr_v2)
+        {
+            return bch_val;
+        }
+        if (this->readahead)
+        {
+            _Bcachefs_iter_frame_readahead(this, iter, frame);
+        }
+        // Children which can't be loaded, or which would go deeper than any
+        // valid btree, are skipped
+        if (iter->depth < BCH_BTREE_MAX_DEPTH &&
+                _Bcachefs_iter_load_frame(this, iter, &iter->frames[iter->depth], (const void*)bch_val,
+                                          _Bcachefs_bkey_end(frame->bkey)))
+        {
+            iter->depth++;
+        }
+    }
+    return NULL;
+}
+
+const struct jset_entry *Bcachefs_iter_next_jset_entry(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    const struct jset_entry *jset_entry = iter->jset_entry;
+    const struct bch_sb_field *sb_field_clean = (const void*)benz_bch_next_sb_field(
+                this->sb,
+                NULL,
+                BCH_SB_FIELD_clean);
+
+    // if sb_field_clean == NULL then the archive needs to be fsck
+    // TODO: we need to return an error all the way back to python here
+    assert(sb_field_clean != NULL);
+    jset_entry = benz_bch_next_jset_entry(sb_field_clean,
+                                          sizeof(struct bch_sb_field_clean),
+                                          jset_entry,
+                                          BCH_JSET_ENTRY_btree_root);
+
+    assert(jset_entry != NULL);
+    for (; jset_entry && jset_entry->btree_id != iter->type;
+         jset_entry = benz_bch_next_jset_entry(sb_field_clean,
+                                               sizeof(struct bch_sb_field_clean),
+                                               jset_entry,
+                                               BCH_JSET_ENTRY_btree_root)) {}
+    return jset_entry;
+}
+
+const struct bch_btree_ptr_v2 *Bcachefs_iter_next_btree_ptr(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    (void)this;
+    const struct jset_entry *jset_entry = iter->jset_entry;
+    const struct bch_btree_ptr_v2 *btree_ptr = iter->btree_ptr;
+    if (jset_entry == NULL)
+    {
+        // The btree is empty, it has no root
+        return NULL;
+    }
+    if (btree_ptr)
+    {
+        btree_ptr = (const void*)benz_bch_next_bch_val(&jset_entry->start->k,
+                                                       (const void*)btree_ptr,
+                                                       sizeof(struct bch_btree_ptr_v2));
+    }
+    else
+    {
+        btree_ptr = (const void*)benz_bch_first_bch_val(&jset_entry->start->k, BKEY_U64s);
+    }
+    const struct bch_val *bch_val = (const void*)btree_ptr;
+    for (; bch_val && btree_ptr->start->unused;
+         bch_val = benz_bch_next_bch_val(&jset_entry->start->k,
+                                         bch_val,
+                                         sizeof(struct bch_btree_ptr_v2)),
+         btree_ptr = (const void*)bch_val) {}
+    return btree_ptr;
+}
+
+const struct bset *Bcachefs_iter_next_bset(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    if (iter->depth == 0)
+    {
+        return NULL;
+    }
+    return _Bcachefs_iter_frame_next_bset(this, Bcachefs_iter_leaf(iter));
+}
+
+// Pointers of the current extent of the iterator, each with the crc entry
+// applying to it. The pointers of a reflink_p key are the ones of the
+// indirect extent of the current piece, and of a reflink_v key the ones of the
+// indirect extent itself. Returns the number of pointers, which can be larger
+// than `max` in which case only the first `max` are filled
+uint32_t Bcachefs_iter_extent_ptrs(const Bcachefs *this, Bcachefs_iterator *iter, Bcachefs_extent_ptr *ptrs, uint32_t max)
+{
+    (void)this;
+
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    const struct bkey_local bkey_local = benz_bch_unpack_bkey(leaf->bkey, &leaf->unpack_plan);
+    const void *p_end = (const uint8_t*)leaf->bkey + bkey_local.u64s * BCH_U64S_SIZE;
+    if (leaf->bch_val == NULL)
+    {
+        return 0;
+    }
+    switch ((int)bkey_local.type)
+    {
+    case KEY_TYPE_extent:
+        return _benz_bch_extent_ptrs(leaf->bch_val, p_end, bkey_local.size, ptrs, max);
+    case KEY_TYPE_reflink_v:
+        return _benz_bch_extent_ptrs((const void*)((const struct bch_reflink_v*)leaf->bch_val)->start, p_end,
+                                     bkey_local.size, ptrs, max);
+    case KEY_TYPE_reflink_p:
+        if (iter->reflink && iter->piece < iter->reflink->nr_pieces)
+        {
+            const _Bcachefs_reflink_piece *piece = &iter->reflink->pieces[iter->piece];
+            memcpy(ptrs, iter->reflink->ptrs + piece->first_ptr,
+                   (piece->nr_ptrs < max ? piece->nr_ptrs : max) * sizeof(Bcachefs_extent_ptr));
+            return piece->nr_ptrs;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+void Bcachefs_set_read_policy(Bcachefs *this, enum Bcachefs_read_policy policy)
+{
+    this->read_policy = policy < BCACHEFS_READ_POLICY_NR ? policy : BCACHEFS_READ_POLICY_first;
+}
+
+// Pointers to devices which are not open can not be read and cached copies
+// may be stale, lower ranks are better
+static inline int _Bcachefs_ptr_rank(const Bcachefs *this, const Bcachefs_extent_ptr *ptr)
+{
+    return !Bcachefs_has_dev(this, ptr->dev) << 1 | ptr->cached;
+}
+
+// Picks the replica to read among the best ranked pointers, `planned` holds
+// the bytes already planned per device by the caller and may be NULL
+static const Bcachefs_extent_ptr *_Bcachefs_pick_ptr(const Bcachefs *this, const Bcachefs_extent_ptr *ptrs,
+                                                     uint32_t nr_ptrs, const uint64_t *planned)
+{
+    const Bcachefs_extent_ptr *picked = NULL;
+    uint32_t nr_candidates = 0;
+    int best = 4;
+    for (uint32_t i = 0; i < nr_ptrs; ++i)
+    {
+        const int rank = _Bcachefs_ptr_rank(this, &ptrs[i]);
+        nr_candidates = rank < best ? 1 : nr_candidates + (rank == best);
+        best = rank < best ? rank : best;
+    }
+    uint32_t nth = 0;
+    if (nr_candidates > 1 && this->read_policy == BCACHEFS_READ_POLICY_round_robin)
+    {
+        nth = (uint32_t)(__atomic_fetch_add(&this->load->next, 1, __ATOMIC_RELAXED) % nr_candidates);
+    }
+    uint64_t least = (uint64_t)-1;
+    for (uint32_t i = 0; i < nr_ptrs; ++i)
+    {
+        if (_Bcachefs_ptr_rank(this, &ptrs[i]) != best)
+        {
+            continue;
+        }
+        if (this->read_policy == BCACHEFS_READ_POLICY_least_loaded)
+        {
+            const uint8_t dev = ptrs[i].dev;
+            const uint64_t load = __atomic_load_n(&this->load->inflight[dev], __ATOMIC_RELAXED) +
+                                  (planned ? planned[dev] : 0);
+            if (load < least)
+            {
+                least = load;
+                picked = &ptrs[i];
+            }
+        }
+        else if (nth-- == 0)
+        {
+            return &ptrs[i];
+        }
+    }
+    return picked;
+}
+
+// Picks the replica to read among the pointers of an extent following the
+// read policy. Returns NULL if there is no pointer
+const Bcachefs_extent_ptr *Bcachefs_pick_ptr(const Bcachefs *this, const Bcachefs_extent_ptr *ptrs, uint32_t nr_ptrs)
+{
+    return _Bcachefs_pick_ptr(this, ptrs, nr_ptrs, NULL);
+}
+
+// Fills the extent of `size` bytes at `file_offset` from the replica picked
+// among `ptrs` by the read policy, along with the region covered by its
+// checksum
+static void _Bcachefs_make_extent(const Bcachefs *this, const Bcachefs_extent_ptr *ptrs, uint32_t nr_ptrs,
+                                  const uint64_t *planned, uint64_t file_offset, uint64_t size,
+                                  Bcachefs_extent *extent, Bcachefs_extent_csum *csum)
+{
+    const Bcachefs_extent_ptr *ptr = _Bcachefs_pick_ptr(this, ptrs, nr_ptrs < BCH_BKEY_PTRS_MAX ?
+                                                                    nr_ptrs : BCH_BKEY_PTRS_MAX, planned);
+    if (ptr == NULL)
+    {
+        return;
+    }
+    const uint8_t compression_type = _benz_bch_crc_compression(&ptr->crc);
+    extent->file_offset = file_offset;
+    extent->offset = ptr->offset + (compression_type ? 0 : ptr->crc.offset * BCH_SECTOR_SIZE);
+    extent->size = size;
+    extent->compression_type = compression_type;
+    *csum = (Bcachefs_extent_csum){.offset = ptr->offset,
+                                   .size = (uint64_t)ptr->crc.compressed_size * BCH_SECTOR_SIZE,
+                                   .csum_type = ptr->crc.csum_type,
+                                   .csum = ptr->crc.csum,
+                                   .compression_type = compression_type,
+                                   .uncompressed_size = (uint64_t)ptr->crc.uncompressed_size * BCH_SECTOR_SIZE,
+                                   .data_offset = (uint64_t)ptr->crc.offset * BCH_SECTOR_SIZE,
+                                   .dev = ptr->dev};
+}
+
+// Decodes the current extent of the iterator from the replica picked by the
+// read policy, along with the region covered by its checksum. A reflink_p key
+// decodes to the current piece of the indirect extents it references
+static void _Bcachefs_iter_decode_extent(const Bcachefs *this, Bcachefs_iterator *iter, const uint64_t *planned,
+                                         Bcachefs_extent *extent, Bcachefs_extent_csum *csum)
+{
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    const struct bkey_local bkey_local = benz_bch_unpack_bkey(leaf->bkey, &leaf->unpack_plan);
+    const struct bkey *bkey = (const void*)&bkey_local;
+    const uint64_t file_offset = (bkey->p.offset - bkey->size) * BCH_SECTOR_SIZE;
+    Bcachefs_extent_ptr ptrs[BCH_BKEY_PTRS_MAX];
+    *extent = (Bcachefs_extent){.inode = bkey->p.inode};
+    *csum = (Bcachefs_extent_csum){0};
+    if (bkey->type == KEY_TYPE_extent || bkey->type == KEY_TYPE_reflink_v)
+    {
+        const uint32_t nr_ptrs = Bcachefs_iter_extent_ptrs(this, iter, ptrs, BCH_BKEY_PTRS_MAX);
+        _Bcachefs_make_extent(this, ptrs, nr_ptrs, planned, file_offset, bkey->size * BCH_SECTOR_SIZE, extent, csum);
+    }
+    else if (bkey->type == KEY_TYPE_reflink_p && iter->reflink && iter->piece < iter->reflink->nr_pieces)
+    {
+        const _Bcachefs_reflink_piece *piece = &iter->reflink->pieces[iter->piece];
+        const uint64_t piece_offset = file_offset + piece->start * BCH_SECTOR_SIZE;
+        if (piece->nr_ptrs)
+        {
+            const uint32_t nr_ptrs = Bcachefs_iter_extent_ptrs(this, iter, ptrs, BCH_BKEY_PTRS_MAX);
+            _Bcachefs_make_extent(this, ptrs, nr_ptrs, planned, piece_offset, piece->size * BCH_SECTOR_SIZE,
+                                  extent, csum);
+        }
+        else
+        {
+            extent->file_offset = piece_offset;
+            extent->offset = piece->inline_offset;
+            extent->size = piece->inline_size;
+            csum->dev = piece->inline_dev;
+        }
+    }
+    else if (bkey->type == KEY_TYPE_inline_data)
+    {
+        const void *p_end = (const uint8_t*)leaf->bkey + bkey->u64s * BCH_U64S_SIZE;
+        benz_bch_file_offset_size(bkey, leaf->bch_val, p_end, &extent->file_offset, &extent->offset, &extent->size);
+        extent->offset = benz_bch_inline_data_offset(leaf->btree_node, leaf->bch_val,
+                                                     benz_bch_get_extent_offset(leaf->node_ptr));
+        extent->size -= (uint64_t)((const uint8_t*)leaf->bch_val - (const uint8_t*)leaf->bkey);
+        csum->dev = leaf->node_ptr->dev;
+    }
+}
+
+Bcachefs_extent Bcachefs_iter_make_extent(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    Bcachefs_extent extent;
+    Bcachefs_extent_csum csum;
+    _Bcachefs_iter_decode_extent(this, iter, NULL, &extent, &csum);
+    return extent;
+}
+
+// Region of the image checksummed for the current extent of the iterator. It
+// covers the whole extent as it was written, which can be larger than the
+// data still referenced by the key, and is decompressed as a whole. Inline
+// data is checksummed with its btree node and has no checksum of its own
+Bcachefs_extent_csum Bcachefs_iter_make_extent_csum(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    Bcachefs_extent extent;
+    Bcachefs_extent_csum csum;
+    _Bcachefs_iter_decode_extent(this, iter, NULL, &extent, &csum);
+    return csum;
+}
+
+// Data of the current key when it is an inline extent, which is stored in the
+// btree node itself and can be used without reading the image. The data points
+// in the node buffer of the iterator and is only valid until it moves. Returns
+// NULL for other keys
+const uint8_t *Bcachefs_iter_inline_data(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t *size)
+{
+    (void)this;
+
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    if (iter->type != BTREE_ID_extents || iter->depth == 0 || leaf->bkey == NULL || leaf->bch_val == NULL)
+    {
+        return NULL;
+    }
+    const struct bkey_local bkey_local = benz_bch_unpack_bkey(leaf->bkey, &leaf->unpack_plan);
+    if (bkey_local.type != KEY_TYPE_inline_data)
+    {
+        return NULL;
+    }
+    const uint8_t *p_end = (const uint8_t*)leaf->bkey + bkey_local.u64s * BCH_U64S_SIZE;
+    *size = (uint64_t)(p_end - (const uint8_t*)leaf->bch_val);
+    return (const uint8_t*)leaf->bch_val;
+}
+
+Bcachefs_inode Bcachefs_iter_make_inode(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    (void)this;
+
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    const struct bkey *bkey = leaf->bkey;
+    const struct bkey_local bkey_local = benz_bch_unpack_bkey(bkey, &leaf->unpack_plan);
+    const struct bch_inode *bch_inode = (const void*)leaf->bch_val;
+
+    const void *p_end = (const void*)((const uint8_t*)bkey + bkey->u64s * BCH_U64S_SIZE);
+
+    Bcachefs_inode inode = {0};
+    inode.inode = bkey_local.p.offset;
+
+    benz_bch_inode_unpack_size(&inode.size, bch_inode, p_end);
+    return inode;
+}
+
+Bcachefs_dirent Bcachefs_iter_make_dirent(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    (void)this;
+
+    const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(iter);
+    const struct bkey *bkey = leaf->bkey;
+    const struct bkey_local bkey_local = benz_bch_unpack_bkey(bkey, &leaf->unpack_plan);
+    const struct bch_dirent *bch_dirent = (const void*)leaf->bch_val;
+    const uint8_t name_len = strlen((const void*)bch_dirent->d_name);
+    const uint8_t max_name_len = (const uint8_t*)bkey + bkey->u64s * BCH_U64S_SIZE - bch_dirent->d_name;
+    return (Bcachefs_dirent){.parent_inode = bkey_local.p.inode,
+                                  .inode = bch_dirent->d_inum,
+                                  .type = bch_dirent->d_type,
+                                  .name = bch_dirent->d_name,
+                                  .name_len = (name_len < max_name_len ? name_len : max_name_len)};
+}
+
+// Decodes up to `n` extents into the columns of `batch` and returns how many
+// were decoded, 0 once the iteration is over. When the batch collects inline
+// data it also stops early once its buffer is full, the extent which did not
+// fit is the first one of the next batch
+uint32_t Bcachefs_iter_next_batch_extents(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_extent_batch *batch)
+{
+    uint32_t i = 0;
+    uint32_t inline_used = 0;
+    if (iter->type != BTREE_ID_extents)
+    {
+        return 0;
+    }
+    if (batch->inline_offset)
+    {
+        batch->inline_offset[0] = 0;
+    }
+    for (; i < n && Bcachefs_iter_next(this, iter); ++i)
+    {
+        if (batch->inline_offset)
+        {
+            uint64_t inline_size = 0;
+            const uint8_t *inline_data = Bcachefs_iter_inline_data(this, iter, &inline_size);
+            if (inline_used + inline_size > batch->inline_data_size)
+            {
+                iter->pending = 1;
+                break;
+            }
+            if (inline_data)
+            {
+                memcpy(batch->inline_data + inline_used, inline_data, inline_size);
+                inline_used += (uint32_t)inline_size;
+            }
+            batch->inline_offset[i + 1] = inline_used;
+        }
+        const Bcachefs_extent extent = Bcachefs_iter_make_extent(this, iter);
+        batch->inode[i] = extent.inode;
+        batch->file_offset[i] = extent.file_offset;
+        batch->offset[i] = extent.offset;
+        batch->size[i] = extent.size;
+        if (batch->compression_type)
+        {
+            batch->compression_type[i] = extent.compression_type;
+        }
+    }
+    return i;
+}
+
+uint32_t Bcachefs_iter_next_batch_inodes(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_inode_batch *batch)
+{
+    uint32_t i = 0;
+    if (iter->type != BTREE_ID_inodes)
+    {
+        return 0;
+    }
+    for (; i < n && Bcachefs_iter_next(this, iter); ++i)
+    {
+        const Bcachefs_inode inode = Bcachefs_iter_make_inode(this, iter);
+        batch->inode[i] = inode.inode;
+        batch->size[i] = inode.size;
+    }
+    return i;
+}
+
+// The batch also stops early when the names buffer is full, the dirent which
+// did not fit is the first one of the next batch
+uint32_t Bcachefs_iter_next_batch_dirents(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_dirent_batch *batch)
+{
+    uint32_t i = 0;
+    uint32_t names_used = 0;
+    if (iter->type != BTREE_ID_dirents)
+    {
+        return 0;
+    }
+    batch->name_offset[0] = 0;
+    for (; i < n && Bcachefs_iter_next(this, iter); ++i)
+    {
+        const Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(this, iter);
+        if (names_used + dirent.name_len > batch->names_size)
+        {
+            iter->pending = 1;
+            break;
+        }
+        batch->parent_inode[i] = dirent.parent_inode;
+        batch->inode[i] = dirent.inode;
+        batch->type[i] = dirent.type;
+        memcpy(batch->names + names_used, dirent.name, dirent.name_len);
+        names_used += dirent.name_len;
+        batch->name_offset[i + 1] = names_used;
+    }
+    return i;
+}
+
+// Parallel scans
+// --------------
+
+static int _Bcachefs_scan_append(Bcachefs_scan_range **ranges, uint32_t *nr_ranges, uint32_t *capacity,
+                                 const Bcachefs_iterator *iter, struct bpos min_key, struct bpos max_key)
+{
+    Bcachefs_scan_range range = {.start = bpos_cmp(min_key, iter->start) > 0 ? min_key : iter->start,
+                                 .end = bpos_cmp(max_key, iter->end) < 0 ? max_key : iter->end};
+    if (bpos_cmp(range.start, range.end) > 0)
+    {
+        return 1;
+    }
+    if (*nr_ranges == *capacity)
+    {
+        Bcachefs_scan_range *grown = realloc(*ranges, (*capacity * 2 + 16) * sizeof(Bcachefs_scan_range));
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        *ranges = grown;
+        *capacity = *capacity * 2 + 16;
+    }
+    (*ranges)[(*nr_ranges)++] = range;
+    return 1;
+}
+
+// Appends the key ranges of the children of the node of frame `depth` found
+// at depth `target`
+static int _Bcachefs_scan_collect(const Bcachefs *this, Bcachefs_iterator *iter, int depth, int target,
+                                  Bcachefs_scan_range **ranges, uint32_t *nr_ranges, uint32_t *capacity)
+{
+    Bcachefs_iter_frame *frame = &iter->frames[depth];
+    const struct bch_val *bch_val = NULL;
+    while ((bch_val = _Bcachefs_iter_frame_next(this, iter, frame)))
+    {
+        const struct bkey *bkey = frame->bkey;
+        const struct bch_btree_ptr_v2 *btree_ptr = (const void*)bch_val;
+        if (bkey->type != KEY_TYPE_btree_ptr_v2)
+        {
+            continue;
+        }
+        if (depth + 1 == target)
+        {
+            const struct bpos max_key = benz_bch_unpack_bkey(bkey, &frame->unpack_plan).p;
+            if (!_Bcachefs_scan_append(ranges, nr_ranges, capacity, iter, btree_ptr->min_key, max_key))
+            {
+                return 0;
+            }
+            continue;
+        }
+        if (!_Bcachefs_iter_load_frame(this, iter, &iter->frames[depth + 1], btree_ptr, _Bcachefs_bkey_end(bkey)))
+        {
+            return 0;
+        }
+        iter->depth = depth + 2;
+        int ret = _Bcachefs_scan_collect(this, iter, depth + 1, target, ranges, nr_ranges, capacity);
+        _Bcachefs_iter_unwind(this, iter, depth + 1);
+        if (!ret)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Splits the keys of a btree in [start, end] into disjoint, ordered, ranges
+// following the node boundaries. The ranges are the ones of the children of
+// the root, or of the first level down which yields at least
+// `min_partitions` nodes. The caller frees `ranges`
+int Bcachefs_scan_partitions(const Bcachefs *this, enum btree_id type, struct bpos start, struct bpos end,
+                             uint32_t min_partitions, Bcachefs_scan_range **ranges, uint32_t *nr_ranges)
+{
+    Bcachefs_iterator iter = {0};
+    uint32_t capacity = 0;
+    int ret = 1;
+    *ranges = NULL;
+    *nr_ranges = 0;
+    if (!Bcachefs_iter(this, &iter, type) || !Bcachefs_iter_seek(this, &iter, start, end))
+    {
+        Bcachefs_iter_fini(this, &iter);
+        return 0;
+    }
+    const int root_level = iter.jset_entry->level < BCH_BTREE_MAX_DEPTH ? iter.jset_entry->level : 0;
+    if (root_level == 0)
+    {
+        ret = _Bcachefs_scan_append(ranges, nr_ranges, &capacity, &iter, start, end);
+    }
+    for (int target = 1; ret && target <= root_level; ++target)
+    {
+        *nr_ranges = 0;
+        ret = Bcachefs_iter_seek(this, &iter, start, end) &&
+              _Bcachefs_scan_collect(this, &iter, 0, target, ranges, nr_ranges, &capacity);
+        if (*nr_ranges >= min_partitions)
+        {
+            break;
+        }
+    }
+    Bcachefs_iter_fini(this, &iter);
+    if (!ret)
+    {
+        free(*ranges);
+        *ranges = NULL;
+        *nr_ranges = 0;
+    }
+    return ret;
+}
+
+// Resolves a number of worker threads, 0 meaning one per online CPU
+static uint32_t _Bcachefs_nr_threads(uint32_t nr_threads)
+{
+    if (nr_threads == 0)
+    {
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_threads = nr_cpus > 0 ? (uint32_t)nr_cpus : 1;
+    }
+    return nr_threads;
+}
+
+// Runs `worker` on a pool of `nr_threads` threads, 0 meaning one per online
+// CPU, and no more than `nr_jobs`. The workers pull their jobs from `state`.
+// The calling thread is one of the workers and the only one left if threads
+// can not be created
+static void _Bcachefs_run_pool(uint32_t nr_threads, uint32_t nr_jobs, void *(*worker)(void*), void *state)
+{
+    nr_threads = _Bcachefs_nr_threads(nr_threads);
+    if (nr_threads > nr_jobs)
+    {
+        nr_threads = nr_jobs;
+    }
+    pthread_t *threads = nr_threads > 1 ? malloc((nr_threads - 1) * sizeof(pthread_t)) : NULL;
+    uint32_t nr_started = 0;
+    for (; threads && nr_started < nr_threads - 1; ++nr_started)
+    {
+        if (pthread_create(&threads[nr_started], NULL, worker, state) != 0)
+        {
+            break;
+        }
+    }
+    worker(state);
+    for (uint32_t i = 0; i < nr_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+typedef struct {
+    const Bcachefs *this;
+    enum btree_id type;
+    const Bcachefs_scan_range *ranges;
+    uint32_t nr_ranges;
+    uint32_t next_range;
+    int failed;
+    Bcachefs_scan_cb cb;
+    void *arg;
+} _Bcachefs_scan_state;
+
+static void *_Bcachefs_scan_worker(void *arg)
+{
+    _Bcachefs_scan_state *state = arg;
+    Bcachefs_iterator iter = {0};
+    if (!Bcachefs_iter(state->this, &iter, state->type))
+    {
+        __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_load_n(&state->failed, __ATOMIC_RELAXED))
+    {
+        const uint32_t i = __atomic_fetch_add(&state->next_range, 1, __ATOMIC_RELAXED);
+        if (i >= state->nr_ranges)
+        {
+            break;
+        }
+        if (!Bcachefs_iter_seek(state->this, &iter, state->ranges[i].start, state->ranges[i].end) ||
+                !state->cb(state->this, &iter, i, state->arg))
+        {
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    Bcachefs_iter_fini(state->this, &iter);
+    return NULL;
+}
+
+// Hands the ranges out to a pool of `nr_threads` workers, 0 meaning one per
+// online CPU. Each worker owns an iterator, so the nodes of different ranges
+// are read and decoded concurrently, and calls `cb` once per range. Since the
+// ranges are ordered, results written per partition and concatenated are in
+// key order
+int Bcachefs_scan(const Bcachefs *this, enum btree_id type, const Bcachefs_scan_range *ranges, uint32_t nr_ranges,
+                  uint32_t nr_threads, Bcachefs_scan_cb cb, void *arg)
+{
+    _Bcachefs_scan_state state = {.this = this,
+                                  .type = type,
+                                  .ranges = ranges,
+                                  .nr_ranges = nr_ranges,
+                                  .cb = cb,
+                                  .arg = arg};
+    _Bcachefs_run_pool(nr_threads, nr_ranges, _Bcachefs_scan_worker, &state);
+    return !state.failed;
+}
+
+// Partitions the whole btree `type` and scans it with `nr_threads` workers, 0
+// meaning one per online CPU. `prepare`, if not NULL, is called with the
+// number of partitions before the scan to size per partition results
+int Bcachefs_scan_btree(const Bcachefs *this, enum btree_id type, uint32_t nr_threads,
+                        Bcachefs_scan_prepare_cb prepare, Bcachefs_scan_cb cb, void *arg)
+{
+    Bcachefs_scan_range *ranges = NULL;
+    uint32_t nr_ranges = 0;
+    nr_threads = _Bcachefs_nr_threads(nr_threads);
+    // A few ranges per thread to balance uneven subtrees
+    int ret = Bcachefs_scan_partitions(this, type, POS_MIN, POS_MAX, nr_threads * 4, &ranges, &nr_ranges) &&
+              (prepare == NULL || prepare(nr_ranges, arg)) &&
+              Bcachefs_scan(this, type, ranges, nr_ranges, nr_threads, cb, arg);
+    free(ranges);
+    return ret;
+}
+
+// Batched file reads
+// ------------------
+
+// Fetch the inode `inode`, returns 0 if it does not exist
+int Bcachefs_find_inode(const Bcachefs *this, uint64_t inode, Bcachefs_inode *out)
+{
+    Bcachefs_iterator iter = {0};
+    int ret = 0;
+    if (Bcachefs_iter(this, &iter, BTREE_ID_inodes) &&
+            Bcachefs_iter_seek(this, &iter, SPOS(0, inode, 0), SPOS(0, inode, (uint32_t)-1)) &&
+            Bcachefs_iter_next(this, &iter))
+    {
+        *out = Bcachefs_iter_make_inode(this, &iter);
+        ret = 1;
+    }
+    Bcachefs_iter_fini(this, &iter);
+    return ret;
+}
+
+static int _Bcachefs_read_spans_add(Bcachefs_read_span **spans, uint32_t *nr_spans, uint32_t *spans_capacity,
+                                    Bcachefs_read_span span)
+{
+    if (*nr_spans == *spans_capacity)
+    {
+        uint32_t capacity = *spans_capacity ? *spans_capacity * 2 : 64;
+        Bcachefs_read_span *grown = realloc(*spans, capacity * sizeof(Bcachefs_read_span));
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        *spans = grown;
+        *spans_capacity = capacity;
+    }
+    (*spans)[(*nr_spans)++] = span;
+    return 1;
+}
+
+static int _Bcachefs_read_plan_add(Bcachefs_read_plan *plan, Bcachefs_read_span span)
+{
+    return _Bcachefs_read_spans_add(&plan->spans, &plan->nr_spans, &plan->spans_capacity, span);
+}
+
+// Inline extents are copied out of the btree node while it is at hand so
+// executing the plan does not read them from the image again
+static int _Bcachefs_read_plan_add_inline(Bcachefs_read_plan *plan, uint64_t arena_offset, const uint8_t *data,
+                                          uint64_t size)
+{
+    if (plan->inline_data_size + size > plan->inline_data_capacity)
+    {
+        uint64_t capacity = plan->inline_data_capacity ? plan->inline_data_capacity * 2 : 4096;
+        while (capacity < plan->inline_data_size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(plan->inline_data, capacity);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        plan->inline_data = grown;
+        plan->inline_data_capacity = capacity;
+    }
+    memcpy(plan->inline_data + plan->inline_data_size, data, size);
+    plan->inline_data_size += size;
+    return _Bcachefs_read_spans_add(&plan->inline_spans, &plan->nr_inline_spans, &plan->inline_spans_capacity,
+                                    (Bcachefs_read_span){.offset = plan->inline_data_size - size,
+                                                         .size = size,
+                                                         .arena_offset = arena_offset});
+}
+
+// Lays the files out one after the other in an arena and lists the parts of
+// the image to copy in it. Extents past the end of a file are clipped and
+// holes are left to be zeroed, files which do not exist are empty. Inline
+// extents are copied in the plan and cost no read. The plan is released with
+// Bcachefs_read_plan_free
+int Bcachefs_read_plan_build(const Bcachefs *this, const uint64_t *inodes, uint32_t nr_inodes, Bcachefs_read_plan *plan)
+{
+    Bcachefs_iterator inodes_iter = {0};
+    Bcachefs_iterator extents_iter = {0};
+    // Bytes planned per device, to spread the plan over the replicas
+    uint64_t planned[BCH_SB_MEMBERS_MAX] = {0};
+    int ret = 1;
+    *plan = (Bcachefs_read_plan){.nr_inodes = nr_inodes};
+    plan->offsets = malloc((nr_inodes + 1) * sizeof(uint64_t));
+    if (plan->offsets == NULL || !Bcachefs_iter(this, &inodes_iter, BTREE_ID_inodes) ||
+            !Bcachefs_iter(this, &extents_iter, BTREE_ID_extents))
+    {
+        ret = 0;
+    }
+    for (uint32_t i = 0; ret && i < nr_inodes; ++i)
+    {
+        uint64_t size = 0;
+        plan->offsets[i] = plan->arena_size;
+        if (Bcachefs_iter_seek(this, &inodes_iter, SPOS(0, inodes[i], 0), SPOS(0, inodes[i], (uint32_t)-1)) &&
+                Bcachefs_iter_next(this, &inodes_iter))
+        {
+            size = Bcachefs_iter_make_inode(this, &inodes_iter).size;
+        }
+        Bcachefs_iter_seek(this, &extents_iter, SPOS(inodes[i], 0, 0), SPOS(inodes[i], (uint64_t)-1, (uint32_t)-1));
+        while (ret && size && Bcachefs_iter_next(this, &extents_iter))
+        {
+            Bcachefs_extent extent;
+            Bcachefs_extent_csum csum;
+            _Bcachefs_iter_decode_extent(this, &extents_iter, planned, &extent, &csum);
+            if (extent.file_offset >= size)
+            {
+                break;
+            }
+            const uint64_t extent_size = extent.file_offset + extent.size > size ? size - extent.file_offset : extent.size;
+            uint64_t inline_size = 0;
+            const uint8_t *inline_data = Bcachefs_iter_inline_data(this, &extents_iter, &inline_size);
+            if (inline_data)
+            {
+                ret = _Bcachefs_read_plan_add_inline(plan, plan->arena_size + extent.file_offset, inline_data,
+                                                     extent_size < inline_size ? extent_size : inline_size);
+                continue;
+            }
+            planned[csum.dev] += csum.size ? csum.size : extent_size;
+            ret = _Bcachefs_read_plan_add(plan, (Bcachefs_read_span){.offset = extent.offset,
+                                                                     .size = extent_size,
+                                                                     .arena_offset = plan->arena_size + extent.file_offset,
+                                                                     .csum = csum});
+        }
+        plan->arena_size += size;
+    }
+    if (plan->offsets)
+    {
+        plan->offsets[nr_inodes] = plan->arena_size;
+    }
+    Bcachefs_iter_fini(this, &inodes_iter);
+    Bcachefs_iter_fini(this, &extents_iter);
+    if (!ret)
+    {
+        Bcachefs_read_plan_free(plan);
+    }
+    return ret;
+}
+
+static int _Bcachefs_read_span_cmp(const void *l, const void *r)
+{
+    const Bcachefs_read_span *ls = l;
+    const Bcachefs_read_span *rs = r;
+    if (ls->csum.dev != rs->csum.dev)
+    {
+        return (ls->csum.dev > rs->csum.dev) - (ls->csum.dev < rs->csum.dev);
+    }
+    return (ls->read_offset > rs->read_offset) - (ls->read_offset < rs->read_offset);
+}
+
+// Groups the sorted spans starting at `first` which are on the same device and
+// less than `gap` bytes apart, returns the index past the group and its range
+// of the device
+static uint32_t _Bcachefs_read_plan_group(const Bcachefs_read_plan *plan, uint32_t first, uint64_t gap,
+                                          uint64_t *start, uint64_t *end)
+{
+    uint32_t next = first + 1;
+    *start = plan->spans[first].read_offset;
+    *end = *start + plan->spans[first].read_size;
+    for (; next < plan->nr_spans; ++next)
+    {
+        const Bcachefs_read_span *span = &plan->spans[next];
+        if (span->csum.dev != plan->spans[first].csum.dev || span->read_offset > *end + gap ||
+                span->read_offset + span->read_size - *start > BCACHEFS_READ_MAX)
+        {
+            break;
+        }
+        if (span->read_offset + span->read_size > *end)
+        {
+            *end = span->read_offset + span->read_size;
+        }
+    }
+    return next;
+}
+
+// Spans of compressed extents, and of checksummed extents when verifying, are
+// read whole to be verified and decompressed once read
+static inline int _Bcachefs_read_span_whole(const Bcachefs *this, const Bcachefs_read_span *span)
+{
+    return span->csum.compression_type || (this->verify && span->csum.csum_type);
+}
+
+// Content of the file of a single file plan in the image mapping, when the
+// file is contiguous in the image and its extents are read as is. Returns
+// NULL if the plan has to be executed
+const void *Bcachefs_read_plan_map(const Bcachefs *this, const Bcachefs_read_plan *plan)
+{
+    if (plan->nr_inodes != 1 || plan->nr_spans == 0 || plan->nr_inline_spans)
+    {
+        return NULL;
+    }
+    const Bcachefs_read_span *first = &plan->spans[0];
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < plan->nr_spans; ++i)
+    {
+        // Spans are in file order until the plan is executed
+        const Bcachefs_read_span *span = &plan->spans[i];
+        if (span->arena_offset != size || span->offset != first->offset + size ||
+                span->csum.dev != first->csum.dev || _Bcachefs_read_span_whole(this, span))
+        {
+            return NULL;
+        }
+        size += span->size;
+    }
+    return size == plan->arena_size ? Bcachefs_map_range_dev(this, first->csum.dev, first->offset, size) : NULL;
+}
+
+// Spans which have to be verified or decompressed once read
+typedef struct {
+    const Bcachefs_read_span *span;
+    const uint8_t *src;                         //! read range of the span
+    uint64_t src_len;                           //! bytes of the read range actually read
+} _Bcachefs_decode_job;
+
+typedef struct {
+    const Bcachefs *this;
+    Bcachefs_read_plan *plan;
+    const _Bcachefs_decode_job *jobs;
+    uint32_t nr_jobs;
+    uint32_t next_job;
+    uint8_t *arena;
+} _Bcachefs_decode_state;
+
+static void _Bcachefs_decode(_Bcachefs_decode_state *state, const _Bcachefs_decode_job *job)
+{
+    const Bcachefs_read_span *span = job->span;
+    const Bcachefs_extent_csum *csum = &span->csum;
+    uint8_t *dst = state->arena + span->arena_offset;
+    if (state->this->verify && csum->csum_type)
+    {
+        struct bch_csum computed;
+        if (job->src_len < csum->size || !benz_bch_checksum(csum->csum_type, job->src, csum->size, &computed) ||
+                computed.lo != csum->csum.lo || computed.hi != csum->csum.hi)
+        {
+            __atomic_fetch_add(&state->plan->nr_csum_errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (csum->compression_type == BCH_COMPRESSION_TYPE_none)
+    {
+        const uint64_t from = span->offset - span->read_offset;
+        // Only copy what was read if the read came short
+        const uint64_t size = from >= job->src_len ? 0 :
+                              from + span->size > job->src_len ? job->src_len - from : span->size;
+        if (size)
+        {
+            memcpy(dst, job->src + from, size);
+        }
+        return;
+    }
+    if (csum->data_offset == 0 && span->size == csum->uncompressed_size)
+    {
+        // The key references the whole extent, decompress in place
+        if (!benz_bch_decompress(csum->compression_type, job->src, job->src_len, dst, span->size))
+        {
+            __atomic_fetch_add(&state->plan->nr_decode_errors, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    uint8_t *buffer = malloc(csum->uncompressed_size);
+    if (buffer == NULL || csum->data_offset + span->size > csum->uncompressed_size ||
+            !benz_bch_decompress(csum->compression_type, job->src, job->src_len, buffer, csum->uncompressed_size))
+    {
+        __atomic_fetch_add(&state->plan->nr_decode_errors, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        memcpy(dst, buffer + csum->data_offset, span->size);
+    }
+    free(buffer);
+}
+
+static void *_Bcachefs_decode_worker(void *arg)
+{
+    _Bcachefs_decode_state *state = arg;
+    for (;;)
+    {
+        const uint32_t i = __atomic_fetch_add(&state->next_job, 1, __ATOMIC_RELAXED);
+        if (i >= state->nr_jobs)
+        {
+            return NULL;
+        }
+        _Bcachefs_decode(state, &state->jobs[i]);
+    }
+}
+
+// Verifies and decompresses the jobs with a pool of decode_threads workers
+static void _Bcachefs_decode_jobs(const Bcachefs *this, Bcachefs_read_plan *plan, const _Bcachefs_decode_job *jobs,
+                                  uint32_t nr_jobs, uint8_t *arena)
+{
+    _Bcachefs_decode_state state = {.this = this, .plan = plan, .jobs = jobs, .nr_jobs = nr_jobs, .arena = arena};
+    _Bcachefs_run_pool(this->decode_threads, nr_jobs, _Bcachefs_decode_worker, &state);
+}
+
+// Reads the plan into `arena`, which must hold plan->arena_size bytes. Spans
+// are sorted by their location in the image and the ones less than `gap`
+// bytes apart are coalesced into reads of up to BCACHEFS_READ_MAX bytes, which
+// land in a staging buffer before being scattered in the arena. The reads are
+// submitted in a single batch. Compressed extents, and checksummed extents
+// when the filesystem verifies reads, are read whole then verified and
+// decompressed by a pool of decode_threads workers. Failures are counted in
+// plan->nr_csum_errors and plan->nr_decode_errors
+int Bcachefs_read_plan_exec(const Bcachefs *this, Bcachefs_read_plan *plan, uint8_t *arena, uint64_t gap)
+{
+    uint64_t covered = 0;
+    uint64_t staging_size = 0;
+    uint32_t nr_reads = 0;
+    uint32_t nr_jobs = 0;
+    int ret = 1;
+    plan->nr_csum_errors = 0;
+    plan->nr_decode_errors = 0;
+    for (uint32_t i = 0; i < plan->nr_spans; ++i)
+    {
+        Bcachefs_read_span *span = &plan->spans[i];
+        const int whole = _Bcachefs_read_span_whole(this, span);
+        span->read_offset = whole ? span->csum.offset : span->offset;
+        span->read_size = whole ? span->csum.size : span->size;
+        covered += span->size;
+        nr_jobs += whole;
+    }
+    for (uint32_t i = 0; i < plan->nr_inline_spans; ++i)
+    {
+        covered += plan->inline_spans[i].size;
+    }
+    if (covered < plan->arena_size)
+    {
+        // Holes read as zeros
+        memset(arena, 0, plan->arena_size);
+    }
+    for (uint32_t i = 0; i < plan->nr_inline_spans; ++i)
+    {
+        const Bcachefs_read_span *span = &plan->inline_spans[i];
+        memcpy(arena + span->arena_offset, plan->inline_data + span->offset, span->size);
+    }
+    _Bcachefs_decode_job *jobs = malloc((nr_jobs ? nr_jobs : 1) * sizeof(_Bcachefs_decode_job));
+    if (jobs == NULL)
+    {
+        return 0;
+    }
+    nr_jobs = 0;
+
+    if (this->map)
+    {
+        for (uint32_t i = 0; i < plan->nr_spans; ++i)
+        {
+            const Bcachefs_read_span *span = &plan->spans[i];
+            const Bcachefs_device device = _Bcachefs_device(this, span->csum.dev);
+            const uint64_t available = device.map && span->read_offset < (uint64_t)device.size ?
+                                       (uint64_t)device.size - span->read_offset : 0;
+            if (_Bcachefs_read_span_whole(this, span))
+            {
+                // Verified and decompressed straight from the mapping
+                jobs[nr_jobs++] = (_Bcachefs_decode_job){.span = span,
+                                                         .src = available ? device.map + span->read_offset : NULL,
+                                                         .src_len = available < span->read_size ? available :
+                                                                                                  span->read_size};
+                ret = ret && available >= span->read_size;
+                continue;
+            }
+            ret = Bcachefs_pread_dev(this, span->csum.dev, arena + span->arena_offset, span->size, span->offset) ==
+                  span->size && ret;
+        }
+        _Bcachefs_decode_jobs(this, plan, jobs, nr_jobs, arena);
+        free(jobs);
+        return ret && !plan->nr_csum_errors && !plan->nr_decode_errors;
+    }
+
+    qsort(plan->spans, plan->nr_spans, sizeof(Bcachefs_read_span), _Bcachefs_read_span_cmp);
+    // First pass to size the staging buffer and count the reads
+    for (uint32_t i = 0, j = 0; i < plan->nr_spans; i = j, ++nr_reads)
+    {
+        uint64_t start, end;
+        j = _Bcachefs_read_plan_group(plan, i, gap, &start, &end);
+        if (j - i > 1 || _Bcachefs_read_span_whole(this, &plan->spans[i]))
+        {
+            staging_size += end - start;
+        }
+    }
+
+    Bcachefs_read_req *reqs = malloc((nr_reads ? nr_reads : 1) * sizeof(Bcachefs_read_req));
+    uint32_t *firsts = malloc((nr_reads + 1) * sizeof(uint32_t));
+    uint8_t *staging = staging_size ? malloc(staging_size) : NULL;
+    if (reqs == NULL || firsts == NULL || (staging_size && staging == NULL))
+    {
+        free(jobs);
+        free(reqs);
+        free(firsts);
+        free(staging);
+        return 0;
+    }
+    uint64_t staging_used = 0;
+    nr_reads = 0;
+    for (uint32_t i = 0, j = 0; i < plan->nr_spans; i = j, ++nr_reads)
+    {
+        uint64_t start, end;
+        j = _Bcachefs_read_plan_group(plan, i, gap, &start, &end);
+        firsts[nr_reads] = i;
+        if (j - i == 1 && !_Bcachefs_read_span_whole(this, &plan->spans[i]))
+        {
+            // Lone spans are read in place
+            reqs[nr_reads] = (Bcachefs_read_req){.buf = arena + plan->spans[i].arena_offset,
+                                                 .size = plan->spans[i].size,
+                                                 .offset = plan->spans[i].offset,
+                                                 .buf_index = -1,
+                                                 .dev = plan->spans[i].csum.dev};
+        }
+        else
+        {
+            reqs[nr_reads] = (Bcachefs_read_req){.buf = staging + staging_used,
+                                                 .size = end - start,
+                                                 .offset = start,
+                                                 .buf_index = -1,
+                                                 .dev = plan->spans[i].csum.dev};
+            staging_used += end - start;
+        }
+    }
+    firsts[nr_reads] = plan->nr_spans;
+
+    // Reads in flight steer the least loaded read policy
+    for (uint32_t r = 0; r < nr_reads; ++r)
+    {
+        __atomic_fetch_add(&this->load->inflight[plan->spans[firsts[r]].csum.dev], reqs[r].size, __ATOMIC_RELAXED);
+    }
+    ret = Bcachefs_pread_many(this, reqs, nr_reads);
+    for (uint32_t r = 0; r < nr_reads; ++r)
+    {
+        __atomic_fetch_sub(&this->load->inflight[plan->spans[firsts[r]].csum.dev], reqs[r].size, __ATOMIC_RELAXED);
+    }
+    for (uint32_t r = 0; r < nr_reads; ++r)
+    {
+        if (reqs[r].buf == arena + plan->spans[firsts[r]].arena_offset)
+        {
+            continue;
+        }
+        for (uint32_t i = firsts[r]; i < firsts[r + 1]; ++i)
+        {
+            const Bcachefs_read_span *span = &plan->spans[i];
+            const uint64_t from = span->read_offset - reqs[r].offset;
+            const _Bcachefs_decode_job job = {.span = span,
+                                              .src = (const uint8_t*)reqs[r].buf + from,
+                                              .src_len = from >= reqs[r].result ? 0 :
+                                                         from + span->read_size > reqs[r].result ?
+                                                         reqs[r].result - from : span->read_size};
+            if (_Bcachefs_read_span_whole(this, span))
+            {
+                jobs[nr_jobs++] = job;
+                continue;
+            }
+            memcpy(arena + span->arena_offset, job.src, job.src_len);
+        }
+    }
+    _Bcachefs_decode_jobs(this, plan, jobs, nr_jobs, arena);
+    free(jobs);
+    free(reqs);
+    free(firsts);
+    free(staging);
+    return ret && !plan->nr_csum_errors && !plan->nr_decode_errors;
+}
+
+void Bcachefs_read_plan_free(Bcachefs_read_plan *plan)
+{
+    free(plan->spans);
+    free(plan->inline_spans);
+    free(plan->inline_data);
+    free(plan->offsets);
+    *plan = (Bcachefs_read_plan){0};
+}
+
+// Extent verification
+// -------------------
+
+void Bcachefs_set_verify(Bcachefs *this, int verify)
+{
+    this->verify = verify != 0;
+}
+
+void Bcachefs_set_decode_threads(Bcachefs *this, uint32_t nr_threads)
+{
+    this->decode_threads = nr_threads;
+}
+
+typedef struct {
+    uint64_t offset;
+    struct bch_csum csum;
+    uint8_t dev;
+    uint8_t used;
+} _Bcachefs_verify_region;
+
+typedef struct {
+    Bcachefs_verify_stats stats;
+    Bcachefs_verify_cb cb;
+    void *arg;
+    pthread_mutex_t lock;
+    _Bcachefs_verify_region *regions;           //! open addressed set of the regions shared by several keys
+    uint64_t nr_regions;
+    uint64_t regions_capacity;
+} _Bcachefs_verify_state;
+
+static _Bcachefs_verify_region *_Bcachefs_verify_region_slot(_Bcachefs_verify_region *regions, uint64_t capacity,
+                                                            const Bcachefs_extent_csum *csum)
+{
+    uint64_t i = _hash_mix(csum->offset, csum->dev ^ csum->csum.lo);
+    for (;; ++i)
+    {
+        _Bcachefs_verify_region *region = &regions[i & (capacity - 1)];
+        if (!region->used || (region->offset == csum->offset && region->dev == csum->dev &&
+                              region->csum.lo == csum->csum.lo && region->csum.hi == csum->csum.hi))
+        {
+            return region;
+        }
+    }
+}
+
+// Records the region of a key which only covers part of it, so the keys left
+// by splitting an extent verify it once. Returns 0 if another key already
+// claimed the region
+static int _Bcachefs_verify_claim(_Bcachefs_verify_state *state, const Bcachefs_extent_csum *csum)
+{
+    int ret = 1;
+    pthread_mutex_lock(&state->lock);
+    if ((state->nr_regions + 1) * 2 > state->regions_capacity)
+    {
+        const uint64_t capacity = state->regions_capacity ? state->regions_capacity * 2 : 256;
+        _Bcachefs_verify_region *regions = calloc(capacity, sizeof(_Bcachefs_verify_region));
+        if (regions)
+        {
+            for (uint64_t i = 0; i < state->regions_capacity; ++i)
+            {
+                const _Bcachefs_verify_region *region = &state->regions[i];
+                if (region->used)
+                {
+                    const Bcachefs_extent_csum key = {.offset = region->offset, .csum = region->csum, .dev = region->dev};
+                    *_Bcachefs_verify_region_slot(regions, capacity, &key) = *region;
+                }
+            }
+            free(state->regions);
+            state->regions = regions;
+            state->regions_capacity = capacity;
+        }
+    }
+    // When out of memory, the region is verified once per key
+    if (state->nr_regions < state->regions_capacity / 2)
+    {
+        _Bcachefs_verify_region *region = _Bcachefs_verify_region_slot(state->regions, state->regions_capacity, csum);
+        ret = !region->used;
+        if (ret)
+        {
+            *region = (_Bcachefs_verify_region){.offset = csum->offset, .csum = csum->csum, .dev = csum->dev, .used = 1};
+            ++state->nr_regions;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return ret;
+}
+
+static int _Bcachefs_verify_worker(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t partition, void *arg)
+{
+    (void)partition;
+
+    _Bcachefs_verify_state *state = arg;
+    Bcachefs_verify_stats stats = {0};
+    uint8_t *buffer = NULL;
+    uint64_t buffer_size = 0;
+    while (Bcachefs_iter_next(this, iter))
+    {
+        if (((const struct bkey*)Bcachefs_iter_leaf(iter)->bkey)->type == KEY_TYPE_reflink_p)
+        {
+            // Verified once with the indirect extents of the reflink btree
+            continue;
+        }
+        Bcachefs_extent extent;
+        Bcachefs_extent_csum csum;
+        struct bch_csum computed;
+        const uint8_t *data = NULL;
+        _Bcachefs_iter_decode_extent(this, iter, NULL, &extent, &csum);
+        if (csum.size == 0)
+        {
+            // Inline data, covered by the checksum of its btree node
+            continue;
+        }
+        if ((csum.data_offset || extent.size < csum.uncompressed_size) && !_Bcachefs_verify_claim(state, &csum))
+        {
+            continue;
+        }
+        ++stats.extents;
+        if (csum.csum_type == BCH_CSUM_none || csum.csum_type == BCH_CSUM_chacha20_poly1305_80 ||
+                csum.csum_type == BCH_CSUM_chacha20_poly1305_128 || csum.csum_type >= BCH_CSUM_NR)
+        {
+            ++stats.skipped;
+            continue;
+        }
+        if (this->map)
+        {
+            // Hash straight from the mapping
+            data = Bcachefs_map_range_dev(this, csum.dev, csum.offset, csum.size);
+        }
+        else
+        {
+            if (csum.size > buffer_size)
+            {
+                free(buffer);
+                buffer_size = csum.size;
+                buffer = malloc(buffer_size);
+                if (buffer == NULL)
+                {
+                    buffer_size = 0;
+                }
+            }
+            if (buffer && Bcachefs_pread_dev(this, csum.dev, buffer, csum.size, csum.offset) == csum.size)
+            {
+                data = buffer;
+            }
+        }
+        if (data)
+        {
+            benz_bch_checksum(csum.csum_type, data, csum.size, &computed);
+            stats.bytes += csum.size;
+        }
+        if (data && computed.lo == csum.csum.lo && computed.hi == csum.csum.hi)
+        {
+            ++stats.verified;
+            continue;
+        }
+        ++stats.errors;
+        if (state->cb)
+        {
+            pthread_mutex_lock(&state->lock);
+            state->cb(&extent, state->arg);
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+    free(buffer);
+    __atomic_fetch_add(&state->stats.extents, stats.extents, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->stats.verified, stats.verified, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->stats.skipped, stats.skipped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->stats.errors, stats.errors, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->stats.bytes, stats.bytes, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Checks the stored checksum of every extent of the image with `nr_threads`
+// workers, 0 for one per cpu. A checksummed region referenced by several keys,
+// as left by splitting an extent, is checked and counted once. Indirect
+// extents shared through reflink are checked once, from the reflink btree, and
+// reported with inode 0 and their reflink index as file offset. Extents
+// failing verification are reported to `cb` when it is not NULL. Returns 0 if
+// the extents btree could not be scanned, checksum errors are only reported in
+// `stats`
+int Bcachefs_verify(const Bcachefs *this, uint32_t nr_threads, Bcachefs_verify_stats *stats,
+                    Bcachefs_verify_cb cb, void *arg)
+{
+    _Bcachefs_verify_state state = {.cb = cb, .arg = arg, .lock = PTHREAD_MUTEX_INITIALIZER};
+    Bcachefs_iterator iter = {0};
+    int ret = Bcachefs_scan_btree(this, BTREE_ID_extents, nr_threads, NULL, _Bcachefs_verify_worker, &state);
+    // Only images with reflinked files have a reflink btree
+    const int reflink = Bcachefs_iter(this, &iter, BTREE_ID_reflink);
+    Bcachefs_iter_fini(this, &iter);
+    if (ret && reflink)
+    {
+        ret = Bcachefs_scan_btree(this, BTREE_ID_reflink, nr_threads, NULL, _Bcachefs_verify_worker, &state);
+    }
+    free(state.regions);
+    *stats = state.stats;
+    return ret;
+}
+
+// Fetch the string hash parameters of a directory from its inode
+int Bcachefs_hash_info(const Bcachefs *this, uint64_t inode, struct bch_hash_info *info)
+{
+    Bcachefs_iterator iter = {0};
+    const struct bch_val *bch_val = NULL;
+    int ret = 0;
+    if (Bcachefs_iter(this, &iter, BTREE_ID_inodes) &&
+            Bcachefs_iter_seek(this, &iter, SPOS(0, inode, 0), SPOS(0, inode, (uint32_t)-1)))
+    {
+        bch_val = Bcachefs_iter_next(this, &iter);
+    }
+    if (bch_val && ((const struct bkey*)Bcachefs_iter_leaf(&iter)->bkey)->type == KEY_TYPE_inode)
+    {
+        const struct bch_inode *bch_inode = (const void*)bch_val;
+        uint32_t bi_flags = 0;
+        memcpy(&bi_flags, &bch_inode->bi_flags, sizeof(bi_flags));
+        info->type = (uint8_t)benz_get_flag_bits(bi_flags, BCH_INODE_STR_HASH_OFFSET,
+                                                 BCH_INODE_STR_HASH_OFFSET + BCH_INODE_STR_HASH_BITS);
+        memcpy(&info->seed, &bch_inode->bi_hash_seed, sizeof(info->seed));
+        ret = 1;
+    }
+    Bcachefs_iter_fini(this, &iter);
+    return ret;
+}
+
+// Finds the dirent `name` in the directory `parent_inode` without scanning
+// the directory. Dirents are stored at the hash of their name, collisions are
+// resolved by linear probing into the next free slot and deleted entries
+// leave hash_whiteout keys behind so the probing can go past them. Returns a
+// dirent with a null inode if the name is not found, the name of the returned
+// dirent points to `name`
+Bcachefs_dirent Bcachefs_lookup_dirent(const Bcachefs *this, uint64_t parent_inode, const uint8_t *name, uint8_t name_len)
+{
+    struct bch_hash_info info = {0};
+    Bcachefs_iterator iter = {0};
+    if (!Bcachefs_hash_info(this, parent_inode, &info) || info.type >= BCH_STR_HASH_NR ||
+            info.type == BCH_STR_HASH_siphash_old)
+    {
+        return (Bcachefs_dirent){0};
+    }
+    uint64_t slot = benz_bch_dirent_hash(&info, name, name_len);
+    if (!Bcachefs_iter(this, &iter, BTREE_ID_dirents))
+    {
+        Bcachefs_iter_fini(this, &iter);
+        return (Bcachefs_dirent){0};
+    }
+    iter.whiteouts = 1;
+    Bcachefs_iter_seek(this, &iter, SPOS(parent_inode, slot, 0),
+                       SPOS(parent_inode, (uint64_t)-1, (uint32_t)-1));
+    while (Bcachefs_iter_next(this, &iter))
+    {
+        const Bcachefs_iter_frame *leaf = Bcachefs_iter_leaf(&iter);
+        const struct bkey *bkey = leaf->bkey;
+        const struct bkey_local bkey_local = benz_bch_unpack_bkey(bkey, &leaf->unpack_plan);
+        if (bkey_local.p.offset > slot)
+        {
+            // Empty slot, the name is not in the table
+            break;
+        }
+        slot = bkey_local.p.offset + 1;
+        if (bkey->type != KEY_TYPE_dirent)
+        {
+            continue;
+        }
+        Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(this, &iter);
+        if (dirent.name_len == name_len && memcmp(dirent.name, name, name_len) == 0)
+        {
+            Bcachefs_iter_fini(this, &iter);
+            return (Bcachefs_dirent){.parent_inode = dirent.parent_inode,
+                                     .inode = dirent.inode,
+                                     .type = dirent.type,
+                                     .name = name,
+                                     .name_len = name_len};
+        }
+    }
+    Bcachefs_iter_fini(this, &iter);
+    return (Bcachefs_dirent){0};
+}
+
+// Namespace index
+// ---------------
+
+static const uint8_t _bcachefs_index_magic[8] = {'B', 'C', 'H', 'I', 'N', 'D', 'E', 'X'};
+
+// Growable buffer the keys of a scan partition are collected in
+typedef struct {
+    uint8_t *data;
+    uint64_t size;
+    uint64_t capacity;
+} _Bcachefs_index_buf;
+
+static int _Bcachefs_index_buf_append(_Bcachefs_index_buf *buf, const void *data, uint64_t size)
+{
+    if (buf->size + size > buf->capacity)
+    {
+        uint64_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity < buf->size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(buf->data, capacity);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 1;
+}
+
+// Columns of the keys of a scan partition:
+//  inodes  (inode, size)
+//  extents (inode, file_offset, offset, size, compression, inline size, inline data)
+//  dirents (parent, inode, type, name length, names)
+#define BCACHEFS_INDEX_PART_COLUMNS 7
+
+typedef struct {
+    _Bcachefs_index_buf columns[BCACHEFS_INDEX_PART_COLUMNS];
+    uint64_t count;
+} _Bcachefs_index_part;
+
+typedef struct {
+    _Bcachefs_index_part *parts;
+    uint32_t nr_parts;
+} _Bcachefs_index_scan_state;
+
+static int _Bcachefs_index_scan_prepare(uint32_t nr_partitions, void *arg)
+{
+    _Bcachefs_index_scan_state *state = arg;
+    state->parts = calloc(nr_partitions ? nr_partitions : 1, sizeof(_Bcachefs_index_part));
+    state->nr_parts = state->parts ? nr_partitions : 0;
+    return state->parts != NULL;
+}
+
+static int _Bcachefs_index_scan_cb(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t partition, void *arg)
+{
+    _Bcachefs_index_part *part = &((_Bcachefs_index_scan_state*)arg)->parts[partition];
+    _Bcachefs_index_buf *c = part->columns;
+    int ret = 1;
+    while (ret && Bcachefs_iter_next(this, iter))
+    {
+        switch ((int)iter->type)
+        {
+        case BTREE_ID_inodes:
+        {
+            const Bcachefs_inode inode = Bcachefs_iter_make_inode(this, iter);
+            ret = _Bcachefs_index_buf_append(&c[0], &inode.inode, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[1], &inode.size, sizeof(uint64_t));
+            break;
+        }
+        case BTREE_ID_extents:
+        {
+            const Bcachefs_extent extent = Bcachefs_iter_make_extent(this, iter);
+            uint64_t inline_size = 0;
+            const uint8_t *inline_data = Bcachefs_iter_inline_data(this, iter, &inline_size);
+            ret = _Bcachefs_index_buf_append(&c[0], &extent.inode, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[1], &extent.file_offset, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[2], &extent.offset, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[3], &extent.size, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[4], &extent.compression_type, sizeof(uint8_t)) &&
+                  _Bcachefs_index_buf_append(&c[5], &inline_size, sizeof(uint64_t)) &&
+                  (inline_data == NULL || _Bcachefs_index_buf_append(&c[6], inline_data, inline_size));
+            break;
+        }
+        case BTREE_ID_dirents:
+        {
+            const Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(this, iter);
+            const uint64_t name_len = dirent.name_len;
+            ret = _Bcachefs_index_buf_append(&c[0], &dirent.parent_inode, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[1], &dirent.inode, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[2], &dirent.type, sizeof(uint8_t)) &&
+                  _Bcachefs_index_buf_append(&c[3], &name_len, sizeof(uint64_t)) &&
+                  _Bcachefs_index_buf_append(&c[4], dirent.name, name_len);
+            break;
+        }
+        default:
+            ret = 0;
+        }
+        part->count += ret;
+    }
+    return ret;
+}
+
+static void _Bcachefs_index_parts_free(_Bcachefs_index_part *parts, uint32_t nr_parts)
+{
+    for (uint32_t p = 0; parts && p < nr_parts; ++p)
+    {
+        for (int i = 0; i < BCACHEFS_INDEX_PART_COLUMNS; ++i)
+        {
+            free(parts[p].columns[i].data);
+        }
+    }
+    free(parts);
+}
+
+// Scans a whole btree into one set of columns per partition, in key order
+static _Bcachefs_index_part *_Bcachefs_index_scan(const Bcachefs *this, enum btree_id type, uint32_t nr_threads,
+                                                  uint32_t *nr_parts)
+{
+    _Bcachefs_index_scan_state state = {0};
+    if (!Bcachefs_scan_btree(this, type, nr_threads, _Bcachefs_index_scan_prepare, _Bcachefs_index_scan_cb, &state))
+    {
+        _Bcachefs_index_parts_free(state.parts, state.nr_parts);
+        state = (_Bcachefs_index_scan_state){0};
+    }
+    *nr_parts = state.nr_parts;
+    return state.parts;
+}
+
+static uint64_t _Bcachefs_index_parts_count(const _Bcachefs_index_part *parts, uint32_t nr_parts, int column,
+                                            uint64_t *column_size)
+{
+    uint64_t count = 0;
+    *column_size = 0;
+    for (uint32_t p = 0; p < nr_parts; ++p)
+    {
+        count += parts[p].count;
+        *column_size += parts[p].columns[column].size;
+    }
+    return count;
+}
+
+// Concatenates a column of the partitions into `dst`
+static void _Bcachefs_index_parts_gather(const _Bcachefs_index_part *parts, uint32_t nr_parts, int column,
+                                         uint8_t *dst)
+{
+    for (uint32_t p = 0; p < nr_parts; ++p)
+    {
+        memcpy(dst, parts[p].columns[column].data, parts[p].columns[column].size);
+        dst += parts[p].columns[column].size;
+    }
+}
+
+// Turns a column of lengths into n + 1 offsets
+static void _Bcachefs_index_parts_offsets(const _Bcachefs_index_part *parts, uint32_t nr_parts, int column,
+                                          uint64_t *dst)
+{
+    uint64_t offset = 0;
+    for (uint32_t p = 0; p < nr_parts; ++p)
+    {
+        const uint64_t *lengths = (const void*)parts[p].columns[column].data;
+        for (uint64_t i = 0; i < parts[p].count; ++i)
+        {
+            *dst++ = offset;
+            offset += lengths[i];
+        }
+    }
+    *dst = offset;
+}
+
+// Places the tables after the header and returns the size of the index
+static uint64_t _Bcachefs_index_layout(Bcachefs_index_header *header)
+{
+    const uint64_t sizes[BCACHEFS_INDEX_NR_TABLES] = {
+        [BCACHEFS_INDEX_INODE] = header->nr_inodes * sizeof(uint64_t),
+        [BCACHEFS_INDEX_INODE_SIZE] = header->nr_inodes * sizeof(uint64_t),
+        [BCACHEFS_INDEX_INODE_EXTENTS] = (header->nr_inodes + 1) * sizeof(uint64_t),
+        [BCACHEFS_INDEX_INODE_CHILDREN] = (header->nr_inodes + 1) * sizeof(uint64_t),
+        [BCACHEFS_INDEX_EXTENT_FILE_OFFSET] = header->nr_extents * sizeof(uint64_t),
+        [BCACHEFS_INDEX_EXTENT_OFFSET] = header->nr_extents * sizeof(uint64_t),
+        [BCACHEFS_INDEX_EXTENT_SIZE] = header->nr_extents * sizeof(uint64_t),
+        [BCACHEFS_INDEX_EXTENT_INLINE] = (header->nr_extents + 1) * sizeof(uint64_t),
+        [BCACHEFS_INDEX_EXTENT_COMPRESSION] = header->nr_extents * sizeof(uint8_t),
+        [BCACHEFS_INDEX_INLINE_DATA] = header->inline_size,
+        [BCACHEFS_INDEX_DIRENT_PARENT] = header->nr_dirents * sizeof(uint64_t),
+        [BCACHEFS_INDEX_DIRENT_INODE] = header->nr_dirents * sizeof(uint64_t),
+        [BCACHEFS_INDEX_DIRENT_NAME] = (header->nr_dirents + 1) * sizeof(uint64_t),
+        [BCACHEFS_INDEX_DIRENT_TYPE] = header->nr_dirents * sizeof(uint8_t),
+        [BCACHEFS_INDEX_NAMES] = header->names_size,
+        [BCACHEFS_INDEX_BUCKETS] = header->nr_buckets * sizeof(uint32_t),
+    };
+    uint64_t offset = (sizeof(Bcachefs_index_header) + 7) & ~7ULL;
+    for (int t = 0; t < BCACHEFS_INDEX_NR_TABLES; ++t)
+    {
+        header->tables[t] = offset;
+        offset += (sizes[t] + 7) & ~7ULL;
+    }
+    return offset;
+}
+
+// Points the tables of `index` into `base`, which must hold a whole index
+// built from the same filesystem in its current state. The tables are trusted
+// once the header matches
+static int _Bcachefs_index_bind(const Bcachefs *this, Bcachefs_index *index, const uint8_t *base, uint64_t size)
+{
+    const Bcachefs_index_header *header = (const void*)base;
+    Bcachefs_index_header layout;
+    *index = (Bcachefs_index){0};
+    if (size < sizeof(Bcachefs_index_header) || memcmp(header->magic, _bcachefs_index_magic, sizeof(header->magic)) ||
+            header->version != BCACHEFS_INDEX_VERSION || header->nr_tables != BCACHEFS_INDEX_NR_TABLES ||
+            memcmp(&header->uuid, &this->sb->uuid, sizeof(struct uuid)) || header->seq != this->sb->seq ||
+            header->image_size != (uint64_t)this->size ||
+            header->nr_buckets <= header->nr_dirents || (header->nr_buckets & (header->nr_buckets - 1)))
+    {
+        return 0;
+    }
+    layout = *header;
+    if (_Bcachefs_index_layout(&layout) != size || header->size != size ||
+            memcmp(layout.tables, header->tables, sizeof(layout.tables)))
+    {
+        return 0;
+    }
+#define TABLE(t) ((const void*)(base + header->tables[t]))
+    *index = (Bcachefs_index){.base = base,
+                              .size = size,
+                              .header = header,
+                              .inode = TABLE(BCACHEFS_INDEX_INODE),
+                              .inode_size = TABLE(BCACHEFS_INDEX_INODE_SIZE),
+                              .inode_extents = TABLE(BCACHEFS_INDEX_INODE_EXTENTS),
+                              .inode_children = TABLE(BCACHEFS_INDEX_INODE_CHILDREN),
+                              .extent_file_offset = TABLE(BCACHEFS_INDEX_EXTENT_FILE_OFFSET),
+                              .extent_offset = TABLE(BCACHEFS_INDEX_EXTENT_OFFSET),
+                              .extent_size = TABLE(BCACHEFS_INDEX_EXTENT_SIZE),
+                              .extent_inline = TABLE(BCACHEFS_INDEX_EXTENT_INLINE),
+                              .extent_compression = TABLE(BCACHEFS_INDEX_EXTENT_COMPRESSION),
+                              .inline_data = TABLE(BCACHEFS_INDEX_INLINE_DATA),
+                              .dirent_parent = TABLE(BCACHEFS_INDEX_DIRENT_PARENT),
+                              .dirent_inode = TABLE(BCACHEFS_INDEX_DIRENT_INODE),
+                              .dirent_name = TABLE(BCACHEFS_INDEX_DIRENT_NAME),
+                              .dirent_type = TABLE(BCACHEFS_INDEX_DIRENT_TYPE),
+                              .names = TABLE(BCACHEFS_INDEX_NAMES),
+                              .buckets = TABLE(BCACHEFS_INDEX_BUCKETS)};
+#undef TABLE
+    return 1;
+}
+
+// Inodes are the union of the keys of the inodes btree, of the inodes with
+// extents and of the directories with dirents, all of them sorted. Counts
+// them, and fills the inode tables when `header` is not NULL
+static uint64_t _Bcachefs_index_merge_inodes(const uint64_t *keys, const uint64_t *sizes, uint64_t nr_keys,
+                                             const uint64_t *extents, uint64_t nr_extents,
+                                             const uint64_t *parents, uint64_t nr_dirents,
+                                             uint8_t *base, const Bcachefs_index_header *header)
+{
+    uint64_t *inode = base ? (void*)(base + header->tables[BCACHEFS_INDEX_INODE]) : NULL;
+    uint64_t *inode_size = base ? (void*)(base + header->tables[BCACHEFS_INDEX_INODE_SIZE]) : NULL;
+    uint64_t *inode_extents = base ? (void*)(base + header->tables[BCACHEFS_INDEX_INODE_EXTENTS]) : NULL;
+    uint64_t *inode_children = base ? (void*)(base + header->tables[BCACHEFS_INDEX_INODE_CHILDREN]) : NULL;
+    uint64_t k = 0, e = 0, d = 0, n = 0;
+    while (k < nr_keys || e < nr_extents || d < nr_dirents)
+    {
+        uint64_t next = (uint64_t)-1;
+        next = k < nr_keys && keys[k] < next ? keys[k] : next;
+        next = e < nr_extents && extents[e] < next ? extents[e] : next;
+        next = d < nr_dirents && parents[d] < next ? parents[d] : next;
+        uint64_t size = 0;
+        if (base)
+        {
+            inode[n] = next;
+            inode_extents[n] = e;
+            inode_children[n] = d;
+        }
+        // Keys of the same inode in several snapshots, the last one wins
+        for (; k < nr_keys && keys[k] == next; ++k)
+        {
+            size = sizes[k];
+        }
+        for (; e < nr_extents && extents[e] == next; ++e);
+        for (; d < nr_dirents && parents[d] == next; ++d);
+        if (base)
+        {
+            inode_size[n] = size;
+        }
+        ++n;
+    }
+    if (base)
+    {
+        inode_extents[n] = nr_extents;
+        inode_children[n] = nr_dirents;
+    }
+    return n;
+}
+
+static uint64_t _Bcachefs_index_hash(uint64_t parent_inode, const uint8_t *name, uint64_t name_len)
+{
+    return benz_xxh64(parent_inode, name, name_len);
+}
+
+// Builds the index of the namespace of the filesystem with `nr_threads`
+// workers scanning the btrees, 0 for one per cpu. The index is released with
+// Bcachefs_index_free
+int Bcachefs_index_build(const Bcachefs *this, uint32_t nr_threads, Bcachefs_index *index)
+{
+    uint32_t nr_inode_parts = 0, nr_extent_parts = 0, nr_dirent_parts = 0;
+    _Bcachefs_index_part *inode_parts = _Bcachefs_index_scan(this, BTREE_ID_inodes, nr_threads, &nr_inode_parts);
+    _Bcachefs_index_part *extent_parts = _Bcachefs_index_scan(this, BTREE_ID_extents, nr_threads, &nr_extent_parts);
+    _Bcachefs_index_part *dirent_parts = _Bcachefs_index_scan(this, BTREE_ID_dirents, nr_threads, &nr_dirent_parts);
+    uint64_t *keys = NULL, *sizes = NULL, *extents = NULL, *parents = NULL;
+    uint8_t *base = NULL;
+    Bcachefs_index_header header = {.version = BCACHEFS_INDEX_VERSION,
+                                    .nr_tables = BCACHEFS_INDEX_NR_TABLES,
+                                    .uuid = this->sb->uuid,
+                                    .seq = this->sb->seq,
+                                    .image_size = (uint64_t)this->size};
+    uint64_t unused = 0;
+    int ret = inode_parts && extent_parts && dirent_parts;
+    *index = (Bcachefs_index){0};
+    memcpy(header.magic, _bcachefs_index_magic, sizeof(header.magic));
+    if (ret)
+    {
+        const uint64_t nr_keys = _Bcachefs_index_parts_count(inode_parts, nr_inode_parts, 0, &unused);
+        header.nr_extents = _Bcachefs_index_parts_count(extent_parts, nr_extent_parts, 6, &header.inline_size);
+        header.nr_dirents = _Bcachefs_index_parts_count(dirent_parts, nr_dirent_parts, 4, &header.names_size);
+        // Half full at most so probing stays short
+        for (header.nr_buckets = 16; header.nr_buckets < header.nr_dirents * 2; header.nr_buckets *= 2);
+        keys = malloc((nr_keys ? nr_keys : 1) * sizeof(uint64_t));
+        sizes = malloc((nr_keys ? nr_keys : 1) * sizeof(uint64_t));
+        extents = malloc((header.nr_extents ? header.nr_extents : 1) * sizeof(uint64_t));
+        parents = malloc((header.nr_dirents ? header.nr_dirents : 1) * sizeof(uint64_t));
+        ret = keys && sizes && extents && parents && header.nr_dirents < UINT32_MAX;
+        if (ret)
+        {
+            _Bcachefs_index_parts_gather(inode_parts, nr_inode_parts, 0, (void*)keys);
+            _Bcachefs_index_parts_gather(inode_parts, nr_inode_parts, 1, (void*)sizes);
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 0, (void*)extents);
+            _Bcachefs_index_parts_gather(dirent_parts, nr_dirent_parts, 0, (void*)parents);
+            header.nr_inodes = _Bcachefs_index_merge_inodes(keys, sizes, nr_keys, extents, header.nr_extents,
+                                                            parents, header.nr_dirents, NULL, NULL);
+            header.size = _Bcachefs_index_layout(&header);
+            base = calloc(1, header.size);
+            ret = base != NULL;
         }
-        else if (bch_val)
+        if (ret)
         {
-            return bch_val;
+#define TABLE(t) ((void*)(base + header.tables[t]))
+            memcpy(base, &header, sizeof(header));
+            _Bcachefs_index_merge_inodes(keys, sizes, nr_keys, extents, header.nr_extents,
+                                         parents, header.nr_dirents, base, &header);
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 1, TABLE(BCACHEFS_INDEX_EXTENT_FILE_OFFSET));
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 2, TABLE(BCACHEFS_INDEX_EXTENT_OFFSET));
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 3, TABLE(BCACHEFS_INDEX_EXTENT_SIZE));
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 4, TABLE(BCACHEFS_INDEX_EXTENT_COMPRESSION));
+            _Bcachefs_index_parts_offsets(extent_parts, nr_extent_parts, 5, TABLE(BCACHEFS_INDEX_EXTENT_INLINE));
+            _Bcachefs_index_parts_gather(extent_parts, nr_extent_parts, 6, TABLE(BCACHEFS_INDEX_INLINE_DATA));
+            memcpy(TABLE(BCACHEFS_INDEX_DIRENT_PARENT), parents, header.nr_dirents * sizeof(uint64_t));
+            _Bcachefs_index_parts_gather(dirent_parts, nr_dirent_parts, 1, TABLE(BCACHEFS_INDEX_DIRENT_INODE));
+            _Bcachefs_index_parts_gather(dirent_parts, nr_dirent_parts, 2, TABLE(BCACHEFS_INDEX_DIRENT_TYPE));
+            _Bcachefs_index_parts_offsets(dirent_parts, nr_dirent_parts, 3, TABLE(BCACHEFS_INDEX_DIRENT_NAME));
+            _Bcachefs_index_parts_gather(dirent_parts, nr_dirent_parts, 4, TABLE(BCACHEFS_INDEX_NAMES));
+            const uint64_t *name_offset = TABLE(BCACHEFS_INDEX_DIRENT_NAME);
+            const uint8_t *names = TABLE(BCACHEFS_INDEX_NAMES);
+            uint32_t *buckets = TABLE(BCACHEFS_INDEX_BUCKETS);
+#undef TABLE
+            for (uint64_t i = 0; i < header.nr_dirents; ++i)
+            {
+                uint64_t slot = _Bcachefs_index_hash(parents[i], names + name_offset[i],
+                                                     name_offset[i + 1] - name_offset[i]);
+                for (slot &= header.nr_buckets - 1; buckets[slot]; slot = (slot + 1) & (header.nr_buckets - 1));
+                buckets[slot] = (uint32_t)(i + 1);
+            }
+            ret = _Bcachefs_index_bind(this, index, base, header.size);
         }
-        break;
-    default:
-        return NULL;
     }
-    if (iter->bkey == NULL)
+    _Bcachefs_index_parts_free(inode_parts, nr_inode_parts);
+    _Bcachefs_index_parts_free(extent_parts, nr_extent_parts);
+    _Bcachefs_index_parts_free(dirent_parts, nr_dirent_parts);
+    free(keys);
+    free(sizes);
+    free(extents);
+    free(parents);
+    if (!ret)
+    {
+        free(base);
+    }
+    return ret;
+}
+
+// Writes the index to `path` through a uniquely named temporary file renamed
+// over it, so processes or threads opening or saving the index concurrently
+// never see a partial one
+int Bcachefs_index_save(const Bcachefs_index *index, const char *path)
+{
+    const size_t tmp_len = strlen(path) + sizeof(".XXXXXX");
+    char *tmp = malloc(tmp_len);
+    int fd = -1;
+    int ret = index->header != NULL && tmp != NULL;
+    if (ret)
     {
-        iter->bset = Bcachefs_iter_next_bset(this, iter);
+        snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+        fd = mkstemp(tmp);
+        // mkstemp creates the file readable by its owner only
+        ret = fd >= 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0 && fchmod(fd, 0644) == 0;
     }
-    if (iter->bset == NULL)
+    for (uint64_t written = 0; ret && written < index->size;)
     {
-        iter->btree_ptr = NULL;
+        const ssize_t n = write(fd, index->base + written, index->size - written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        ret = n > 0;
+        written += ret ? (uint64_t)n : 0;
+    }
+    if (fd >= 0)
+    {
+        ret = close(fd) == 0 && ret;
+        ret = ret && rename(tmp, path) == 0;
+        if (!ret)
+        {
+            unlink(tmp);
+        }
     }
-    return Bcachefs_iter_next(this, iter);
+    free(tmp);
+    return ret;
 }
 
-const struct jset_entry *Bcachefs_iter_next_jset_entry(const Bcachefs *this, Bcachefs_iterator *iter)
+// Maps the index held by `fd` and closes it
+static int _Bcachefs_index_map(const Bcachefs *this, Bcachefs_index *index, int fd)
 {
-    const struct jset_entry *jset_entry = iter->jset_entry;
-    const struct bch_sb_field *sb_field_clean = (const void*)benz_bch_next_sb_field(
-                this->sb,
-                NULL,
-                BCH_SB_FIELD_clean);
+    struct stat st;
+    void *base = MAP_FAILED;
+    *index = (Bcachefs_index){0};
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(Bcachefs_index_header))
+    {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return 0;
+    }
+    if (!_Bcachefs_index_bind(this, index, base, (uint64_t)st.st_size))
+    {
+        munmap(base, (size_t)st.st_size);
+        return 0;
+    }
+    index->mapped = 1;
+    return 1;
+}
 
-    // if sb_field_clean == NULL then the archive needs to be fsck
-    // TODO: we need to return an error all the way back to python here
-    assert(sb_field_clean != NULL);
-    jset_entry = benz_bch_next_jset_entry(sb_field_clean,
-                                          sizeof(struct bch_sb_field_clean),
-                                          jset_entry,
-                                          BCH_JSET_ENTRY_btree_root);
+// Maps the index saved at `path`. The pages of the mapping are shared by all
+// the processes using the same index. Returns 0 if the file is missing or was
+// not built from the filesystem in its current state
+int Bcachefs_index_load(const Bcachefs *this, Bcachefs_index *index, const char *path)
+{
+    return _Bcachefs_index_map(this, index, open(path, O_RDONLY | O_CLOEXEC));
+}
 
-    assert(jset_entry != NULL);
-    for (; jset_entry && jset_entry->btree_id != iter->type;
-         jset_entry = benz_bch_next_jset_entry(sb_field_clean,
-                                               sizeof(struct bch_sb_field_clean),
-                                               jset_entry,
-                                               BCH_JSET_ENTRY_btree_root)) {}
-    return jset_entry;
+// Copies an index handed over as bytes, like one pickled by another process,
+// returns 0 if it does not match the filesystem
+int Bcachefs_index_copy(const Bcachefs *this, Bcachefs_index *index, const void *data, uint64_t size)
+{
+    uint8_t *base = malloc(size ? size : 1);
+    *index = (Bcachefs_index){0};
+    if (base == NULL)
+    {
+        return 0;
+    }
+    memcpy(base, data, size);
+    if (!_Bcachefs_index_bind(this, index, base, size))
+    {
+        free(base);
+        return 0;
+    }
+    return 1;
 }
 
-const struct bch_btree_ptr_v2 *Bcachefs_iter_next_btree_ptr(const Bcachefs *this, Bcachefs_iterator *iter)
+// Copies the index in a new POSIX shared memory object `name`, which other
+// processes attach to with Bcachefs_index_attach. The object lives until it
+// is removed with Bcachefs_index_unshare, mappings outlive it
+int Bcachefs_index_share(const Bcachefs_index *index, const char *name)
 {
-    (void)this;
-    const struct jset_entry *jset_entry = iter->jset_entry;
-    const struct bch_btree_ptr_v2 *btree_ptr = iter->btree_ptr;
-    if (btree_ptr)
+    void *base = MAP_FAILED;
+    int fd = index->header ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : -1;
+    if (fd < 0)
     {
-        btree_ptr = (const void*)benz_bch_next_bch_val(&jset_entry->start->k,
-                                                       (const void*)btree_ptr,
-                                                       sizeof(struct bch_btree_ptr_v2));
+        return 0;
+    }
+    if (ftruncate(fd, (off_t)index->size) == 0)
+    {
+        base = mmap(NULL, (size_t)index->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return 0;
+    }
+    memcpy(base, index->base, index->size);
+    munmap(base, (size_t)index->size);
+    return 1;
+}
+
+// Maps the index shared under `name`, returns 0 if there is none or if it
+// does not match the filesystem
+int Bcachefs_index_attach(const Bcachefs *this, Bcachefs_index *index, const char *name)
+{
+    return _Bcachefs_index_map(this, index, shm_open(name, O_RDONLY, 0));
+}
+
+int Bcachefs_index_unshare(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+void Bcachefs_index_free(Bcachefs_index *index)
+{
+    if (index->mapped)
+    {
+        munmap((void*)index->base, (size_t)index->size);
     }
     else
     {
-        btree_ptr = (const void*)benz_bch_first_bch_val(&jset_entry->start->k, BKEY_U64s);
+        free((void*)index->base);
     }
-    const struct bch_val *bch_val = (const void*)btree_ptr;
-    for (; bch_val && btree_ptr->start->unused;
-         bch_val = benz_bch_next_bch_val(&jset_entry->start->k,
-                                         bch_val,
-                                         sizeof(struct bch_btree_ptr_v2)),
-         btree_ptr = (const void*)bch_val) {}
-    return btree_ptr;
+    *index = (Bcachefs_index){0};
 }
 
-const struct bset *Bcachefs_iter_next_bset(const Bcachefs *this, Bcachefs_iterator *iter)
+// Position of `inode` in the inode tables, -1 if the index does not know it
+int64_t Bcachefs_index_find_inode(const Bcachefs_index *index, uint64_t inode)
 {
-    const struct btree_node *btree_node = iter->btree_node;
-    const void *btree_node_end = (const uint8_t*)iter->btree_node + iter->btree_ptr->sectors_written * BCH_SECTOR_SIZE;
-    const struct bset *bset = iter->bset;
-    return benz_bch_next_bset(btree_node, btree_node_end, bset, this->sb);
+    uint64_t lo = 0, hi = index->header ? index->header->nr_inodes : 0;
+    while (lo < hi)
+    {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (index->inode[mid] < inode)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return index->header && lo < index->header->nr_inodes && index->inode[lo] == inode ? (int64_t)lo : -1;
 }
 
-Bcachefs_extent Bcachefs_iter_make_extent(const Bcachefs *this, Bcachefs_iterator *iter)
+// Position of the dirent `name` of the directory `parent_inode` in the dirent
+// tables, -1 if there is none
+int64_t Bcachefs_index_lookup(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *name, uint64_t name_len)
 {
-    (void)this;
+    if (index->header == NULL)
+    {
+        return -1;
+    }
+    const uint64_t mask = index->header->nr_buckets - 1;
+    for (uint64_t slot = _Bcachefs_index_hash(parent_inode, name, name_len) & mask; index->buckets[slot];
+         slot = (slot + 1) & mask)
+    {
+        const uint64_t i = index->buckets[slot] - 1;
+        if (index->dirent_parent[i] == parent_inode &&
+                index->dirent_name[i + 1] - index->dirent_name[i] == name_len &&
+                memcmp(index->names + index->dirent_name[i], name, name_len) == 0)
+        {
+            return (int64_t)i;
+        }
+    }
+    return -1;
+}
 
-    while (iter->next_it)
+// Position of the dirent of `path` relative to the directory `parent_inode`
+// in the dirent tables, -1 if there is none. Empty components are skipped,
+// `path` must have at least one component
+int64_t Bcachefs_index_resolve(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *path, uint64_t path_len)
+{
+    int64_t dirent = -1;
+    for (uint64_t start = 0, end = 0; start < path_len; start = end + 1)
     {
-        iter = iter->next_it;
+        for (end = start; end < path_len && path[end] != '/'; ++end);
+        if (end == start)
+        {
+            continue;
+        }
+        dirent = Bcachefs_index_lookup(index, parent_inode, path + start, end - start);
+        if (dirent < 0)
+        {
+            return -1;
+        }
+        parent_inode = index->dirent_inode[dirent];
     }
+    return dirent;
+}
 
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(iter->bkey, &iter->btree_node->format);
-    const struct bkey *bkey = (const void*)&bkey_local;
-    Bcachefs_extent extent = {.inode = bkey->p.inode};
-    benz_bch_file_offset_size(bkey, iter->bch_val, &extent.file_offset, &extent.offset, &extent.size);
-    if (bkey->type == KEY_TYPE_inline_data)
+// String hashes
+// -------------
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                    \
+    do {                                                            \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                    \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                    \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+uint64_t benz_siphash24(uint64_t k0, uint64_t k1, const uint8_t *data, uint64_t len)
+{
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m = 0;
+    const uint8_t *end = data + (len & ~(uint64_t)7);
+
+    for (; data != end; data += sizeof(m))
     {
-        extent.offset = benz_bch_inline_data_offset(iter->btree_node, iter->bch_val,
-                                                    benz_bch_get_extent_offset(iter->btree_ptr->start));
-        extent.size -= (uint64_t)((const uint8_t*)iter->bch_val - (const uint8_t*)iter->bkey);
+        memcpy(&m, data, sizeof(m));
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
     }
-    return extent;
+    m = len << 56;
+    for (uint64_t i = 0; i < (len & 7); ++i)
+    {
+        m |= (uint64_t)data[i] << (i * 8);
+    }
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-Bcachefs_inode Bcachefs_iter_make_inode(const Bcachefs *this, Bcachefs_iterator *iter)
+#undef SIPROUND
+#undef ROTL64
+
+// Checksums
+// ---------
+//
+// crc32c uses the crc32 instruction of SSE4.2 or ARMv8 when the cpu has it and
+// slicing-by-8 tables otherwise. The implementation is picked once, on first
+// use
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t _benz_crc32c_hw(uint32_t crc, const uint8_t *data, uint64_t len)
 {
-    (void)this;
+    uint64_t crc64 = crc;
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len; --len)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static int _benz_crc32c_hw_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
 
-    while (iter->next_it)
+static uint32_t _benz_crc32c_hw(uint32_t crc, const uint8_t *data, uint64_t len)
+{
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; len; --len)
     {
-        iter = iter->next_it;
+        crc = __crc32cb(crc, *data++);
     }
+    return crc;
+}
 
-    const struct bkey *bkey = iter->bkey;
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(bkey, &iter->btree_node->format);
-    const struct bch_inode *bch_inode = (const void*)iter->bch_val;
+static int _benz_crc32c_hw_supported(void)
+{
+    return 1;
+}
+#else
+#define _benz_crc32c_hw NULL
 
-    const void *p_end = (const void*)((const uint8_t*)bkey + bkey->u64s * BCH_U64S_SIZE);
+static int _benz_crc32c_hw_supported(void)
+{
+    return 0;
+}
+#endif
 
-    Bcachefs_inode inode = {0};
-    inode.inode = bkey_local.p.offset;
+static uint32_t _benz_crc32c_table[8][256];
+static uint64_t _benz_crc64_table[256];
+static uint32_t (*_benz_crc32c_impl)(uint32_t crc, const uint8_t *data, uint64_t len);
+static pthread_once_t _benz_crc_once = PTHREAD_ONCE_INIT;
 
-    benz_bch_inode_unpack_size(&inode.size, bch_inode, p_end);
-    return inode;
+// Slicing-by-8, consumes a little endian word per iteration
+static uint32_t _benz_crc32c_sw(uint32_t crc, const uint8_t *data, uint64_t len)
+{
+    const uint32_t (*t)[256] = (const void*)_benz_crc32c_table;
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        const uint32_t lo = crc ^ (uint32_t)word;
+        const uint32_t hi = (uint32_t)(word >> 32);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; len; --len)
+    {
+        crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
 }
 
-Bcachefs_dirent Bcachefs_iter_make_dirent(const Bcachefs *this, Bcachefs_iterator *iter)
+static void _benz_crc_init(void)
 {
-    (void)this;
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        uint64_t crc64 = (uint64_t)i << 56;
+        for (int k = 0; k < 8; ++k)
+        {
+            crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+            crc64 = (crc64 << 1) ^ (0x42f0e1eba9ea3693ULL & (0ULL - (crc64 >> 63)));
+        }
+        _benz_crc32c_table[0][i] = crc;
+        _benz_crc64_table[i] = crc64;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        for (int t = 1; t < 8; ++t)
+        {
+            const uint32_t crc = _benz_crc32c_table[t - 1][i];
+            _benz_crc32c_table[t][i] = (crc >> 8) ^ _benz_crc32c_table[0][crc & 0xff];
+        }
+    }
+    _benz_crc32c_impl = _benz_crc32c_hw_supported() ? _benz_crc32c_hw : _benz_crc32c_sw;
+}
 
-    while (iter->next_it)
+// Castagnoli crc, without pre or post inversion like the kernel's crc32c()
+uint32_t benz_crc32c(uint32_t crc, const uint8_t *data, uint64_t len)
+{
+    pthread_once(&_benz_crc_once, _benz_crc_init);
+    return _benz_crc32c_impl(crc, data, len);
+}
+
+// ECMA-182 crc, msb first like the kernel's crc64_be()
+uint64_t benz_crc64_be(uint64_t crc, const uint8_t *data, uint64_t len)
+{
+    pthread_once(&_benz_crc_once, _benz_crc_init);
+    for (uint64_t i = 0; i < len; ++i)
     {
-        iter = iter->next_it;
+        crc = _benz_crc64_table[(crc >> 56) ^ data[i]] ^ (crc << 8);
     }
-    const struct bkey *bkey = iter->bkey;
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(bkey, &iter->btree_node->format);
-    const struct bch_dirent *bch_dirent = (const void*)iter->bch_val;
-    const uint8_t name_len = strlen((const void*)bch_dirent->d_name);
-    const uint8_t max_name_len = (const uint8_t*)bkey + bkey->u64s * BCH_U64S_SIZE - bch_dirent->d_name;
-    return (Bcachefs_dirent){.parent_inode = bkey_local.p.inode,
-                                  .inode = bch_dirent->d_inum,
-                                  .type = bch_dirent->d_type,
-                                  .name = bch_dirent->d_name,
-                                  .name_len = (name_len < max_name_len ? name_len : max_name_len)};
+    return crc;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline uint64_t _benz_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    return XXH_ROTL64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t _benz_xxh64_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= _benz_xxh64_round(0, lane);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// xxHash64 of a buffer. The four lanes of a stripe are independent so the
+// compiler keeps them in flight together
+uint64_t benz_xxh64(uint64_t seed, const uint8_t *data, uint64_t len)
+{
+    const uint8_t *end = data + len;
+    uint64_t hash;
+    if (len >= 32)
+    {
+        uint64_t v[4] = {seed + XXH_PRIME64_1 + XXH_PRIME64_2, seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1};
+        for (; data + 32 <= end; data += 32)
+        {
+            uint64_t lanes[4];
+            memcpy(lanes, data, sizeof(lanes));
+            for (int i = 0; i < 4; ++i)
+            {
+                v[i] = _benz_xxh64_round(v[i], lanes[i]);
+            }
+        }
+        hash = XXH_ROTL64(v[0], 1) + XXH_ROTL64(v[1], 7) + XXH_ROTL64(v[2], 12) + XXH_ROTL64(v[3], 18);
+        for (int i = 0; i < 4; ++i)
+        {
+            hash = _benz_xxh64_merge(hash, v[i]);
+        }
+    }
+    else
+    {
+        hash = seed + XXH_PRIME64_5;
+    }
+    hash += len;
+    for (; data + sizeof(uint64_t) <= end; data += sizeof(uint64_t))
+    {
+        uint64_t lane;
+        memcpy(&lane, data, sizeof(lane));
+        hash ^= _benz_xxh64_round(0, lane);
+        hash = XXH_ROTL64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (data + sizeof(uint32_t) <= end)
+    {
+        uint32_t lane;
+        memcpy(&lane, data, sizeof(lane));
+        hash ^= lane * XXH_PRIME64_1;
+        hash = XXH_ROTL64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        data += sizeof(lane);
+    }
+    for (; data < end; ++data)
+    {
+        hash ^= *data * XXH_PRIME64_5;
+        hash = XXH_ROTL64(hash, 11) * XXH_PRIME64_1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#undef XXH_ROTL64
+
+// Checksum of extent data as bcachefs computes it, returns 0 for the
+// encrypted checksum types which need the filesystem key
+int benz_bch_checksum(uint8_t csum_type, const uint8_t *data, uint64_t len, struct bch_csum *csum)
+{
+    *csum = (struct bch_csum){0};
+    switch (csum_type)
+    {
+    case BCH_CSUM_none:
+        return 1;
+    case BCH_CSUM_crc32c_nonzero:
+        csum->lo = benz_crc32c((uint32_t)-1, data, len) ^ (uint32_t)-1;
+        return 1;
+    case BCH_CSUM_crc64_nonzero:
+        csum->lo = benz_crc64_be((uint64_t)-1, data, len) ^ (uint64_t)-1;
+        return 1;
+    case BCH_CSUM_crc32c:
+        csum->lo = benz_crc32c(0, data, len);
+        return 1;
+    case BCH_CSUM_crc64:
+        csum->lo = benz_crc64_be(0, data, len);
+        return 1;
+    case BCH_CSUM_xxhash:
+        csum->lo = benz_xxh64(0, data, len);
+        return 1;
+    }
+    return 0;
+}
+
+// Compression
+// -----------
+//
+// Each codec is only built in if its library was found, extents compressed
+// with a missing codec fail to decompress
+
+// Decompresses the `src_len` bytes of a compressed extent, which include the
+// padding to the end of its last sector, into exactly `dst_len` bytes. gzip
+// extents are raw deflate streams and zstd frames are prefixed by their
+// little endian 32 bits length like bcachefs writes them
+int benz_bch_decompress(uint8_t compression_type, const uint8_t *src, uint64_t src_len, uint8_t *dst, uint64_t dst_len)
+{
+    switch (compression_type)
+    {
+    case BCH_COMPRESSION_TYPE_none:
+    case BCH_COMPRESSION_TYPE_incompressible:
+        if (src_len < dst_len)
+        {
+            return 0;
+        }
+        memcpy(dst, src, dst_len);
+        return 1;
+#ifdef BENZ_HAVE_ZLIB
+    case BCH_COMPRESSION_TYPE_gzip:
+    {
+        z_stream strm = {.next_in = (Bytef*)src,
+                         .avail_in = (uInt)src_len,
+                         .next_out = dst,
+                         .avail_out = (uInt)dst_len};
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+        {
+            return 0;
+        }
+        const int ret = inflate(&strm, Z_FINISH);
+        inflateEnd(&strm);
+        return ret == Z_STREAM_END && strm.total_out == dst_len;
+    }
+#endif
+#ifdef BENZ_HAVE_ZSTD
+    case BCH_COMPRESSION_TYPE_zstd:
+    {
+        uint32_t len = 0;
+        if (src_len < sizeof(len))
+        {
+            return 0;
+        }
+        memcpy(&len, src, sizeof(len));
+        if (len > src_len - sizeof(len))
+        {
+            return 0;
+        }
+        const size_t ret = ZSTD_decompress(dst, dst_len, src + sizeof(len), len);
+        return !ZSTD_isError(ret) && ret == dst_len;
+    }
+#endif
+#ifdef BENZ_HAVE_LZ4
+    case BCH_COMPRESSION_TYPE_lz4_old:
+    case BCH_COMPRESSION_TYPE_lz4:
+        // The padding after the block is not part of it
+        return LZ4_decompress_safe_partial((const char*)src, (char*)dst, (int)src_len, (int)dst_len,
+                                           (int)dst_len) == (int)dst_len;
+#endif
+    }
+    return 0;
+}
+
+// Hash of a dirent name, which is the offset of the dirent key in its
+// directory. Offsets 0 and 1 are reserved for "." and ".."
+uint64_t benz_bch_dirent_hash(const struct bch_hash_info *info, const uint8_t *name, uint8_t name_len)
+{
+    uint64_t hash = 0;
+    uint8_t seed[sizeof(info->seed)];
+    memcpy(seed, &info->seed, sizeof(seed));
+    switch (info->type)
+    {
+    case BCH_STR_HASH_crc32c:
+        hash = benz_crc32c(benz_crc32c((uint32_t)-1, seed, sizeof(seed)), name, name_len);
+        break;
+    case BCH_STR_HASH_crc64:
+        hash = benz_crc64_be(benz_crc64_be((uint64_t)-1, seed, sizeof(seed)), name, name_len) >> 1;
+        break;
+    case BCH_STR_HASH_siphash:
+        hash = benz_siphash24(info->seed, 0, name, name_len) >> 1;
+        break;
+    }
+    return hash < 2 ? 2 : hash;
 }
 
 inline uint64_t benz_get_flag_bits(const uint64_t bitfield, uint8_t first_bit, uint8_t last_bit)
@@ -774,20 +4940,21 @@ inline uint64_t benz_get_flag_bits(const uint64_t bitfield, uint8_t first_bit, u
     return bitfield << (sizeof(bitfield) * 8 - last_bit) >> (sizeof(bitfield) * 8 - last_bit + first_bit);
 }
 
-uint64_t benz_uintXX_as_uint64(const uint8_t *bytes, uint8_t sizeof_uint)
+// Reads the `bits` least significant bits of the little endian integer
+// starting at `bytes`
+uint64_t benz_uintXX_as_uint64(const uint8_t *bytes, uint8_t bits)
 {
-    switch (sizeof_uint)
+    uint64_t value = 0;
+    if (bits == 0)
+    {
+        return 0;
+    }
+    if (bits > 64)
     {
-    case 64:
-        return *(const uint64_t*)(const void*)bytes;
-    case 32:
-        return *(const uint32_t*)(const void*)bytes;
-    case 16:
-        return *(const uint16_t*)(const void*)bytes;
-    case 8:
-        return *(const uint8_t*)bytes;
+        bits = 64;
     }
-    return (uint64_t)-1;
+    memcpy(&value, bytes, (bits + 7) / 8);
+    return bits == 64 ? value : value & (((uint64_t)1 << bits) - 1);
 }
 
 void benz_print_chars(const uint8_t* bytes, uint64_t len)
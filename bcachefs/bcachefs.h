@@ -7,7 +7,9 @@
  * Includes
  */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 
 /* Extern "C" Guard */
@@ -313,6 +315,26 @@ static inline struct bpos SPOS(uint64_t inode, uint64_t offset, uint32_t snapsho
     };
 }
 
+#define POS_MIN             SPOS(0, 0, 0)
+#define POS_MAX             SPOS((uint64_t)-1, (uint64_t)-1, (uint32_t)-1)
+
+static inline int bpos_cmp(struct bpos l, struct bpos r)
+{
+    if (l.inode != r.inode)
+    {
+        return l.inode < r.inode ? -1 : 1;
+    }
+    if (l.offset != r.offset)
+    {
+        return l.offset < r.offset ? -1 : 1;
+    }
+    if (l.snapshot != r.snapshot)
+    {
+        return l.snapshot < r.snapshot ? -1 : 1;
+    }
+    return 0;
+}
+
 /* Empty placeholder struct, for container_of() */
 struct bch_val {
     uint64_t        __nothing[0];
@@ -374,6 +396,27 @@ struct bkey_local {
     uint8_t     key_u64s;
 } __attribute__((packed, aligned(8)));
 
+// A bkey_format compiled into the location of each packed field, so unpacking
+// a key does not have to walk the format again
+struct bkey_unpack_field {
+    uint8_t     word;       /* u64 of the key holding the lowest bit of the field */
+    uint8_t     shift;      /* position of the lowest bit inside the word */
+    uint8_t     bits;
+    uint64_t    mask;
+    uint64_t    offset;
+};
+
+enum bkey_unpack_kernel {
+    BKEY_UNPACK_SHORT,      /* BKEY_FORMAT_SHORT, the fields are whole u64/u32 */
+    BKEY_UNPACK_GENERIC,    /* any bits_per_field */
+};
+
+struct bkey_unpack_plan {
+    uint8_t     kernel;
+    uint8_t     key_u64s;
+    struct bkey_unpack_field fields[BKEY_NR_FIELDS];
+};
+
 struct bkey {
     /* Size of combined key and value, in u64s */
     uint8_t     u64s;
@@ -454,6 +497,22 @@ struct jset_entry {
     };
 };
 
+struct bch_member {
+    struct uuid     uuid;
+    uint64_t        nbuckets;   /* device size */
+    uint16_t        first_bucket;   /* index of first bucket used */
+    uint16_t        bucket_size;    /* sectors */
+    uint32_t        pad;
+    uint64_t        last_mount; /* time_t */
+
+    uint64_t        flags[2];
+} __attribute__((packed, aligned(8)));
+
+struct bch_sb_field_members {
+    struct bch_sb_field field;
+    struct bch_member   members[0];
+};
+
 struct bch_sb_field_clean {
     struct bch_sb_field field;
 
@@ -514,6 +573,43 @@ struct bch_extent_crc128 {
 #define CRC128_SIZE_MAX     (1U << 13)
 #define CRC128_NONCE_MAX    ((1U << 13) - 1)
 
+enum bch_csum_type {
+    BCH_CSUM_none                   = 0,
+    BCH_CSUM_crc32c_nonzero         = 1,
+    BCH_CSUM_crc64_nonzero          = 2,
+    BCH_CSUM_chacha20_poly1305_80   = 3,
+    BCH_CSUM_chacha20_poly1305_128  = 4,
+    BCH_CSUM_crc32c                 = 5,
+    BCH_CSUM_crc64                  = 6,
+    BCH_CSUM_xxhash                 = 7,
+    BCH_CSUM_NR                     = 8,
+};
+
+#define BCH_SB_MEMBERS_MAX      64
+#define BCH_BKEY_PTRS_MAX       16
+
+enum bch_compression_type {
+    BCH_COMPRESSION_TYPE_none           = 0,
+    BCH_COMPRESSION_TYPE_lz4_old        = 1,
+    BCH_COMPRESSION_TYPE_gzip           = 2,
+    BCH_COMPRESSION_TYPE_lz4            = 3,
+    BCH_COMPRESSION_TYPE_zstd           = 4,
+    BCH_COMPRESSION_TYPE_incompressible = 5,
+    BCH_COMPRESSION_TYPE_NR             = 6,
+};
+
+//! Checksum and compression parameters of an extent, whichever crc entry
+//! stores them. Sizes and offset are in sectors
+struct bch_extent_crc_unpacked {
+    uint32_t    compressed_size;
+    uint32_t    uncompressed_size;
+    uint32_t    offset;
+    uint32_t    nonce;
+    uint8_t     csum_type;
+    uint8_t     compression_type;
+    struct bch_csum csum;
+};
+
 /*
  * @reservation - pointer hasn't been written to, just reserved
  */
@@ -568,10 +664,56 @@ struct bch_extent {
     uint64_t    _data[0];
 } __attribute__((packed, aligned(8)));
 
+/* Reflink */
+
+/*
+ * @idx - start, in sectors, of the range of the reflink btree referenced by
+ *        the key, the indirect extents are positioned at their end in
+ *        [(0, idx), (0, idx + size)]
+ */
+struct bch_reflink_p {
+    struct bch_val      v;
+    uint64_t    idx;
+    uint32_t    front_pad;
+    uint32_t    back_pad;
+} __attribute__((packed, aligned(8)));
+
+#define REFLINK_P_IDX_MASK  ((1ULL << 56) - 1)
+
+struct bch_reflink_v {
+    struct bch_val      v;
+    uint64_t    refcount;
+    union bch_extent_entry  start[0];
+    uint64_t    _data[0];
+} __attribute__((packed, aligned(8)));
+
+struct bch_indirect_inline_data {
+    struct bch_val      v;
+    uint64_t    refcount;
+    uint8_t     data[0];
+};
+
 /* Inodes */
 
 #define BCACHEFS_ROOT_INO   4096
 
+enum bch_str_hash_type {
+    BCH_STR_HASH_crc32c,
+    BCH_STR_HASH_crc64,
+    BCH_STR_HASH_siphash_old,
+    BCH_STR_HASH_siphash,
+    BCH_STR_HASH_NR,
+};
+
+#define BCH_INODE_STR_HASH_OFFSET   20
+#define BCH_INODE_STR_HASH_BITS     4
+
+//! Parameters of the string hash of a directory, taken from its inode
+struct bch_hash_info {
+    uint8_t     type;
+    uint64_t    seed;
+};
+
 struct bch_inode {
     struct bch_val      v;
 
@@ -721,14 +863,23 @@ const struct bset *benz_bch_next_bset(const struct btree_node *p, const void *p_
 const struct bkey *benz_bch_next_bkey(const struct bset *p, const struct bkey *c, enum bch_bkey_type type);
 
 struct bkey_local benz_bch_parse_bkey(const struct bkey *bkey, const struct bkey_format *format);
+void benz_bch_compile_bkey_format(struct bkey_unpack_plan *plan, const struct bkey_format *format);
+struct bkey_local benz_bch_unpack_bkey(const struct bkey *bkey, const struct bkey_unpack_plan *plan);
 
 uint64_t benz_bch_get_sb_size(const struct bch_sb *sb);
 uint64_t benz_bch_get_block_size(const struct bch_sb *sb);
 uint64_t benz_bch_get_btree_node_size(const struct bch_sb *sb);
 uint64_t benz_bch_get_extent_offset(const struct bch_extent_ptr *bch_extent_ptr);
+uint32_t benz_bch_extent_entry_bytes(const union bch_extent_entry *entry);
+const union bch_extent_entry *benz_bch_next_extent_entry(const struct bch_val *bch_val, const void *p_end,
+                                                        const union bch_extent_entry *c);
+void benz_bch_extent_crc_unpack(const union bch_extent_entry *entry, uint32_t size, struct bch_extent_crc_unpacked *crc);
+const struct bch_extent_ptr *benz_bch_extent_first_ptr(const struct bch_val *bch_val, const void *p_end,
+                                                       uint32_t size, struct bch_extent_crc_unpacked *crc);
 
 const struct bkey *benz_bch_file_offset_size(const struct bkey *bkey,
                                              const struct bch_val *bch_val,
+                                             const void *p_end,
                                              uint64_t *file_offset,
                                              uint64_t *offset,
                                              uint64_t *size);
@@ -737,34 +888,198 @@ uint64_t benz_bch_inline_data_offset(const struct btree_node* start, const struc
 struct bch_sb *benz_bch_realloc_sb(struct bch_sb *sb, uint64_t size);
 struct btree_node *benz_bch_malloc_btree_node(const struct bch_sb *sb);
 
-uint64_t benz_bch_fread_sb(struct bch_sb *sb, uint64_t size, FILE *fp);
-uint64_t benz_bch_fread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr, FILE *fp);
+uint64_t benz_pread(int fd, void *buf, uint64_t size, uint64_t offset);
+uint64_t benz_bch_pread_sb(struct bch_sb *sb, uint64_t size, int fd);
+uint64_t benz_bch_pread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr,
+                                   const struct bch_extent_ptr *ptr, int fd);
 
+#define BCACHEFS_NODE_CACHE_SIZE    (64ULL << 20)
+#define BCACHEFS_READAHEAD          8
+#define BCACHEFS_URING_ENTRIES      256
+#define BCACHEFS_PREFETCH_MAX       64
+
+//! Positional read of Bcachefs_pread_many
 typedef struct {
-    FILE *fp;
+    void *buf;
+    uint64_t size;
+    uint64_t offset;
+    int32_t buf_index;                          //! registered buffer holding buf, -1 if none
+    uint8_t dev;                                //! member device read, the image is device sb->dev_idx
+    uint64_t result;                            //! bytes read
+} Bcachefs_read_req;
+
+// io_uring submission and completion rings driven through raw syscalls
+struct benz_uring;
+
+struct benz_uring *benz_uring_new(uint32_t entries);
+void benz_uring_free(struct benz_uring *ring);
+int benz_uring_usable(const struct benz_uring *ring);
+int benz_uring_register_buffers(struct benz_uring *ring, const struct iovec *iovecs, uint32_t nr_iovecs);
+int benz_uring_pread_many(struct benz_uring *ring, const int *fds, Bcachefs_read_req *reqs, uint32_t nr_reqs);
+
+struct Bcachefs_cache_entry;
+
+//! Bounded cache of btree nodes read from the image, shared by all the
+//! iterators of a Bcachefs and keyed by the node location and sequence number
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t capacity;                          //! memory budget in bytes, 0 disables the cache
+    uint64_t size;                              //! bytes currently held by cached nodes
+    uint64_t node_size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t nr_buckets;
+    struct Bcachefs_cache_entry **buckets;
+    struct Bcachefs_cache_entry *lru;           //! least recently used entry, head of a circular list
+} Bcachefs_node_cache;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t size;
+    uint64_t capacity;
+} Bcachefs_cache_stats;
+
+Bcachefs_node_cache *benz_bch_node_cache_new(uint64_t node_size, uint64_t capacity);
+void benz_bch_node_cache_free(Bcachefs_node_cache *cache);
+
+#define BCACHEFS_REFLINK_CACHE_SIZE (16ULL << 20)
+
+struct Bcachefs_reflink_entry;
+
+//! Indirect extents referenced by reflink_p keys, resolved through the reflink
+//! btree and keyed by the range they reference so data shared by several
+//! files is only looked up once. Entries are kept until the filesystem is
+//! closed, the cache stops growing once it holds `capacity` bytes
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t nr_buckets;
+    struct Bcachefs_reflink_entry **buckets;
+} Bcachefs_reflink_cache;
+
+Bcachefs_reflink_cache *benz_bch_reflink_cache_new(uint64_t capacity);
+void benz_bch_reflink_cache_free(Bcachefs_reflink_cache *cache);
+
+//! Replica picked for reads among the pointers of an extent, pointers to
+//! cached copies are only used when there is no other
+enum Bcachefs_read_policy {
+    BCACHEFS_READ_POLICY_first,                 //! first pointer, in key order
+    BCACHEFS_READ_POLICY_least_loaded,          //! device with the fewest bytes being read
+    BCACHEFS_READ_POLICY_round_robin,           //! each pointer in turn
+    BCACHEFS_READ_POLICY_NR,
+};
+
+//! Read load of the devices, shared by all the readers of a filesystem
+typedef struct {
+    uint64_t inflight[BCH_SB_MEMBERS_MAX];      //! bytes being read from each device
+    uint64_t next;                              //! round robin counter
+} Bcachefs_read_load;
+
+//! Member device of a filesystem spread over several images
+typedef struct {
+    int fd;                                     //! -1 if the member was not opened
+    long size;
+    const uint8_t *map;
+} Bcachefs_device;
+
+typedef struct {
+    int fd;                                     //! image file descriptor, only ever read with positional reads
     long size;
     struct bch_sb *sb;
+    const uint8_t *map;                         //! read-only mapping of the whole image, NULL when reading through fd,
+                                                //! the caller's memory when fd is -1
+    Bcachefs_node_cache *cache;                 //! btree node cache, unused when the image is mapped
+    uint32_t readahead;                         //! number of children of interior nodes read ahead, 0 disables it
+    struct benz_uring *uring;                   //! io_uring engine for batched reads, NULL to use pread
+    uint8_t verify;                             //! verify the checksums of the extents of batched file reads
+    uint32_t decode_threads;                    //! threads verifying and decompressing batched reads, 0 for one per cpu
+    uint8_t read_policy;                        //! enum Bcachefs_read_policy
+    Bcachefs_read_load *load;
+    Bcachefs_device *devices;                   //! BCH_SB_MEMBERS_MAX members indexed by dev, NULL when the image is the only device
+    Bcachefs_reflink_cache *reflink;            //! indirect extents resolved for reflink_p keys
 } Bcachefs;
 
+// Deepest btree bcachefs creates, the root of a btree is at most at level 3
+#define BCH_BTREE_MAX_DEPTH 4
+
+typedef struct {
+    const struct bset *bset;                    //! bset the cursor walks
+    const struct bkey *bkey;                    //! next key of the bset, NULL once the bset is consumed
+    struct bpos p;                              //! unpacked position of bkey
+} Bcachefs_bset_cursor;
+
+typedef struct {
+    const struct bch_btree_ptr_v2 *btree_ptr;   //! location of the btree node
+    const struct bch_extent_ptr *node_ptr;      //! replica of the node it was read from, on a present device
+    const struct btree_node *btree_node;        //! btree node, either mapped, cached or read in buffer
+    struct btree_node *buffer;                  //! buffer the node is read into, kept across nodes and seeks
+    const struct bset *bset;                    //! current bset inside the btree node
+    const void *bkey;                           //! current bkey inside the bset
+    const struct bch_val *bch_val;              //! current value stored inside along side the key
+    Bcachefs_bset_cursor *cursors;              //! one cursor per bset of the node, merged in bpos order
+    Bcachefs_bset_cursor *readahead_cursors;    //! cursors of the children read ahead, past the current one
+    uint32_t nr_cursors;
+    uint32_t readahead;                         //! number of children read ahead, counting the current one
+    struct bkey_unpack_plan unpack_plan;        //! format of the node compiled when the node is loaded
+} Bcachefs_iter_frame;
+
 typedef struct Bcachefs_iterator {
     enum btree_id type;                         //! which btree are we iterating over
     const struct jset_entry *jset_entry;        //! journal entry specifying the location of the btree root
-    const struct bch_btree_ptr_v2 *btree_ptr;   //! current btree node location
-    const struct bset *bset;                    //! current bset inside the btree
-    const void *bkey;                           //! current bkey inside the bset
-    const struct bch_val *bch_val;              //! current value stored inside along side the key
-    struct btree_node *btree_node;              //! current btree node
-    struct Bcachefs_iterator *next_it;          //! pointer to the children btree node if iterating over nested Btrees
+    const struct bch_btree_ptr_v2 *btree_ptr;   //! btree root location
+    struct bpos start;                          //! keys positioned before start are skipped
+    struct bpos end;                            //! iteration stops after the last key positioned before or at end
+    int whiteouts;                              //! also return hash_whiteout keys, needed to probe hash tables
+    int depth;                                  //! number of frames in use, the last one is the current node
+    int pending;                                //! the current key was read but not handed out yet
+    Bcachefs_iter_frame frames[BCH_BTREE_MAX_DEPTH];  //! path from the root to the current node
+    struct Bcachefs_reflink_entry *reflink;     //! indirect extents of the current reflink_p key
+    int reflink_owned;                          //! reflink did not fit in the cache and is freed with the key
+    uint32_t piece;                             //! indirect extent of the current reflink_p key handed out
 } Bcachefs_iterator;
 
+// Frame of the node holding the current key
+static inline Bcachefs_iter_frame *Bcachefs_iter_leaf(Bcachefs_iterator *iter)
+{
+    return &iter->frames[iter->depth > 0 ? iter->depth - 1 : 0];
+}
+
 //! Decoded value from the extend btree
 typedef struct {
     uint64_t inode;
     uint64_t file_offset;
-    uint64_t offset;
+    uint64_t offset;                            //! location of the data, or of the compressed data
     uint64_t size;
+    uint8_t compression_type;                   //! BCH_COMPRESSION_TYPE_none if the data is stored as is
 } Bcachefs_extent;
 
+//! Pointer of an extent to one of its replicas
+typedef struct {
+    uint64_t offset;                            //! location of the region addressed by the pointer
+    uint8_t dev;
+    uint8_t gen;
+    uint8_t cached;                             //! cached copies may be stale
+    uint8_t stripe;                             //! also part of an erasure coded stripe
+    struct bch_extent_crc_unpacked crc;         //! crc entry applying to the pointer
+} Bcachefs_extent_ptr;
+
+//! Region of the image covered by the checksum of an extent, which is also
+//! the unit of compression
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint8_t csum_type;
+    struct bch_csum csum;
+    uint8_t compression_type;
+    uint64_t uncompressed_size;
+    uint64_t data_offset;                       //! start of the data of the key in the uncompressed region
+    uint8_t dev;                                //! device of the replica picked for reads
+} Bcachefs_extent_csum;
+
 //! Decoded value from the inode btree
 typedef struct {
     uint64_t inode;
@@ -780,23 +1095,254 @@ typedef struct {
     const uint8_t name_len;
 } Bcachefs_dirent;
 
+//! Largest inline extent, the value of a key is at most 255 u64s
+#define BCACHEFS_INLINE_DATA_MAX    (255 * BCH_U64S_SIZE)
+
+//! Caller provided columns filled by Bcachefs_iter_next_batch_extents
+typedef struct {
+    uint64_t *inode;
+    uint64_t *file_offset;
+    uint64_t *offset;
+    uint64_t *size;
+    uint8_t *compression_type;                  //! optional
+    uint32_t *inline_offset;                    //! optional, n + 1 offsets, the data of inline extent i is inline_data[inline_offset[i]:inline_offset[i + 1]], empty for other extents
+    uint8_t *inline_data;                       //! data of the inline extents packed one after the other
+    uint32_t inline_data_size;                  //! capacity of inline_data, at least BCACHEFS_INLINE_DATA_MAX bytes
+} Bcachefs_extent_batch;
+
+//! Caller provided columns filled by Bcachefs_iter_next_batch_inodes
+typedef struct {
+    uint64_t *inode;
+    uint64_t *size;
+} Bcachefs_inode_batch;
+
+//! Caller provided columns filled by Bcachefs_iter_next_batch_dirents
+typedef struct {
+    uint64_t *parent_inode;
+    uint64_t *inode;
+    uint8_t *type;
+    uint32_t *name_offset;                      //! n + 1 offsets, name i is names[name_offset[i]:name_offset[i + 1]]
+    uint8_t *names;                             //! names packed one after the other, not NUL terminated
+    uint32_t names_size;                        //! capacity of names, at least 255 bytes
+} Bcachefs_dirent_batch;
+
 int Bcachefs_fini(Bcachefs *this);
 int Bcachefs_open(Bcachefs *this, const char *path);
+int Bcachefs_open_mmap(Bcachefs *this, const char *path);
+int Bcachefs_open_fd(Bcachefs *this, int fd);
+int Bcachefs_open_fd_mmap(Bcachefs *this, int fd);
+int Bcachefs_open_memory(Bcachefs *this, const void *data, uint64_t size);
+int Bcachefs_open_multi(Bcachefs *this, const char *const *paths, uint32_t nr_paths);
+int Bcachefs_open_multi_mmap(Bcachefs *this, const char *const *paths, uint32_t nr_paths);
 int Bcachefs_close(Bcachefs *this);
+int Bcachefs_has_dev(const Bcachefs *this, uint8_t dev);
+const void *Bcachefs_map_range(const Bcachefs *this, uint64_t offset, uint64_t size);
+const void *Bcachefs_map_range_dev(const Bcachefs *this, uint8_t dev, uint64_t offset, uint64_t size);
+uint64_t Bcachefs_pread(const Bcachefs *this, void *buf, uint64_t size, uint64_t offset);
+uint64_t Bcachefs_pread_dev(const Bcachefs *this, uint8_t dev, void *buf, uint64_t size, uint64_t offset);
+int Bcachefs_pread_many(const Bcachefs *this, Bcachefs_read_req *reqs, uint32_t nr_reqs);
+int Bcachefs_enable_uring(Bcachefs *this, uint32_t entries);
+int Bcachefs_register_buffers(Bcachefs *this, const struct iovec *iovecs, uint32_t nr_iovecs);
+const struct bch_extent_ptr *Bcachefs_node_replica(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                                                   const void *end);
+const struct btree_node *Bcachefs_node_get(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                                           const struct bch_extent_ptr *ptr, struct btree_node **buffer);
+void Bcachefs_node_put(const Bcachefs *this, const struct btree_node *btree_node, const struct btree_node *buffer);
+int Bcachefs_node_prefetch(const Bcachefs *this, const struct bch_btree_ptr_v2 *const *btree_ptrs,
+                           const struct bch_extent_ptr *const *ptrs, uint32_t nr_ptrs);
+int Bcachefs_set_cache_size(Bcachefs *this, uint64_t capacity);
+Bcachefs_cache_stats Bcachefs_get_cache_stats(const Bcachefs *this);
+Bcachefs_cache_stats Bcachefs_get_reflink_cache_stats(const Bcachefs *this);
+int Bcachefs_set_readahead(Bcachefs *this, uint32_t readahead);
+void Bcachefs_readahead_node(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr,
+                             const struct bch_extent_ptr *ptr);
 int Bcachefs_iter(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type);
-int Bcachefs_next_iter(const Bcachefs *this, Bcachefs_iterator *iter, const struct bch_btree_ptr_v2 *btree_ptr);
+int Bcachefs_iter_seek(const Bcachefs *this, Bcachefs_iterator *iter, struct bpos start, struct bpos end);
 int Bcachefs_iter_fini(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct jset_entry *Bcachefs_iter_next_jset_entry(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct bch_btree_ptr_v2 *Bcachefs_iter_next_btree_ptr(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct bset *Bcachefs_iter_next_bset(const Bcachefs *this, Bcachefs_iterator *iter);
 Bcachefs_extent Bcachefs_iter_make_extent(const Bcachefs *this, Bcachefs_iterator *iter);
+Bcachefs_extent_csum Bcachefs_iter_make_extent_csum(const Bcachefs *this, Bcachefs_iterator *iter);
+const uint8_t *Bcachefs_iter_inline_data(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t *size);
+uint32_t Bcachefs_iter_extent_ptrs(const Bcachefs *this, Bcachefs_iterator *iter, Bcachefs_extent_ptr *ptrs, uint32_t max);
+void Bcachefs_set_read_policy(Bcachefs *this, enum Bcachefs_read_policy policy);
+const Bcachefs_extent_ptr *Bcachefs_pick_ptr(const Bcachefs *this, const Bcachefs_extent_ptr *ptrs, uint32_t nr_ptrs);
 Bcachefs_inode Bcachefs_iter_make_inode(const Bcachefs *this, Bcachefs_iterator *iter);
 Bcachefs_dirent Bcachefs_iter_make_dirent(const Bcachefs *this, Bcachefs_iterator *iter);
+uint32_t Bcachefs_iter_next_batch_extents(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_extent_batch *batch);
+uint32_t Bcachefs_iter_next_batch_inodes(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_inode_batch *batch);
+uint32_t Bcachefs_iter_next_batch_dirents(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t n, const Bcachefs_dirent_batch *batch);
+
+#define BCACHEFS_READ_GAP           (64ULL << 10)
+#define BCACHEFS_READ_MAX           (8ULL << 20)
+
+//! Part of a file to copy from the image into the arena of a batch read
+typedef struct {
+    uint64_t offset;                            //! location in the image
+    uint64_t size;
+    uint64_t arena_offset;                      //! destination in the arena
+    Bcachefs_extent_csum csum;                  //! checked when the filesystem verifies reads
+    uint64_t read_offset;                       //! range of the image read for the span, set by exec
+    uint64_t read_size;
+} Bcachefs_read_span;
+
+//! Layout of a batch of whole files read into one contiguous arena
+typedef struct {
+    Bcachefs_read_span *spans;
+    uint32_t nr_spans;
+    uint32_t spans_capacity;
+    Bcachefs_read_span *inline_spans;           //! parts of files stored inline, their offset is in inline_data
+    uint32_t nr_inline_spans;
+    uint32_t inline_spans_capacity;
+    uint8_t *inline_data;                       //! inline extents copied out of the btree nodes while planning
+    uint64_t inline_data_size;
+    uint64_t inline_data_capacity;
+    uint64_t *offsets;                          //! nr_inodes + 1 offsets, file i is arena[offsets[i]:offsets[i + 1]]
+    uint32_t nr_inodes;
+    uint64_t arena_size;
+    uint32_t nr_csum_errors;                    //! extents which failed verification during exec
+    uint32_t nr_decode_errors;                  //! extents which could not be decompressed during exec
+} Bcachefs_read_plan;
+
+//! Outcome of Bcachefs_verify
+typedef struct {
+    uint64_t extents;                           //! checksummed regions stored out of the btree nodes
+    uint64_t verified;
+    uint64_t skipped;                           //! extents without checksum or with an unsupported one
+    uint64_t errors;                            //! extents which could not be read or failed verification
+    uint64_t bytes;                             //! bytes hashed
+} Bcachefs_verify_stats;
+
+// Called for each extent failing verification, calls are serialized
+typedef void (*Bcachefs_verify_cb)(const Bcachefs_extent *extent, void *arg);
+
+void Bcachefs_set_verify(Bcachefs *this, int verify);
+void Bcachefs_set_decode_threads(Bcachefs *this, uint32_t nr_threads);
+int Bcachefs_verify(const Bcachefs *this, uint32_t nr_threads, Bcachefs_verify_stats *stats,
+                    Bcachefs_verify_cb cb, void *arg);
+int Bcachefs_find_inode(const Bcachefs *this, uint64_t inode, Bcachefs_inode *out);
+int Bcachefs_read_plan_build(const Bcachefs *this, const uint64_t *inodes, uint32_t nr_inodes, Bcachefs_read_plan *plan);
+int Bcachefs_read_plan_exec(const Bcachefs *this, Bcachefs_read_plan *plan, uint8_t *arena, uint64_t gap);
+const void *Bcachefs_read_plan_map(const Bcachefs *this, const Bcachefs_read_plan *plan);
+void Bcachefs_read_plan_free(Bcachefs_read_plan *plan);
+
+//! Key range of a btree scanned by a single worker
+typedef struct {
+    struct bpos start;
+    struct bpos end;
+} Bcachefs_scan_range;
+
+// Called by the workers of Bcachefs_scan with an iterator seeked to the range
+// of `partition`, returns 0 to abort the scan
+typedef int (*Bcachefs_scan_cb)(const Bcachefs *this, Bcachefs_iterator *iter, uint32_t partition, void *arg);
+
+int Bcachefs_scan_partitions(const Bcachefs *this, enum btree_id type, struct bpos start, struct bpos end,
+                             uint32_t min_partitions, Bcachefs_scan_range **ranges, uint32_t *nr_ranges);
+int Bcachefs_scan(const Bcachefs *this, enum btree_id type, const Bcachefs_scan_range *ranges, uint32_t nr_ranges,
+                  uint32_t nr_threads, Bcachefs_scan_cb cb, void *arg);
+
+// Called by Bcachefs_scan_btree once the btree is partitioned, before the
+// workers start, returns 0 to abort the scan
+typedef int (*Bcachefs_scan_prepare_cb)(uint32_t nr_partitions, void *arg);
+
+int Bcachefs_scan_btree(const Bcachefs *this, enum btree_id type, uint32_t nr_threads,
+                        Bcachefs_scan_prepare_cb prepare, Bcachefs_scan_cb cb, void *arg);
+
+int Bcachefs_hash_info(const Bcachefs *this, uint64_t inode, struct bch_hash_info *info);
+Bcachefs_dirent Bcachefs_lookup_dirent(const Bcachefs *this, uint64_t parent_inode, const uint8_t *name, uint8_t name_len);
+
+//! Tables of a namespace index
+enum Bcachefs_index_table {
+    BCACHEFS_INDEX_INODE,                       //! u64 inode numbers, sorted
+    BCACHEFS_INDEX_INODE_SIZE,                  //! u64 size of each inode
+    BCACHEFS_INDEX_INODE_EXTENTS,               //! u64 nr_inodes + 1, extents of inode i are [extents[i], extents[i + 1])
+    BCACHEFS_INDEX_INODE_CHILDREN,              //! u64 nr_inodes + 1, dirents of directory i are [children[i], children[i + 1])
+    BCACHEFS_INDEX_EXTENT_FILE_OFFSET,          //! u64 per extent, grouped by inode in file order
+    BCACHEFS_INDEX_EXTENT_OFFSET,               //! u64
+    BCACHEFS_INDEX_EXTENT_SIZE,                 //! u64
+    BCACHEFS_INDEX_EXTENT_INLINE,               //! u64 nr_extents + 1 offsets into the inline data, empty if not inline
+    BCACHEFS_INDEX_EXTENT_COMPRESSION,          //! u8
+    BCACHEFS_INDEX_INLINE_DATA,                 //! u8 data of the inline extents
+    BCACHEFS_INDEX_DIRENT_PARENT,               //! u64 per dirent, grouped by parent in btree order
+    BCACHEFS_INDEX_DIRENT_INODE,                //! u64
+    BCACHEFS_INDEX_DIRENT_NAME,                 //! u64 nr_dirents + 1 offsets into the names
+    BCACHEFS_INDEX_DIRENT_TYPE,                 //! u8
+    BCACHEFS_INDEX_NAMES,                       //! u8 names of the dirents packed one after the other
+    BCACHEFS_INDEX_BUCKETS,                     //! u32 hash table of (parent, name), dirent + 1 or 0 if the slot is free
+    BCACHEFS_INDEX_NR_TABLES
+};
+
+#define BCACHEFS_INDEX_VERSION      1
+
+//! Header of a namespace index, the tables follow at the offsets in `tables`,
+//! each aligned on 8 bytes
+typedef struct {
+    uint8_t magic[8];                           //! "BCHINDEX"
+    uint32_t version;
+    uint32_t nr_tables;
+    struct uuid uuid;                           //! filesystem the index was built from
+    uint64_t seq;                               //! superblock sequence number when it was built
+    uint64_t image_size;                        //! size of the image it was built from
+    uint64_t size;                              //! bytes of the whole index
+    uint64_t nr_inodes;
+    uint64_t nr_extents;
+    uint64_t nr_dirents;
+    uint64_t inline_size;
+    uint64_t names_size;
+    uint64_t nr_buckets;                        //! a power of 2 larger than nr_dirents
+    uint64_t tables[BCACHEFS_INDEX_NR_TABLES];
+} Bcachefs_index_header;
+
+//! Namespace of an image laid out in flat tables held in a single buffer, so
+//! it can be written to a file and mapped back as is
+typedef struct {
+    const uint8_t *base;                        //! header followed by the tables
+    uint64_t size;
+    int mapped;                                 //! base is a mapping instead of an allocation
+    const Bcachefs_index_header *header;        //! NULL if no index is loaded
+    const uint64_t *inode;
+    const uint64_t *inode_size;
+    const uint64_t *inode_extents;
+    const uint64_t *inode_children;
+    const uint64_t *extent_file_offset;
+    const uint64_t *extent_offset;
+    const uint64_t *extent_size;
+    const uint64_t *extent_inline;
+    const uint8_t *extent_compression;
+    const uint8_t *inline_data;
+    const uint64_t *dirent_parent;
+    const uint64_t *dirent_inode;
+    const uint64_t *dirent_name;
+    const uint8_t *dirent_type;
+    const uint8_t *names;
+    const uint32_t *buckets;
+} Bcachefs_index;
+
+int Bcachefs_index_build(const Bcachefs *this, uint32_t nr_threads, Bcachefs_index *index);
+int Bcachefs_index_save(const Bcachefs_index *index, const char *path);
+int Bcachefs_index_load(const Bcachefs *this, Bcachefs_index *index, const char *path);
+int Bcachefs_index_copy(const Bcachefs *this, Bcachefs_index *index, const void *data, uint64_t size);
+int Bcachefs_index_share(const Bcachefs_index *index, const char *name);
+int Bcachefs_index_attach(const Bcachefs *this, Bcachefs_index *index, const char *name);
+int Bcachefs_index_unshare(const char *name);
+void Bcachefs_index_free(Bcachefs_index *index);
+int64_t Bcachefs_index_find_inode(const Bcachefs_index *index, uint64_t inode);
+int64_t Bcachefs_index_lookup(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *name, uint64_t name_len);
+int64_t Bcachefs_index_resolve(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *path, uint64_t path_len);
+
+uint64_t benz_siphash24(uint64_t k0, uint64_t k1, const uint8_t *data, uint64_t len);
+uint32_t benz_crc32c(uint32_t crc, const uint8_t *data, uint64_t len);
+uint64_t benz_crc64_be(uint64_t crc, const uint8_t *data, uint64_t len);
+uint64_t benz_xxh64(uint64_t seed, const uint8_t *data, uint64_t len);
+int benz_bch_checksum(uint8_t csum_type, const uint8_t *data, uint64_t len, struct bch_csum *csum);
+int benz_bch_decompress(uint8_t compression_type, const uint8_t *src, uint64_t src_len, uint8_t *dst, uint64_t dst_len);
+uint64_t benz_bch_dirent_hash(const struct bch_hash_info *info, const uint8_t *name, uint8_t name_len);
 
 uint64_t benz_get_flag_bits(const uint64_t bitfield, uint8_t first_bit, uint8_t last_bit);
 
-uint64_t benz_uintXX_as_uint64(const uint8_t *bytes, uint8_t sizeof_uint);
+uint64_t benz_uintXX_as_uint64(const uint8_t *bytes, uint8_t bits);
 
 void benz_print_chars(const uint8_t *bytes, uint64_t len);
 void benz_print_bytes(const uint8_t *bytes, uint64_t len);
@@ -1,7 +1,9 @@
 # This Python file uses the following encoding: utf-8
 
+import functools
 import io
 import os
+import time
 from dataclasses import dataclass
 
 from PIL.Image import WEB
@@ -20,6 +22,16 @@ DIRENT_TYPE = 2
 DIR_TYPE = 4
 FILE_TYPE = 8
 
+# Which replica of an extent is read: the first one that is neither cached
+# nor on a missing device, the one on the device with the least bytes in
+# flight or one after the other
+READ_POLICY_FIRST = 0
+READ_POLICY_LEAST_LOADED = 1
+READ_POLICY_ROUND_ROBIN = 2
+
+# Inodes whose extents and size are kept by a lazily opened image
+LAZY_CACHE_SIZE = 1 << 16
+
 
 @dataclass(eq=True, frozen=True)
 class Extent:
@@ -27,6 +39,9 @@ class Extent:
     file_offset: int = 0
     offset: int = 0
     size: int = 0
+    compression_type: int = 0
+    # Content of extents stored inline in the btree, None for the others
+    data: bytes = None
 
 
 @dataclass(eq=True, frozen=True)
@@ -61,14 +76,20 @@ LOSTFOUND_DIRENT = DirEnt(4096, 4097, DIR_TYPE, "lost+found")
 class _BcachefsFileBinary(io.BufferedIOBase):
     """Python file interface for Bcachefs files"""
 
-    def __init__(self, name, extents, file, inode, size):
+    def __init__(self, name, extents, file, inode, size, cfile=None):
         self.name = file
         self._inode = inode
         self._size = size
 
-        # underlying bcachefs archive
+        # underlying bcachefs archive, only read with positional reads so
+        # it can be shared between files, threads and forked processes
         # DO NOT close this!!
         self._file = file
+        self._fd = file.fileno() if file is not None else -1
+
+        # whole file reads go through the C file when there is one, in a
+        # single copy
+        self._cfile = cfile
 
         # sort by offset so the extents are always in the right order
         sorted(extents, key=lambda extent: extent.file_offset)
@@ -124,18 +145,18 @@ class _BcachefsFileBinary(io.BufferedIOBase):
         return bytes(buffer[:size])
 
     def readall(self) -> bytes:
-        """Most efficient way to read a file, single allocation"""
-        buffer = np.empty(self._size, dtype="<u1")
-        memory = memoryview(buffer)
-
-        for extent in self._extents:
-            s = extent.file_offset
-            e = s + extent.size
-
-            self._file.seek(extent.offset)
-            self._file.readinto(memory[s:e])
+        """Most efficient way to read a file, single allocation and copy"""
+        if self._pos == 0 and self._cfile is not None:
+            self._finish()
+            return self._cfile.read()
+        buffer = bytearray(self._size - self._pos)
+        size = self.readinto(buffer)
+        return bytes(buffer[:size])
 
-        return bytes(buffer)
+    def _finish(self):
+        self._extent_pos = len(self._extents)
+        self._extent_read = 0
+        self._pos = self._size
 
     def readinto1(self, b: memoryview) -> int:
         """Read at most one extend
@@ -154,8 +175,13 @@ class _BcachefsFileBinary(io.BufferedIOBase):
         # continue reading the current extent
         extent = self._extents[self._extent_pos]
 
-        self._file.seek(extent.offset + self._extent_read)
-        read = self._file.readinto(b)
+        if extent.data is not None:
+            # Inline extents were loaded with the btree, no need to read them
+            data = extent.data[self._extent_read : self._extent_read + len(b)]
+            read = len(data)
+            b[:read] = data
+        else:
+            read = os.preadv(self._fd, [b], extent.offset + self._extent_read)
 
         self._extent_read += read
         self._pos += read
@@ -178,6 +204,10 @@ class _BcachefsFileBinary(io.BufferedIOBase):
     def readinto(self, b: memoryview) -> int:
         """Read until the buffer is full"""
         n = len(b)
+        if self._pos == 0 and n >= self._size and self._cfile is not None:
+            # The whole file fits, read it straight into the buffer
+            self._finish()
+            return self._cfile.readinto(b)
         size = self.readinto1(b)
 
         while size < n and not self.closed:
@@ -250,22 +280,91 @@ class Bcachefs:
     ...     with image.open('file.bin', 'rb') as f:
     ...         bytes = f.read()
 
+    By default the image is mapped in memory: btree nodes and contiguous
+    files are then read in place, without a copy, and the page cache is the
+    only cache. The btree node cache is not used by mapped images, and
+    neither is the io_uring prefetch of btree nodes, which loads nodes in
+    that cache. With `mmap=False`, nodes are read with pread into the node
+    cache, which bounds the memory used for the btrees. An image which can't
+    be mapped, like a huge image under an address space limit, is read with
+    pread as with `mmap=False`
+
+    The image can also be a file descriptor, like a memfd, or a buffer already
+    holding the image, which is read in place. Images in memory are pickled
+    with their content
+
+    >>> with BCacheFS(memoryview(data)) as image:
+    ...     bytes = image.read_file('file.bin')
+
+    A filesystem spread over several devices is opened from the image of one
+    of its members, the images of the other members are listed in `devices`
+
+    >>> with BCacheFS('/path/to/dev0', devices=['/path/to/dev1']) as image:
+    ...     bytes = image.read_file('file.bin')
+
+    The namespace is a compact index built from the btrees at open, and
+    pickled along with the image. With an `index` file, the index is built
+    and saved on the first open, then mapped as is by the next ones, and
+    rebuilt if the image changed
+
+    >>> with BCacheFS('/path/to/image', index='/path/to/image.index') as image:
+    ...     bytes = image.read_file('file.bin')
+
+    With `shared_index` and no index file, the index is built at open and
+    copied in shared memory. Processes the image is pickled to, like data
+    loader workers, attach to it by name instead of receiving a copy of the
+    namespace. The shared memory is removed when the image is closed
+
+    With `lazy`, nothing is loaded at open. Paths are resolved with hashed
+    lookups in the dirents btree and the extents and size of a file are
+    fetched when it is opened, the last LAZY_CACHE_SIZE of them are kept
+
+    >>> with BCacheFS('/path/to/image', lazy=True) as image:
+    ...     bytes = image.read_file('file.bin')
+
     """
 
-    def __init__(self, path: str, mode: str = "rb"):
+    def __init__(
+        self,
+        path: [str, int, bytes],
+        mode: str = "rb",
+        mmap: bool = True,
+        cache_size: int = None,
+        readahead: int = None,
+        io_uring: bool = False,
+        verify: bool = False,
+        decode_threads: int = None,
+        read_policy: int = READ_POLICY_FIRST,
+        devices: list = None,
+        index: str = None,
+        shared_index: bool = False,
+        lazy: bool = False,
+    ):
         assert mode in ("r", "rb"), "Only reading is supported"
+        assert not devices or isinstance(path, (str, os.PathLike)), "Members are opened by path"
 
         self._path = path
+        self._mmap = mmap
+        self._cache_size = cache_size
+        self._readahead = readahead
+        self._io_uring = io_uring
+        self._verify = verify
+        self._decode_threads = decode_threads
+        self._read_policy = read_policy
+        self._devices = list(devices) if devices else []
+        self._index = index
+        self._shared_index = shared_index
+        self._lazy = lazy
+        self._shm_name = None  # shared memory holding the index
+        self._shm_owner = None  # pid of the process which created it
         self._filesystem = None
         self._size = 0
         self._file: [io.RawIOBase] = None
         self._closed = True
         self._pwd = "/"  # Used in Cursor
         self._dirent = ROOT_DIRENT  # Used in Cursor
-        self._extents_map = {}
-        self._inodes_ls = {ROOT_DIRENT.inode: []}
-        self._inodes_tree = {}
-        self._inode_map = {}
+        self._index_data = None  # index received with a pickled image
+        self._lazy_inode = functools.lru_cache(LAZY_CACHE_SIZE)(self._fetch_inode)
 
     def open(self, name: [str, int], mode: str = "rb", encoding: str = "utf-8"):
         """Open a file inside the image for reading
@@ -285,13 +384,28 @@ class Bcachefs:
         if isinstance(name, str):
             inode = self.find_dirent(name).inode
 
-        extents = self._extents_map.get(inode)
+        extents = self._file_extents(inode)
 
         if extents is None:
             raise FileNotFoundError(f"{name} was not found")
 
-        file_size = self._inode_map[inode]
-        base = _BcachefsFileBinary(name, extents, self._file, inode, file_size)
+        # The content is read once, as checksums and compression cover whole
+        # extents and extents of other devices and images in memory are only
+        # reachable through the batched reads
+        whole = (
+            self._verify
+            or self._devices
+            or self._file is None
+            or any(e.compression_type for e in extents)
+        )
+        cfile = self._filesystem.file(inode) if whole or self._mmap else None
+        if cfile is not None and (whole or cfile.mapped):
+            # Read from the content of the file, in place in the image when
+            # it is mapped and the file is contiguous
+            extents = [Extent(inode, 0, 0, cfile.size, 0, memoryview(cfile))]
+
+        file_size = self._file_size(inode)
+        base = _BcachefsFileBinary(name, extents, self._file, inode, file_size, cfile)
         return base
 
     def namelist(self):
@@ -302,7 +416,7 @@ class Bcachefs:
         Added for parity with Zipfile interface
         """
 
-        directories = self._inodes_ls.get(ROOT_DIRENT.inode, [])
+        directories = self._children(ROOT_DIRENT.inode)
         return self._namelist("", directories)
 
     def _namelist(self, path, directories):
@@ -310,7 +424,7 @@ class Bcachefs:
 
         for dirent in directories:
             if dirent.is_dir:
-                children = self._inodes_ls.get(dirent.inode, [])
+                children = self._children(dirent.inode)
                 names.extend(
                     self._namelist(os.path.join(path, dirent.name), children)
                 )
@@ -328,7 +442,7 @@ class Bcachefs:
         self.close()
 
     def __iter__(self):
-        return (ent for ent in self._inodes_tree.values())
+        return iter(self._dirents())
 
     @property
     def path(self) -> str:
@@ -342,20 +456,99 @@ class Bcachefs:
     def closed(self) -> bool:
         return self._closed
 
+    @property
+    def cache_stats(self) -> dict:
+        """Btree node cache statistics, the cache is not used by mapped images"""
+        hits, misses, size, capacity = self._filesystem.cache_stats
+        return dict(hits=hits, misses=misses, size=size, capacity=capacity)
+
     def cd(self, path: str = "/"):
-        cursor = Cursor(
-            self.path, self._extents_map, self._inodes_ls, self._inodes_tree
-        )
+        cursor = Cursor(self)
         return cursor.cd(path)
 
+    @property
+    def _in_memory(self) -> bool:
+        return not isinstance(self._path, (str, int, os.PathLike))
+
+    def _open_file(self):
+        """File the image is read from, None for images in memory"""
+        if self._in_memory:
+            return None
+        if isinstance(self._path, int):
+            return open(self._path, "rb", closefd=False)
+        return open(self._path, "rb")
+
+    def _open_filesystem(self):
+        self._filesystem = _Bcachefs()
+        if self._devices:
+            paths = [os.fspath(p) for p in [self._path] + self._devices]
+            self._filesystem.open_multi(paths, self._mmap)
+        elif self._file is not None:
+            # Btrees and files are read through the same open file
+            self._filesystem.open_fd(self._file.fileno(), self._mmap)
+        elif self._in_memory:
+            self._filesystem.open_memory(self._path)
+        elif isinstance(self._path, int):
+            self._filesystem.open_fd(self._path, self._mmap)
+        else:
+            self._filesystem.open(os.fspath(self._path), self._mmap)
+        if self._cache_size is not None:
+            self._filesystem.set_cache_size(self._cache_size)
+        if self._readahead is not None:
+            self._filesystem.set_readahead(self._readahead)
+        if self._io_uring:
+            # Falls back to pread if io_uring is not available
+            self._filesystem.enable_io_uring()
+        self._filesystem.set_verify(self._verify)
+        if self._decode_threads is not None:
+            self._filesystem.set_decode_threads(self._decode_threads)
+        self._filesystem.set_read_policy(self._read_policy)
+        if self._lazy:
+            return
+        if self._index:
+            self._load_index()
+        elif self._shared_index:
+            self._attach_index()
+        elif self._index_data is not None:
+            if not self._filesystem.load_index_data(self._index_data):
+                self._filesystem.build_index()
+            self._index_data = None
+        else:
+            self._filesystem.build_index()
+
+    def _load_index(self):
+        if self._filesystem.load_index(self._index):
+            return
+        # Missing or built from another state of the image
+        self._filesystem.build_index()
+        try:
+            self._filesystem.save_index(self._index)
+        except RuntimeError:
+            # Keep the index in memory if it can not be saved
+            return
+        if not self._filesystem.load_index(self._index):
+            self._filesystem.build_index()
+
+    def _attach_index(self):
+        if self._shm_name is not None:
+            # Pickled from the process which shared the index
+            if not self._filesystem.attach_index(self._shm_name):
+                self._filesystem.build_index()
+            return
+        self._filesystem.build_index()
+        name = f"/bcachefs-index-{os.getpid()}-{os.urandom(8).hex()}"
+        self._filesystem.share_index(name)
+        self._shm_name, self._shm_owner = name, os.getpid()
+        # Drop the private copy for the shared one
+        if not self._filesystem.attach_index(name):
+            self._filesystem.build_index()
+
     def _open(self):
         if self._closed:
-            self._filesystem = _Bcachefs()
-            self._filesystem.open(self._path)
+            self._file = self._open_file()
+            self._open_filesystem()
             self._size = self._filesystem.size
-            self._file = open(self._path, "rb")
             self._closed = False
-            self._parse()
 
     def close(self):
         if not self._closed:
@@ -364,23 +557,36 @@ class Bcachefs:
             if self._filesystem:
                 self._filesystem.close()
                 self._filesystem = None
+            self._lazy_inode.cache_clear()
+            if self._shm_name is not None and self._shm_owner == os.getpid():
+                _Bcachefs.unshare_index(self._shm_name)
+                self._shm_name = None
             self._size = 0
-            self._file.close()
-            self._file = None
+            if self._file is not None:
+                self._file.close()
+                self._file = None
             self._closed = True
 
     def find_dirent(self, path: str = None) -> DirEnt:
         if not path:
             dirent = self._dirent
+        elif self._lazy:
+            dirent = self.lookup(path)
         else:
-            parts = [p for p in path.split("/") if p]
             dirent = self._dirent if not path.startswith("/") else ROOT_DIRENT
-            while parts:
-                dirent = self._inodes_tree.get(
-                    (dirent.inode, parts.pop(0)), None
-                )
-                if dirent is None:
-                    break
+            if path.strip("/"):
+                found = self._filesystem.index_resolve(dirent.inode, path)
+                dirent = DirEnt(*found) if found is not None else None
+        return dirent
+
+    def lookup(self, path: str) -> DirEnt:
+        """Resolve a path with hashed lookups in the dirents btree, without
+        relying on the namespace loaded at open"""
+        parts = [p for p in path.split("/") if p]
+        dirent = self._dirent if not path.startswith("/") else ROOT_DIRENT
+        while parts and dirent is not None:
+            found = self._filesystem.lookup(dirent.inode, parts.pop(0))
+            dirent = DirEnt(*found) if found is not None else None
         return dirent
 
     def ls(self, path: [str, DirEnt] = None):
@@ -392,13 +598,85 @@ class Bcachefs:
         else:
             parent = self.find_dirent(os.path.join(self._pwd, path))
         if parent.is_dir:
-            return self._inodes_ls[parent.inode]
+            return self._children(parent.inode)
         else:
             return [parent]
 
     def read_file(self, inode: [str, int]) -> memoryview:
-        with self.open(inode) as f:
-            return f.readall()
+        """Read-only view of the content of a file, in place in the image when
+        it is mapped and the extents of the file are contiguous in it"""
+        if isinstance(inode, str):
+            dirent = self.find_dirent(inode)
+            if dirent is None:
+                raise FileNotFoundError(f"{inode} was not found")
+            inode = dirent.inode
+        if self._file_extents(inode) is None:
+            raise FileNotFoundError(f"{inode} was not found")
+        return memoryview(self._filesystem.file(inode))
+
+    def read_many(self, files: list, gap: int = None) -> tuple:
+        """Read whole files in a single batch, ordered by their location in
+        the image and with nearby extents read together
+
+        Parameters
+        ----------
+        files: list
+            Paths to files or inode integers
+
+        gap: int
+            extents less than gap bytes apart are coalesced in a single read
+
+        Returns
+        -------
+        (arena, offsets) where file i is arena[offsets[i]:offsets[i + 1]]
+        """
+        if self._filesystem is None:
+            raise ValueError("I/O operation on closed image")
+        inodes = []
+        for name in files:
+            inode = name
+            if isinstance(name, str):
+                dirent = self.find_dirent(name)
+                if dirent is None:
+                    raise FileNotFoundError(f"{name} was not found")
+                inode = dirent.inode
+            inodes.append(inode)
+        args = (inodes,) if gap is None else (inodes, gap)
+        arena, offsets = self._filesystem.read_many(*args)
+        return memoryview(arena), np.frombuffer(offsets, dtype=np.uint64)
+
+    def verify(self, threads: int = 0) -> dict:
+        """Check the stored checksum of every extent of the image
+
+        Extents split into several keys share their checksum and are checked
+        and counted once.
+
+        Parameters
+        ----------
+        threads: int
+            number of threads hashing extents, 0 for one per cpu
+
+        Returns
+        -------
+        dict of the counts of extents, verified, skipped (no checksum or
+        encrypted) and errors, the bytes hashed, the throughput in bytes per
+        second and the (inode, file_offset) of the extents which failed
+        """
+        if self._filesystem is None:
+            raise ValueError("I/O operation on closed image")
+        start = time.perf_counter()
+        extents, verified, skipped, errors, nbytes, bad = self._filesystem.verify(threads)
+        seconds = time.perf_counter() - start
+        return dict(
+            extents=extents,
+            verified=verified,
+            skipped=skipped,
+            errors=errors,
+            bytes=nbytes,
+            seconds=seconds,
+            throughput=nbytes / seconds if seconds else 0.0,
+            bad_extents=sorted(bad),
+        )
 
     def walk(self, top: str = None):
         if not top:
@@ -410,101 +688,149 @@ class Bcachefs:
         if parent:
             return self._walk(top, parent)
 
-    def _parse(self):
-        if self._extents_map:
-            return
-
-        for dirent in BcachefsIterDirEnt(self._filesystem):
-            if dirent.is_dir:
-                self._inodes_ls.setdefault(dirent.inode, [])
+    # Namespace accessors, served by the index of the filesystem or by keyed
+    # btree lookups when the image is lazy
+
+    def _children(self, inode: int) -> list:
+        if self._lazy:
+            return list(BcachefsIterDirEnt(self._filesystem, (inode, 0), (inode, 2**64 - 1)))
+        return [DirEnt(*d) for d in self._filesystem.index_ls(inode) or []]
+
+    def _dirents(self) -> list:
+        if self._lazy:
+            return list(BcachefsIterDirEnt.items(BcachefsIterDirEnt.scan(self._filesystem)))
+        return [DirEnt(*d) for d in self._filesystem.index_dirents()]
+
+    def _file_extents(self, inode: int) -> list:
+        if self._lazy:
+            return self._lazy_inode(inode)[0]
+        extents = self._filesystem.index_extents(inode)
+        return [Extent(*e) for e in extents] if extents is not None else None
+
+    def _file_size(self, inode: int) -> int:
+        if self._lazy:
+            return self._lazy_inode(inode)[1]
+        return self._filesystem.index_inode_size(inode) or 0
+
+    def _fetch_inode(self, inode: int) -> tuple:
+        """(extents, size) of an inode, extents is None if it does not exist"""
+        found = next(BcachefsIterInode(self._filesystem, (0, inode), (0, inode)), None)
+        if found is None:
+            return None, 0
+        extents = list(BcachefsIterExtent(self._filesystem, (inode, 0), (inode, 2**64 - 1)))
+        return extents, found.size
+
+    # Dict views of the namespace, materialized at every access. Only meant
+    # for debugging and tests, they cost what the index saves
 
-        for dirent in BcachefsIterDirEnt(self._filesystem):
-            self._inodes_ls[dirent.parent_inode].append(dirent)
-            self._inodes_tree[(dirent.parent_inode, dirent.name)] = dirent
-
-        for extent in BcachefsIterExtent(self._filesystem):
-            self._extents_map.setdefault(extent.inode, [])
-            self._extents_map[extent.inode].append(extent)
-
-        for inode in BcachefsIterInode(self._filesystem):
-            self._inode_map[inode.inode] = inode.size
+    @property
+    def _extents_map(self) -> dict:
+        extents = {}
+        if self._lazy:
+            for extent in BcachefsIterExtent.items(BcachefsIterExtent.scan(self._filesystem)):
+                extents.setdefault(extent.inode, []).append(extent)
+            return extents
+        for inode, _ in self._filesystem.index_inodes():
+            inode_extents = self._file_extents(inode)
+            if inode_extents:
+                extents[inode] = inode_extents
+        return extents
 
-        for inode, extents in self._extents_map.items():
-            self._extents_map[inode] = self._unique_extent_list(extents)
+    @property
+    def _inode_map(self) -> dict:
+        if self._lazy:
+            return {
+                inode.inode: inode.size
+                for inode in BcachefsIterInode.items(BcachefsIterInode.scan(self._filesystem))
+            }
+        return dict(self._filesystem.index_inodes())
 
-        for parent_inode, ls in self._inodes_ls.items():
-            self._inodes_ls[parent_inode] = self._unique_dirent_list(ls)
+    @property
+    def _inodes_tree(self) -> dict:
+        return {(d.parent_inode, d.name): d for d in self._dirents()}
 
     def _walk(self, dirpath: str, dirent: DirEnt):
-        dirs = [ent for ent in self._inodes_ls[dirent.inode] if ent.is_dir]
-        files = [ent for ent in self._inodes_ls[dirent.inode] if not ent.is_dir]
+        children = self._children(dirent.inode)
+        dirs = [ent for ent in children if ent.is_dir]
+        files = [ent for ent in children if not ent.is_dir]
         yield dirpath, dirs, files
         for d in dirs:
             yield from self._walk(os.path.join(dirpath, d.name), d)
 
-    @staticmethod
-    def _unique_extent_list(inode_extents):
-        # It's possible to have multiple duplicated extents for a single inode
-        # and this implementation assumes that the last ones should be the
-        # correct ones.
-        unique_extent_list = []
-        for ent in sorted(inode_extents, key=lambda _: _.file_offset):
-            if ent not in unique_extent_list[-1:]:
-                unique_extent_list.append(ent)
-        return unique_extent_list
-
-    @staticmethod
-    def _unique_dirent_list(dirent_ls):
-        # It's possible to have multiple inodes for a single file and this
-        # implementation assumes that the last inode should be the correct one.
-        return list({ent.name: ent for ent in dirent_ls}.values())
-
     def __getstate__(self):
         return dict(
-            path=self._path,
+            path=self._path if not self._in_memory else bytes(self._path),
+            mmap=self._mmap,
+            cache_size=self._cache_size,
+            readahead=self._readahead,
+            io_uring=self._io_uring,
+            verify=self._verify,
+            decode_threads=self._decode_threads,
+            read_policy=self._read_policy,
+            devices=self._devices,
+            index=self._index,
+            shared_index=self._shared_index,
+            lazy=self._lazy,
+            shm_name=self._shm_name,
             size=self._size,
             closed=self._closed,
             pwd=self._pwd,
             dirent=self._dirent,
-            extents_map=self._extents_map,
-            inode_ls=self._inodes_ls,
-            inode_tree=self._inodes_tree,
-            inode_map=self._inode_map,
+            # Index files and shared memory are mapped back by name
+            index_data=(
+                self._filesystem.index_data()
+                if self._filesystem is not None
+                and not (self._index or self._shared_index or self._lazy)
+                else None
+            ),
         )
 
     def __setstate__(self, state):
         self._path = state["path"]
+        self._mmap = state["mmap"]
+        self._cache_size = state["cache_size"]
+        self._readahead = state["readahead"]
+        self._io_uring = state["io_uring"]
+        self._verify = state["verify"]
+        self._decode_threads = state["decode_threads"]
+        self._read_policy = state["read_policy"]
+        self._devices = state["devices"]
+        self._index = state["index"]
+        self._shared_index = state["shared_index"]
+        self._lazy = state["lazy"]
+        self._lazy_inode = functools.lru_cache(LAZY_CACHE_SIZE)(self._fetch_inode)
+        self._shm_name = state["shm_name"]
+        self._shm_owner = None
         self._size = state["size"]
         self._closed = state["closed"]
+        self._index_data = state["index_data"]
 
         if not self._closed:
-            self._file = open(self._path, "rb")
+            self._file = self._open_file()
 
         self._filesystem = None
         self._pwd = state["pwd"]
         self._dirent = state["dirent"]
-        self._extents_map = state["extents_map"]
-        self._inodes_ls = state["inode_ls"]
-        self._inodes_tree = state["inode_tree"]
-        self._inode_map = state["inode_map"]
+
+        if not self._closed:
+            self._open_filesystem()
 
 
 class Cursor(Bcachefs):
-    def __init__(
-        self,
-        path: [str, Bcachefs],
-        extents_map: dict,
-        inodes_ls: dict,
-        inodes_tree: dict,
-    ):
+    def __init__(self, path: [str, Bcachefs]):
         if isinstance(path, str):
             super(Cursor, self).__init__(path)
         else:
             path: Bcachefs
-            super(Cursor, self).__init__(path.path)
-        self._extents_map = extents_map
-        self._inodes_ls = inodes_ls
-        self._inodes_tree = inodes_tree
+            super(Cursor, self).__init__(
+                path.path,
+                index=path._index,
+                shared_index=path._shared_index,
+                lazy=path._lazy,
+            )
+            # Shares the index or the inode cache of the image
+            self._filesystem = path._filesystem
+            self._lazy_inode = path._lazy_inode
         self._is_owner = False
 
     def __iter__(self):
@@ -545,8 +871,19 @@ class Cursor(Bcachefs):
 
 
 class BcachefsIter:
-    def __init__(self, fs: _Bcachefs, t: int = DIRENT_TYPE):
+    """Iterate over the keys of a btree, optionally restricted to the keys
+    positioned in [start, end] where positions are (inode, offset) tuples"""
+
+    def __init__(
+        self, fs: _Bcachefs, t: int = DIRENT_TYPE, start: tuple = None, end: tuple = None
+    ):
         self._iter: _Bcachefs_iterator = fs.iter(t)
+        if start is not None or end is not None:
+            start = start if start is not None else (0, 0)
+            if end is None:
+                self._iter.seek(start)
+            else:
+                self._iter.seek(start, end)
 
     def __iter__(self):
         return self
@@ -558,25 +895,108 @@ class BcachefsIter:
         return item
 
 
-class BcachefsIterExtent(BcachefsIter):
-    def __init__(self, fs: _Bcachefs):
-        super(BcachefsIterExtent, self).__init__(fs, EXTENT_TYPE)
+class _BcachefsBatchIter(BcachefsIter):
+    """Decode the keys in batches of `batch_size` and hand them out one by one"""
 
-    def __next__(self):
-        return Extent(*super(BcachefsIterExtent, self).__next__())
+    TYPE = None
+    BATCH_SIZE = 4096
 
+    def __init__(self, fs: _Bcachefs, start: tuple = None, end: tuple = None):
+        super(_BcachefsBatchIter, self).__init__(fs, self.TYPE, start, end)
+        self._batch = iter(())
 
-class BcachefsIterInode(BcachefsIter):
-    def __init__(self, fs: _Bcachefs):
-        super(BcachefsIterInode, self).__init__(fs, INODE_TYPE)
+    @classmethod
+    def scan(cls, fs: _Bcachefs, threads: int = 0) -> tuple:
+        """Decode the whole btree with a pool of threads, 0 meaning one per
+        CPU, into the same columns as next_batch"""
+        return cls._columns(fs.scan(cls.TYPE, threads))
 
-    def __next__(self):
-        return Inode(*super(BcachefsIterInode, self).__next__())
+    def next_batch(self, n: int = BATCH_SIZE) -> tuple:
+        """Decode up to n keys into a tuple of numpy columns, the columns are
+        empty once the iteration is over"""
+        return self._columns(self._iter.next_batch(n))
 
+    @staticmethod
+    def _columns(columns: tuple) -> tuple:
+        return tuple(np.frombuffer(c, dtype=np.uint64) for c in columns)
 
-class BcachefsIterDirEnt(BcachefsIter):
-    def __init__(self, fs: _Bcachefs):
-        super(BcachefsIterDirEnt, self).__init__(fs, DIRENT_TYPE)
+    @staticmethod
+    def items(columns: tuple):
+        """Iterate over the items of columns"""
+        raise NotImplementedError
 
     def __next__(self):
-        return DirEnt(*super(BcachefsIterDirEnt, self).__next__())
+        item = next(self._batch, None)
+        if item is None:
+            columns = self.next_batch(self.BATCH_SIZE)
+            if not len(columns[0]):
+                raise StopIteration
+            self._batch = self.items(columns)
+            item = next(self._batch)
+        return item
+
+
+class BcachefsIterExtent(_BcachefsBatchIter):
+    """Columns are (inode, file_offset, offset, size) uint64 arrays, a
+    compression_type uint8 array, an inline_offset uint32 array of n + 1
+    offsets into the packed inline data bytes, empty for extents which are
+    not inline"""
+
+    TYPE = EXTENT_TYPE
+
+    @staticmethod
+    def _columns(columns: tuple) -> tuple:
+        *u64, compression_type, inline_offset, inline_data = columns
+        return tuple(np.frombuffer(c, dtype=np.uint64) for c in u64) + (
+            np.frombuffer(compression_type, dtype=np.uint8),
+            np.frombuffer(inline_offset, dtype=np.uint32),
+            inline_data,
+        )
+
+    @staticmethod
+    def items(columns: tuple):
+        *fields, inline_offset, inline_data = columns
+        inline_offset = inline_offset.tolist()
+        data = [
+            inline_data[begin:end] if end > begin else None
+            for begin, end in zip(inline_offset[:-1], inline_offset[1:])
+        ]
+        return map(Extent, *(c.tolist() for c in fields), data)
+
+
+class BcachefsIterInode(_BcachefsBatchIter):
+    """Columns are (inode, size) uint64 arrays"""
+
+    TYPE = INODE_TYPE
+
+    @staticmethod
+    def items(columns: tuple):
+        return map(Inode, *(c.tolist() for c in columns))
+
+
+class BcachefsIterDirEnt(_BcachefsBatchIter):
+    """Columns are (parent_inode, inode) uint64 arrays, a type uint8 array, a
+    name_offset uint32 array of n + 1 offsets into the packed names bytes"""
+
+    TYPE = DIRENT_TYPE
+
+    @staticmethod
+    def _columns(columns: tuple) -> tuple:
+        parent_inode, inode, types, name_offset, names = columns
+        return (
+            np.frombuffer(parent_inode, dtype=np.uint64),
+            np.frombuffer(inode, dtype=np.uint64),
+            np.frombuffer(types, dtype=np.uint8),
+            np.frombuffer(name_offset, dtype=np.uint32),
+            names,
+        )
+
+    @staticmethod
+    def items(columns: tuple):
+        parent_inode, inode, types, name_offset, names = columns
+        name_offset = name_offset.tolist()
+        names = [
+            names[begin:end].decode()
+            for begin, end in zip(name_offset[:-1], name_offset[1:])
+        ]
+        return map(DirEnt, parent_inode.tolist(), inode.tolist(), types.tolist(), names)
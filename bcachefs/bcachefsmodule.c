@@ -14,7 +14,12 @@
 
 static void PyBcachefs_dealloc(PyBcachefs* self)
 {
+    Bcachefs_index_free(&self->_index);
     Bcachefs_fini(&self->_fs);
+    if (self->_memory.obj)
+    {
+        PyBuffer_Release(&self->_memory);
+    }
     Py_TYPE(self)->tp_free(self);
 }
 
@@ -26,61 +31,1314 @@ static PyObject* PyBcachefs_new(PyTypeObject* type, PyObject* args, PyObject* kw
 {
     (void)args;
     (void)kwargs;
-    return type->tp_alloc(type, 0);
+    PyBcachefs *self = (PyBcachefs*)type->tp_alloc(type, 0);
+    if (self)
+    {
+        self->_fs.fd = -1;
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_open(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    int map = nargs > 1 ? PyObject_IsTrue(args[1]) : 0;
+    if (nargs < 1 || nargs > 2 || map < 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
+        return NULL;
+    }
+    const char *path = (void*)PyUnicode_1BYTE_DATA(args[0]);
+    if (!(map ? Bcachefs_open_mmap(&self->_fs, path) : Bcachefs_open(&self->_fs, path)))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Open the image from a file descriptor, optionally memory mapped. The
+ * descriptor stays owned by the caller
+ */
+
+static PyObject *PyBcachefs_open_fd(PyBcachefs *self, PyObject *args)
+{
+    int fd = -1;
+    int map = 0;
+    if (!PyArg_ParseTuple(args, "i|p", &fd, &map))
+    {
+        return NULL;
+    }
+    if (!(map ? Bcachefs_open_fd_mmap(&self->_fs, fd) : Bcachefs_open_fd(&self->_fs, fd)))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Open an image held by an object supporting the buffer protocol, the
+ * buffer is read in place and kept until the image is closed
+ */
+
+static PyObject *PyBcachefs_open_memory(PyBcachefs *self, PyObject *arg)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0)
+    {
+        return NULL;
+    }
+    if (!Bcachefs_open_memory(&self->_fs, view.buf, (uint64_t)view.len))
+    {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image in memory");
+        return NULL;
+    }
+    if (self->_memory.obj)
+    {
+        PyBuffer_Release(&self->_memory);
+    }
+    self->_memory = view;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Open a filesystem spread over several images, one per member device.
+ * The first image provides the btrees
+ */
+
+static PyObject *PyBcachefs_open_multi(PyBcachefs *self, PyObject *args)
+{
+    PyObject *arg = NULL;
+    int map = 0;
+    if (!PyArg_ParseTuple(args, "O|p", &arg, &map))
+    {
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(arg, "open_multi expects a sequence of paths");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    const Py_ssize_t nr_paths = PySequence_Fast_GET_SIZE(seq);
+    const char **paths = PyMem_Calloc(nr_paths ? nr_paths : 1, sizeof(const char*));
+    PyObject *ret = NULL;
+    if (paths == NULL)
+    {
+        PyErr_NoMemory();
+        goto end;
+    }
+    for (Py_ssize_t i = 0; i < nr_paths; ++i)
+    {
+        paths[i] = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+        if (paths[i] == NULL)
+        {
+            goto end;
+        }
+    }
+    if (!(map ? Bcachefs_open_multi_mmap(&self->_fs, paths, (uint32_t)nr_paths) :
+                Bcachefs_open_multi(&self->_fs, paths, (uint32_t)nr_paths)))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs member devices");
+        goto end;
+    }
+    Py_INCREF(Py_None);
+    ret = Py_None;
+
+end:
+    PyMem_Free(paths);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/**
+ * @brief
+ */
+
+static int _PyBcachefs_close(PyBcachefs *self)
+{
+    Bcachefs_index_free(&self->_index);
+    const int ret = Bcachefs_close(&self->_fs);
+    if (self->_memory.obj)
+    {
+        PyBuffer_Release(&self->_memory);
+    }
+    self->_close_pending = 0;
+    return ret;
+}
+
+static PyObject *PyBcachefs_close(PyBcachefs *self)
+{
+    if (self->_exports)
+    {
+        // Mapped files still point in the image, it is closed with the last
+        // of them
+        self->_close_pending = 1;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (!_PyBcachefs_close(self))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error closing Bcachefs image file");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_iter(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    PyBcachefs_iterator *iter = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_iteratorType, NULL);
+    if (iter)
+    {
+        Py_INCREF(self);
+        iter->_pyfs = self;
+    }
+    if (iter == NULL || nargs != 1 || !Bcachefs_iter(&iter->_pyfs->_fs, &iter->_iter, (enum btree_id)(int)PyLong_AsLong(args[0])))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
+        Py_XDECREF(iter);
+        return NULL;
+    }
+    return (PyObject*)iter;
+}
+
+/**
+ * @brief Hashed lookup of a name in a directory, returns None if not found
+ */
+
+static PyObject *PyBcachefs_lookup(PyBcachefs *self, PyObject *args)
+{
+    unsigned long long parent_inode = 0;
+    const char *name = NULL;
+    Py_ssize_t name_len = 0;
+    if (!PyArg_ParseTuple(args, "Ks#", &parent_inode, &name, &name_len))
+    {
+        return NULL;
+    }
+    if (name_len > 255)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    Bcachefs_dirent dirent = Bcachefs_lookup_dirent(&self->_fs, parent_inode,
+                                                    (const uint8_t*)name, (uint8_t)name_len);
+    if (dirent.inode == 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return Py_BuildValue("KKIs#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type,
+                         dirent.name, (Py_ssize_t)dirent.name_len);
+}
+
+/**
+ * Columns decoded by a scan worker for one partition.
+ */
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t *u64[4];
+    uint8_t *type;
+    uint32_t *name_offset;       /* capacity + 1 offsets into names */
+    uint8_t *names;              /* dirent names or inline extents data */
+    uint32_t names_capacity;
+} PyBcachefs_scan_part;
+
+typedef struct {
+    PyBcachefs_scan_part *parts;
+    uint32_t nr_parts;
+} PyBcachefs_scan_parts;
+
+static void _PyBcachefs_scan_part_free(PyBcachefs_scan_part *part)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        free(part->u64[i]);
+    }
+    free(part->type);
+    free(part->name_offset);
+    free(part->names);
+}
+
+static int _PyBcachefs_scan_part_reserve(PyBcachefs_scan_part *part, uint32_t names)
+{
+    if (part->count == part->capacity)
+    {
+        uint32_t capacity = part->capacity ? part->capacity * 2 : 1024;
+        for (int i = 0; i < 4; ++i)
+        {
+            uint64_t *u64 = realloc(part->u64[i], capacity * sizeof(uint64_t));
+            if (u64 == NULL)
+            {
+                return 0;
+            }
+            part->u64[i] = u64;
+        }
+        uint8_t *type = realloc(part->type, capacity * sizeof(uint8_t));
+        if (type == NULL)
+        {
+            return 0;
+        }
+        part->type = type;
+        uint32_t *name_offset = realloc(part->name_offset, (capacity + 1) * sizeof(uint32_t));
+        if (name_offset == NULL)
+        {
+            return 0;
+        }
+        if (part->name_offset == NULL)
+        {
+            name_offset[0] = 0;
+        }
+        part->name_offset = name_offset;
+        part->capacity = capacity;
+    }
+    // Room for at least one name
+    if (names && part->names_capacity - part->name_offset[part->count] < names)
+    {
+        uint32_t names_capacity = part->names_capacity ? part->names_capacity * 2 : 65536;
+        uint8_t *names = realloc(part->names, names_capacity);
+        if (names == NULL)
+        {
+            return 0;
+        }
+        part->names = names;
+        part->names_capacity = names_capacity;
+    }
+    return 1;
+}
+
+/**
+ * @brief Scan prepare callback, allocates the columns of the partitions
+ */
+
+static int _PyBcachefs_scan_prepare(uint32_t nr_partitions, void *arg)
+{
+    PyBcachefs_scan_parts *parts = arg;
+    parts->parts = calloc(nr_partitions ? nr_partitions : 1, sizeof(PyBcachefs_scan_part));
+    parts->nr_parts = parts->parts ? nr_partitions : 0;
+    return parts->parts != NULL;
+}
+
+/**
+ * @brief Scan worker callback, decodes the keys of a partition in batches
+ */
+
+static int _PyBcachefs_scan_cb(const Bcachefs *fs, Bcachefs_iterator *iter, uint32_t partition, void *arg)
+{
+    PyBcachefs_scan_part *part = &((PyBcachefs_scan_parts*)arg)->parts[partition];
+    for (;;)
+    {
+        if (!_PyBcachefs_scan_part_reserve(part, iter->type == BTREE_ID_dirents ? 255 :
+                                                 iter->type == BTREE_ID_extents ? BCACHEFS_INLINE_DATA_MAX : 0))
+        {
+            return 0;
+        }
+        const uint32_t n = part->capacity - part->count;
+        const uint32_t names_used = part->name_offset[part->count];
+        uint32_t count = 0;
+        switch ((int)iter->type)
+        {
+        case BTREE_ID_extents:
+        {
+            const Bcachefs_extent_batch batch = {.inode = part->u64[0] + part->count,
+                                                 .file_offset = part->u64[1] + part->count,
+                                                 .offset = part->u64[2] + part->count,
+                                                 .size = part->u64[3] + part->count,
+                                                 .compression_type = part->type + part->count,
+                                                 .inline_offset = part->name_offset + part->count,
+                                                 .inline_data = part->names + names_used,
+                                                 .inline_data_size = part->names_capacity - names_used};
+            count = Bcachefs_iter_next_batch_extents(fs, iter, n, &batch);
+            // The batch offsets are relative to its first inline extent
+            for (uint32_t i = 0; i <= count; ++i)
+            {
+                part->name_offset[part->count + i] += names_used;
+            }
+            break;
+        }
+        case BTREE_ID_inodes:
+        {
+            const Bcachefs_inode_batch batch = {.inode = part->u64[0] + part->count,
+                                                .size = part->u64[1] + part->count};
+            count = Bcachefs_iter_next_batch_inodes(fs, iter, n, &batch);
+            break;
+        }
+        case BTREE_ID_dirents:
+        {
+            const Bcachefs_dirent_batch batch = {.parent_inode = part->u64[0] + part->count,
+                                                 .inode = part->u64[1] + part->count,
+                                                 .type = part->type + part->count,
+                                                 .name_offset = part->name_offset + part->count,
+                                                 .names = part->names + names_used,
+                                                 .names_size = part->names_capacity - names_used};
+            count = Bcachefs_iter_next_batch_dirents(fs, iter, n, &batch);
+            // The batch offsets are relative to its first name
+            for (uint32_t i = 0; i <= count; ++i)
+            {
+                part->name_offset[part->count + i] += names_used;
+            }
+            break;
+        }
+        default:
+            return 0;
+        }
+        part->count += count;
+        if (count < n && !iter->pending)
+        {
+            return 1;
+        }
+    }
+}
+
+/**
+ * @brief Decodes a whole btree with a pool of threads, the GIL is released
+ * during the scan. Returns the same columns as Bcachefs_iterator.next_batch
+ */
+
+static PyObject *PyBcachefs_scan(PyBcachefs *self, PyObject *args)
+{
+    int type = 0;
+    unsigned int nr_threads = 0;
+    PyBcachefs_scan_parts scan = {0};
+    PyObject *columns[7] = {NULL};
+    int nr_columns = 0;
+    int names_column = 0;
+    int ret = 0;
+    if (!PyArg_ParseTuple(args, "i|I", &type, &nr_threads))
+    {
+        return NULL;
+    }
+    switch (type)
+    {
+    case BTREE_ID_extents:
+        nr_columns = 7;
+        names_column = 5;
+        break;
+    case BTREE_ID_inodes:
+        nr_columns = 2;
+        break;
+    case BTREE_ID_dirents:
+        nr_columns = 5;
+        names_column = 3;
+        break;
+    default:
+        PyErr_SetString(PyExc_RuntimeError, "Scans are not supported on this btree");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_scan_btree(&self->_fs, (enum btree_id)type, nr_threads,
+                              _PyBcachefs_scan_prepare, _PyBcachefs_scan_cb, &scan);
+    Py_END_ALLOW_THREADS
+    const PyBcachefs_scan_part *parts = scan.parts;
+
+    PyObject *result = NULL;
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error scanning Bcachefs btree");
+        goto end;
+    }
+
+    Py_ssize_t count = 0, names_size = 0;
+    for (uint32_t i = 0; i < scan.nr_parts; ++i)
+    {
+        count += parts[i].count;
+        names_size += parts[i].count ? parts[i].name_offset[parts[i].count] : 0;
+    }
+    for (int i = 0; i < nr_columns; ++i)
+    {
+        Py_ssize_t size = count * sizeof(uint64_t);
+        if (type == BTREE_ID_extents && i == 4)
+        {
+            size = count * sizeof(uint8_t);
+        }
+        else if (type == BTREE_ID_dirents && i == 2)
+        {
+            size = count * sizeof(uint8_t);
+        }
+        else if (names_column && i == names_column)
+        {
+            size = (count + 1) * sizeof(uint32_t);
+        }
+        else if (names_column && i == names_column + 1)
+        {
+            size = names_size;
+        }
+        columns[i] = PyBytes_FromStringAndSize(NULL, size);
+        if (columns[i] == NULL)
+        {
+            goto end;
+        }
+    }
+
+    // Partitions are in key order, concatenate them
+    Py_ssize_t offset = 0;
+    uint32_t names_offset = 0;
+    for (uint32_t p = 0; p < scan.nr_parts; ++p)
+    {
+        const PyBcachefs_scan_part *part = &parts[p];
+        if (part->count == 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < nr_columns && i < 2; ++i)
+        {
+            memcpy((uint64_t*)(void*)PyBytes_AS_STRING(columns[i]) + offset, part->u64[i], part->count * sizeof(uint64_t));
+        }
+        if (type == BTREE_ID_extents)
+        {
+            for (int i = 2; i < 4; ++i)
+            {
+                memcpy((uint64_t*)(void*)PyBytes_AS_STRING(columns[i]) + offset, part->u64[i], part->count * sizeof(uint64_t));
+            }
+            memcpy(PyBytes_AS_STRING(columns[4]) + offset, part->type, part->count);
+        }
+        else if (type == BTREE_ID_dirents)
+        {
+            memcpy(PyBytes_AS_STRING(columns[2]) + offset, part->type, part->count);
+        }
+        if (names_column)
+        {
+            uint32_t *name_offset = (uint32_t*)(void*)PyBytes_AS_STRING(columns[names_column]) + offset;
+            for (uint32_t i = 0; i < part->count; ++i)
+            {
+                name_offset[i] = names_offset + part->name_offset[i];
+            }
+            memcpy(PyBytes_AS_STRING(columns[names_column + 1]) + names_offset, part->names,
+                   part->name_offset[part->count]);
+            names_offset += part->name_offset[part->count];
+        }
+        offset += part->count;
+    }
+    if (names_column)
+    {
+        ((uint32_t*)(void*)PyBytes_AS_STRING(columns[names_column]))[count] = names_offset;
+    }
+
+    result = PyTuple_New(nr_columns);
+    if (result)
+    {
+        for (int i = 0; i < nr_columns; ++i)
+        {
+            PyTuple_SET_ITEM(result, i, columns[i]);
+            columns[i] = NULL;
+        }
+    }
+
+end:
+    for (int i = 0; i < nr_columns; ++i)
+    {
+        Py_XDECREF(columns[i]);
+    }
+    for (uint32_t i = 0; i < scan.nr_parts; ++i)
+    {
+        _PyBcachefs_scan_part_free(&scan.parts[i]);
+    }
+    free(scan.parts);
+    return result;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_set_cache_size(PyBcachefs *self, PyObject *arg)
+{
+    unsigned long long capacity = PyLong_AsUnsignedLongLong(arg);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (!Bcachefs_set_cache_size(&self->_fs, capacity))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error resizing Bcachefs node cache");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_set_readahead(PyBcachefs *self, PyObject *arg)
+{
+    unsigned long readahead = PyLong_AsUnsignedLong(arg);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (readahead > (uint32_t)-1 || !Bcachefs_set_readahead(&self->_fs, (uint32_t)readahead))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error setting Bcachefs readahead");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Batches the reads through io_uring, returns False if it is not
+ * available in which case reads keep using pread
+ */
+
+static PyObject *PyBcachefs_enable_io_uring(PyBcachefs *self, PyObject *args)
+{
+    unsigned int entries = BCACHEFS_URING_ENTRIES;
+    if (!PyArg_ParseTuple(args, "|I", &entries))
+    {
+        return NULL;
+    }
+    return PyBool_FromLong(Bcachefs_enable_uring(&self->_fs, entries));
+}
+
+/**
+ * @brief Reads a sequence of (offset, writable buffer[, dev]) in one batch,
+ * the GIL is released during the reads. The device defaults to the image
+ * opened first. Returns the list of bytes read per buffer
+ */
+
+static PyObject *PyBcachefs_pread_many(PyBcachefs *self, PyObject *arg)
+{
+    PyObject *seq = PySequence_Fast(arg, "pread_many expects a sequence of (offset, buffer[, dev])");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    const Py_ssize_t nr_reqs = PySequence_Fast_GET_SIZE(seq);
+    Bcachefs_read_req *reqs = PyMem_Calloc(nr_reqs ? nr_reqs : 1, sizeof(Bcachefs_read_req));
+    Py_buffer *views = PyMem_Calloc(nr_reqs ? nr_reqs : 1, sizeof(Py_buffer));
+    PyObject *ret = NULL;
+    Py_ssize_t nr_views = 0;
+    if (reqs == NULL || views == NULL)
+    {
+        PyErr_NoMemory();
+        goto end;
+    }
+    for (; nr_views < nr_reqs; ++nr_views)
+    {
+        unsigned long long offset = 0;
+        unsigned char dev = self->_fs.sb ? self->_fs.sb->dev_idx : 0;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, nr_views), "Kw*|b", &offset, &views[nr_views], &dev))
+        {
+            goto end;
+        }
+        reqs[nr_views] = (Bcachefs_read_req){.buf = views[nr_views].buf,
+                                             .size = (uint64_t)views[nr_views].len,
+                                             .offset = offset,
+                                             .buf_index = -1,
+                                             .dev = dev};
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_pread_many(&self->_fs, reqs, (uint32_t)nr_reqs);
+    Py_END_ALLOW_THREADS
+
+    ret = PyList_New(nr_reqs);
+    for (Py_ssize_t i = 0; ret && i < nr_reqs; ++i)
+    {
+        PyObject *result = PyLong_FromUnsignedLongLong(reqs[i].result);
+        if (result == NULL)
+        {
+            Py_CLEAR(ret);
+            break;
+        }
+        PyList_SET_ITEM(ret, i, result);
+    }
+
+end:
+    for (Py_ssize_t i = 0; i < nr_views; ++i)
+    {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    PyMem_Free(reqs);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/**
+ * @brief Reads whole files from a sequence of inodes in one batch, ordered by
+ * their location in the image, the GIL is released during the reads. Returns
+ * (arena, offsets) where file i is arena[offsets[i]:offsets[i + 1]] and
+ * offsets holds nr_inodes + 1 uint64
+ */
+
+static PyObject *PyBcachefs_read_many(PyBcachefs *self, PyObject *args)
+{
+    PyObject *arg = NULL;
+    unsigned long long gap = BCACHEFS_READ_GAP;
+    if (!PyArg_ParseTuple(args, "O|K", &arg, &gap))
+    {
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(arg, "read_many expects a sequence of inodes");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    const Py_ssize_t nr_inodes = PySequence_Fast_GET_SIZE(seq);
+    uint64_t *inodes = PyMem_Calloc(nr_inodes ? nr_inodes : 1, sizeof(uint64_t));
+    Bcachefs_read_plan plan = {0};
+    PyObject *arena = NULL;
+    PyObject *ret = NULL;
+    int built = 0;
+    int read = 0;
+    if (inodes == NULL)
+    {
+        PyErr_NoMemory();
+        goto end;
+    }
+    for (Py_ssize_t i = 0; i < nr_inodes; ++i)
+    {
+        inodes[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (PyErr_Occurred())
+        {
+            goto end;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    built = Bcachefs_read_plan_build(&self->_fs, inodes, (uint32_t)nr_inodes, &plan);
+    Py_END_ALLOW_THREADS
+    if (!built)
+    {
+        PyErr_NoMemory();
+        goto end;
+    }
+    arena = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)plan.arena_size);
+    if (arena == NULL)
+    {
+        goto end;
+    }
+
+    uint8_t *buffer = (uint8_t*)PyByteArray_AS_STRING(arena);
+    Py_BEGIN_ALLOW_THREADS
+    read = Bcachefs_read_plan_exec(&self->_fs, &plan, buffer, gap);
+    Py_END_ALLOW_THREADS
+    if (plan.nr_csum_errors)
+    {
+        PyErr_Format(PyExc_IOError, "Checksum mismatch in %u extents", plan.nr_csum_errors);
+        goto end;
+    }
+    if (plan.nr_decode_errors)
+    {
+        PyErr_Format(PyExc_IOError, "Could not decompress %u extents", plan.nr_decode_errors);
+        goto end;
+    }
+    if (!read)
+    {
+        PyErr_SetString(PyExc_IOError, "Could not read files");
+        goto end;
+    }
+    ret = Py_BuildValue("Oy#", arena, (const char*)plan.offsets,
+                        (Py_ssize_t)((nr_inodes + 1) * sizeof(uint64_t)));
+
+end:
+    Py_XDECREF(arena);
+    Bcachefs_read_plan_free(&plan);
+    PyMem_Free(inodes);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/**
+ * @brief Open the file of an inode, its content is exposed through the buffer
+ * protocol
+ */
+
+static PyObject *PyBcachefs_inode_file(PyBcachefs *self, PyObject *arg)
+{
+    const uint64_t inode = PyLong_AsUnsignedLongLong(arg);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (self->_fs.sb == NULL || self->_close_pending)
+    {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed Bcachefs image");
+        return NULL;
+    }
+    PyBcachefs_file *file = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_fileType, NULL);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    Py_INCREF(self);
+    file->_pyfs = self;
+    int ret = 0;
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_read_plan_build(&self->_fs, &inode, 1, &file->_plan);
+    Py_END_ALLOW_THREADS
+    if (!ret)
+    {
+        Py_DECREF(file);
+        PyErr_SetString(PyExc_IOError, "Could not find the extents of the file");
+        return NULL;
+    }
+    file->_map = Bcachefs_read_plan_map(&self->_fs, &file->_plan);
+    if (file->_map)
+    {
+        // The mapping lives as long as the file, closing the image waits for it
+        self->_exports += 1;
+    }
+    return (PyObject*)file;
+}
+
+/**
+ * @brief Verify the checksums of the extents of batched file reads
+ */
+
+static PyObject *PyBcachefs_set_verify(PyBcachefs *self, PyObject *arg)
+{
+    const int verify = PyObject_IsTrue(arg);
+    if (verify < 0)
+    {
+        return NULL;
+    }
+    Bcachefs_set_verify(&self->_fs, verify);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Set the number of threads verifying and decompressing batched file
+ * reads, 0 for one per cpu
+ */
+
+static PyObject *PyBcachefs_set_decode_threads(PyBcachefs *self, PyObject *arg)
+{
+    unsigned long nr_threads = PyLong_AsUnsignedLong(arg);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    Bcachefs_set_decode_threads(&self->_fs, (uint32_t)nr_threads);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Set the policy picking which replica of an extent to read
+ */
+
+static PyObject *PyBcachefs_set_read_policy(PyBcachefs *self, PyObject *arg)
+{
+    unsigned long policy = PyLong_AsUnsignedLong(arg);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (policy >= BCACHEFS_READ_POLICY_NR)
+    {
+        PyErr_Format(PyExc_ValueError, "Unknown read policy %lu", policy);
+        return NULL;
+    }
+    Bcachefs_set_read_policy(&self->_fs, (enum Bcachefs_read_policy)policy);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+typedef struct {
+    Bcachefs_extent *extents;
+    size_t count;
+    size_t capacity;
+} PyBcachefs_verify_errors;
+
+static void _PyBcachefs_verify_cb(const Bcachefs_extent *extent, void *arg)
+{
+    PyBcachefs_verify_errors *errors = arg;
+    if (errors->count == errors->capacity)
+    {
+        size_t capacity = errors->capacity ? errors->capacity * 2 : 16;
+        Bcachefs_extent *extents = realloc(errors->extents, capacity * sizeof(Bcachefs_extent));
+        if (extents == NULL)
+        {
+            return;
+        }
+        errors->extents = extents;
+        errors->capacity = capacity;
+    }
+    errors->extents[errors->count++] = *extent;
+}
+
+/**
+ * @brief Checks the stored checksums of all the extents of the image using a
+ * pool of threads, the GIL is released during the check. Returns (extents,
+ * verified, skipped, errors, bytes, [(inode, file_offset) of bad extents])
+ */
+
+static PyObject *PyBcachefs_verify(PyBcachefs *self, PyObject *args)
+{
+    unsigned int nr_threads = 0;
+    if (!PyArg_ParseTuple(args, "|I", &nr_threads))
+    {
+        return NULL;
+    }
+    Bcachefs_verify_stats stats = {0};
+    PyBcachefs_verify_errors errors = {0};
+    int ret = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_verify(&self->_fs, nr_threads, &stats, _PyBcachefs_verify_cb, &errors);
+    Py_END_ALLOW_THREADS
+
+    PyObject *result = NULL;
+    PyObject *bad = NULL;
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error scanning Bcachefs btree");
+        goto end;
+    }
+    bad = PyList_New((Py_ssize_t)errors.count);
+    for (size_t i = 0; bad && i < errors.count; ++i)
+    {
+        PyObject *item = Py_BuildValue("KK", errors.extents[i].inode, errors.extents[i].file_offset);
+        if (item == NULL)
+        {
+            Py_CLEAR(bad);
+            break;
+        }
+        PyList_SET_ITEM(bad, (Py_ssize_t)i, item);
+    }
+    if (bad)
+    {
+        result = Py_BuildValue("KKKKKN", stats.extents, stats.verified, stats.skipped, stats.errors,
+                               stats.bytes, bad);
+    }
+
+end:
+    free(errors.extents);
+    return result;
+}
+
+/**
+ * @brief Build the index of the namespace with a pool of threads, replacing
+ * the index already loaded if any
+ */
+
+static PyObject *PyBcachefs_build_index(PyBcachefs *self, PyObject *args)
+{
+    unsigned int nr_threads = 0;
+    int ret = 0;
+    if (!PyArg_ParseTuple(args, "|I", &nr_threads))
+    {
+        return NULL;
+    }
+    Bcachefs_index_free(&self->_index);
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_index_build(&self->_fs, nr_threads, &self->_index);
+    Py_END_ALLOW_THREADS
+
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error building Bcachefs index");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Write the index to a file, the GIL is released during the write
+ */
+
+static PyObject *PyBcachefs_save_index(PyBcachefs *self, PyObject *arg)
+{
+    const char *path = PyUnicode_AsUTF8(arg);
+    int ret = 0;
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_index_save(&self->_index, path);
+    Py_END_ALLOW_THREADS
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error saving Bcachefs index");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Map the index saved in a file, returns False if the file is missing
+ * or does not match the image
+ */
+
+static PyObject *PyBcachefs_load_index(PyBcachefs *self, PyObject *arg)
+{
+    const char *path = PyUnicode_AsUTF8(arg);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    Bcachefs_index_free(&self->_index);
+    return PyBool_FromLong(Bcachefs_index_load(&self->_fs, &self->_index, path));
+}
+
+/**
+ * @brief Copy of the index as bytes, to hand it over to another process
+ */
+
+static PyObject *PyBcachefs_index_data(PyBcachefs *self)
+{
+    if (self->_index.header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char*)self->_index.base, (Py_ssize_t)self->_index.size);
+}
+
+/**
+ * @brief Load an index from the bytes returned by index_data, returns False
+ * if it does not match the image
+ */
+
+static PyObject *PyBcachefs_load_index_data(PyBcachefs *self, PyObject *arg)
+{
+    Py_buffer view;
+    int ret = 0;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0)
+    {
+        return NULL;
+    }
+    Bcachefs_index_free(&self->_index);
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = Bcachefs_index_copy(&self->_fs, &self->_index, view.buf, (uint64_t)view.len);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
+    return PyBool_FromLong(ret);
+}
+
+/**
+ * @brief Copy the index in a POSIX shared memory object other processes can
+ * attach to by name
+ */
+
+static PyObject *PyBcachefs_share_index(PyBcachefs *self, PyObject *arg)
+{
+    const char *name = PyUnicode_AsUTF8(arg);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    if (!Bcachefs_index_share(&self->_index, name))
+    {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Map the index shared under a name, returns False if there is none
+ * or if it does not match the image
+ */
+
+static PyObject *PyBcachefs_attach_index(PyBcachefs *self, PyObject *arg)
+{
+    const char *name = PyUnicode_AsUTF8(arg);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    Bcachefs_index_free(&self->_index);
+    return PyBool_FromLong(Bcachefs_index_attach(&self->_fs, &self->_index, name));
+}
+
+/**
+ * @brief Remove the shared memory object of an index, processes which
+ * attached to it keep their mapping
+ */
+
+static PyObject *PyBcachefs_unshare_index(PyObject *cls, PyObject *arg)
+{
+    (void)cls;
+    const char *name = PyUnicode_AsUTF8(arg);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    return PyBool_FromLong(Bcachefs_index_unshare(name));
+}
+
+static PyObject *_PyBcachefs_index_dirent(const Bcachefs_index *index, uint64_t i)
+{
+    return Py_BuildValue("KKIs#", index->dirent_parent[i], index->dirent_inode[i], (uint32_t)index->dirent_type[i],
+                         (const char*)index->names + index->dirent_name[i],
+                         (Py_ssize_t)(index->dirent_name[i + 1] - index->dirent_name[i]));
+}
+
+static PyObject *_PyBcachefs_index_dirents(const Bcachefs_index *index, uint64_t first, uint64_t end)
+{
+    PyObject *list = PyList_New((Py_ssize_t)(end - first));
+    for (uint64_t i = first; list && i < end; ++i)
+    {
+        PyObject *dirent = _PyBcachefs_index_dirent(index, i);
+        if (dirent == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)(i - first), dirent);
+    }
+    return list;
+}
+
+static int64_t _PyBcachefs_index_find_inode(PyBcachefs *self, PyObject *arg)
+{
+    const unsigned long long inode = PyLong_AsUnsignedLongLong(arg);
+    if (inode == (unsigned long long)-1 && PyErr_Occurred())
+    {
+        return -2;
+    }
+    if (self->_index.header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return -2;
+    }
+    return Bcachefs_index_find_inode(&self->_index, inode);
+}
+
+/**
+ * @brief Find the dirent of a name in a directory inode in the index,
+ * returns None if not found
+ */
+
+static PyObject *PyBcachefs_index_lookup(PyBcachefs *self, PyObject *args)
+{
+    unsigned long long parent_inode = 0;
+    const char *name = NULL;
+    Py_ssize_t name_len = 0;
+    if (!PyArg_ParseTuple(args, "Ks#", &parent_inode, &name, &name_len))
+    {
+        return NULL;
+    }
+    if (self->_index.header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return NULL;
+    }
+    const int64_t i = Bcachefs_index_lookup(&self->_index, parent_inode, (const uint8_t*)name, (uint64_t)name_len);
+    if (i < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return _PyBcachefs_index_dirent(&self->_index, (uint64_t)i);
+}
+
+/**
+ * @brief Find the dirent of a path relative to a directory inode in the
+ * index, returns None if not found
+ */
+
+static PyObject *PyBcachefs_index_resolve(PyBcachefs *self, PyObject *args)
+{
+    unsigned long long parent_inode = 0;
+    const char *path = NULL;
+    Py_ssize_t path_len = 0;
+    if (!PyArg_ParseTuple(args, "Ks#", &parent_inode, &path, &path_len))
+    {
+        return NULL;
+    }
+    if (self->_index.header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return NULL;
+    }
+    const int64_t i = Bcachefs_index_resolve(&self->_index, parent_inode, (const uint8_t*)path, (uint64_t)path_len);
+    if (i < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return _PyBcachefs_index_dirent(&self->_index, (uint64_t)i);
+}
+
+/**
+ * @brief List the (inode, size) of every inode of the index
+ */
+
+static PyObject *PyBcachefs_index_inodes(PyBcachefs *self)
+{
+    const Bcachefs_index *index = &self->_index;
+    if (index->header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return NULL;
+    }
+    PyObject *list = PyList_New((Py_ssize_t)index->header->nr_inodes);
+    for (uint64_t i = 0; list && i < index->header->nr_inodes; ++i)
+    {
+        PyObject *inode = Py_BuildValue("KK", index->inode[i], index->inode_size[i]);
+        if (inode == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, inode);
+    }
+    return list;
+}
+
+/**
+ * @brief List the dirents of a directory inode in the index, returns None if
+ * the inode is not known
+ */
+
+static PyObject *PyBcachefs_index_ls(PyBcachefs *self, PyObject *arg)
+{
+    const int64_t i = _PyBcachefs_index_find_inode(self, arg);
+    if (i < -1)
+    {
+        return NULL;
+    }
+    if (i < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return _PyBcachefs_index_dirents(&self->_index, self->_index.inode_children[i], self->_index.inode_children[i + 1]);
+}
+
+/**
+ * @brief List every dirent of the index
+ */
+
+static PyObject *PyBcachefs_index_dirents(PyBcachefs *self)
+{
+    if (self->_index.header == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "No Bcachefs index loaded");
+        return NULL;
+    }
+    return _PyBcachefs_index_dirents(&self->_index, 0, self->_index.header->nr_dirents);
+}
+
+/**
+ * @brief List the extents of an inode in the index, in the same tuples as
+ * the iterator, returns None if the inode is not known
+ */
+
+static PyObject *PyBcachefs_index_extents(PyBcachefs *self, PyObject *arg)
+{
+    const Bcachefs_index *index = &self->_index;
+    const int64_t i = _PyBcachefs_index_find_inode(self, arg);
+    if (i < -1)
+    {
+        return NULL;
+    }
+    if (i < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    const uint64_t first = index->inode_extents[i];
+    const uint64_t end = index->inode_extents[i + 1];
+    PyObject *list = PyList_New((Py_ssize_t)(end - first));
+    for (uint64_t e = first; list && e < end; ++e)
+    {
+        const uint64_t inline_size = index->extent_inline[e + 1] - index->extent_inline[e];
+        PyObject *extent = inline_size ?
+            Py_BuildValue("KKKKIy#", index->inode[i], index->extent_file_offset[e], index->extent_offset[e],
+                          index->extent_size[e], (uint32_t)index->extent_compression[e],
+                          (const char*)index->inline_data + index->extent_inline[e], (Py_ssize_t)inline_size) :
+            Py_BuildValue("KKKKIO", index->inode[i], index->extent_file_offset[e], index->extent_offset[e],
+                          index->extent_size[e], (uint32_t)index->extent_compression[e], Py_None);
+        if (extent == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)(e - first), extent);
+    }
+    return list;
+}
+
+/**
+ * @brief Size of an inode in the index, returns None if the inode is not
+ * known
+ */
+
+static PyObject *PyBcachefs_index_inode_size(PyBcachefs *self, PyObject *arg)
+{
+    const int64_t i = _PyBcachefs_index_find_inode(self, arg);
+    if (i < -1)
+    {
+        return NULL;
+    }
+    if (i < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyLong_FromUnsignedLongLong(self->_index.inode_size[i]);
 }
 
 /**
- * @brief
+ * @brief Getter for the node cache statistics (hits, misses, size, capacity).
  */
 
-static PyObject *PyBcachefs_open(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject* PyBcachefs_getcache_stats(PyBcachefs* self, void* closure)
 {
-    (void)kwnames;
-    if (nargs != 1 || !Bcachefs_open(&self->_fs, (void*)PyUnicode_1BYTE_DATA(args[0])))
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
-        return NULL;
-    }
-    Py_INCREF(Py_None);
-    return Py_None;
+    (void)closure;
+    Bcachefs_cache_stats stats = Bcachefs_get_cache_stats(&self->_fs);
+    return Py_BuildValue("KKKK", stats.hits, stats.misses, stats.size, stats.capacity);
 }
 
 /**
- * @brief
+ * @brief Getter for the reflink cache statistics (hits, misses, size,
+ * capacity).
  */
 
-static PyObject *PyBcachefs_close(PyBcachefs *self)
+static PyObject* PyBcachefs_getreflink_cache_stats(PyBcachefs* self, void* closure)
 {
-    if (!Bcachefs_close(&self->_fs))
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Error closing Bcachefs image file");
-        return NULL;
-    }
-    Py_INCREF(Py_None);
-    return Py_None;
+    (void)closure;
+    Bcachefs_cache_stats stats = Bcachefs_get_reflink_cache_stats(&self->_fs);
+    return Py_BuildValue("KKKK", stats.hits, stats.misses, stats.size, stats.capacity);
 }
 
 /**
- * @brief
+ * @brief Getter for the index statistics (nr_inodes, nr_extents, nr_dirents,
+ * size), None if no index is loaded.
  */
 
-static PyObject *PyBcachefs_iter(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject* PyBcachefs_getindex_stats(PyBcachefs* self, void* closure)
 {
-    (void)kwnames;
-    PyBcachefs_iterator *iter = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_iteratorType, NULL);
-    if (iter)
-    {
-        Py_INCREF(self);
-        iter->_pyfs = self;
-    }
-    if (iter == NULL || nargs != 1 || !Bcachefs_iter(&iter->_pyfs->_fs, &iter->_iter, (enum btree_id)(int)PyLong_AsLong(args[0])))
+    (void)closure;
+    const Bcachefs_index_header *header = self->_index.header;
+    if (header == NULL)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
-        Py_XDECREF(iter);
-        return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
     }
-    Py_INCREF(iter);
-    return (PyObject*)iter;
+    return Py_BuildValue("KKKK", header->nr_inodes, header->nr_extents, header->nr_dirents, header->size);
 }
 
 /**
@@ -99,10 +1357,63 @@ static PyObject* PyBcachefs_getsize(PyBcachefs* self, void* closure)
 
 static PyMethodDef PyBcachefs_methods[] = {
     {"open", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_open,
-     METH_FASTCALL | METH_KEYWORDS, "Open bcachefs file to read"},
+     METH_FASTCALL | METH_KEYWORDS, "Open bcachefs file to read, optionally memory mapped"},
+    {"open_fd", (PyCFunction)PyBcachefs_open_fd, METH_VARARGS,
+     "Open bcachefs image from a file descriptor, optionally memory mapped"},
+    {"open_memory", (PyCFunction)PyBcachefs_open_memory, METH_O,
+     "Open bcachefs image held in a buffer, read in place"},
+    {"open_multi", (PyCFunction)PyBcachefs_open_multi, METH_VARARGS,
+     "Open a filesystem spread over several images, optionally memory mapped"},
     {"close", (PyCFunction)PyBcachefs_close, METH_NOARGS, "Close bcachefs file"},
     {"iter", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_iter,
      METH_FASTCALL | METH_KEYWORDS, "Iterate over entries of specified type"},
+    {"lookup", (PyCFunction)PyBcachefs_lookup, METH_VARARGS,
+     "Find the dirent of a name in a directory inode using the directory hash table"},
+    {"scan", (PyCFunction)PyBcachefs_scan, METH_VARARGS,
+     "Decode a whole btree into columns using a pool of threads"},
+    {"set_cache_size", (PyCFunction)PyBcachefs_set_cache_size, METH_O,
+     "Set the memory budget in bytes of the btree node cache, 0 disables it"},
+    {"enable_io_uring", (PyCFunction)PyBcachefs_enable_io_uring, METH_VARARGS,
+     "Batch the reads through an io_uring of the given size, returns False if not available"},
+    {"pread_many", (PyCFunction)PyBcachefs_pread_many, METH_O,
+     "Read a sequence of (offset, buffer[, dev]) in one batch, returns the bytes read per buffer"},
+    {"set_verify", (PyCFunction)PyBcachefs_set_verify, METH_O,
+     "Verify the checksums of the extents of batched file reads"},
+    {"set_decode_threads", (PyCFunction)PyBcachefs_set_decode_threads, METH_O,
+     "Set the number of threads verifying and decompressing batched file reads, 0 for one per cpu"},
+    {"file", (PyCFunction)PyBcachefs_inode_file, METH_O,
+     "Open the file of an inode, read in place when its extents are contiguous in a mapped image"},
+    {"verify", (PyCFunction)PyBcachefs_verify, METH_VARARGS,
+     "Check the checksums of all the extents with a pool of threads"},
+    {"set_read_policy", (PyCFunction)PyBcachefs_set_read_policy, METH_O,
+     "Set the policy picking which replica of an extent to read"},
+    {"read_many", (PyCFunction)PyBcachefs_read_many, METH_VARARGS,
+     "Read whole files from a sequence of inodes in one batch, returns (arena, offsets)"},
+    {"set_readahead", (PyCFunction)PyBcachefs_set_readahead, METH_O,
+     "Set the number of children of interior btree nodes read ahead, 0 disables it"},
+    {"build_index", (PyCFunction)PyBcachefs_build_index, METH_VARARGS,
+     "Build the index of the namespace using a pool of threads"},
+    {"save_index", (PyCFunction)PyBcachefs_save_index, METH_O, "Write the index to a file"},
+    {"load_index", (PyCFunction)PyBcachefs_load_index, METH_O,
+     "Map the index saved in a file, returns False if it is missing or stale"},
+    {"index_data", (PyCFunction)PyBcachefs_index_data, METH_NOARGS, "Copy of the index as bytes"},
+    {"load_index_data", (PyCFunction)PyBcachefs_load_index_data, METH_O,
+     "Load an index from the bytes of index_data, returns False if it is stale"},
+    {"share_index", (PyCFunction)PyBcachefs_share_index, METH_O,
+     "Copy the index in a shared memory object other processes can attach to"},
+    {"attach_index", (PyCFunction)PyBcachefs_attach_index, METH_O,
+     "Map the index shared under a name, returns False if it is missing or stale"},
+    {"unshare_index", (PyCFunction)PyBcachefs_unshare_index, METH_O | METH_STATIC,
+     "Remove the shared memory object of an index"},
+    {"index_lookup", (PyCFunction)PyBcachefs_index_lookup, METH_VARARGS,
+     "Find the dirent of a name in a directory inode in the index"},
+    {"index_resolve", (PyCFunction)PyBcachefs_index_resolve, METH_VARARGS,
+     "Find the dirent of a path relative to a directory inode in the index"},
+    {"index_inodes", (PyCFunction)PyBcachefs_index_inodes, METH_NOARGS, "List the (inode, size) of the index"},
+    {"index_ls", (PyCFunction)PyBcachefs_index_ls, METH_O, "List the dirents of a directory inode in the index"},
+    {"index_dirents", (PyCFunction)PyBcachefs_index_dirents, METH_NOARGS, "List every dirent of the index"},
+    {"index_extents", (PyCFunction)PyBcachefs_index_extents, METH_O, "List the extents of an inode in the index"},
+    {"index_inode_size", (PyCFunction)PyBcachefs_index_inode_size, METH_O, "Size of an inode in the index"},
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -112,6 +1423,12 @@ static PyMethodDef PyBcachefs_methods[] = {
 
 static PyGetSetDef PyBcachefs_getsetters[] = {
     {"size", (getter)PyBcachefs_getsize, 0, "Size of the image file", NULL},
+    {"cache_stats", (getter)PyBcachefs_getcache_stats, 0,
+     "Btree node cache (hits, misses, size, capacity)", NULL},
+    {"reflink_cache_stats", (getter)PyBcachefs_getreflink_cache_stats, 0,
+     "Resolved indirect extents cache (hits, misses, size, capacity)", NULL},
+    {"index_stats", (getter)PyBcachefs_getindex_stats, 0,
+     "Namespace index (nr_inodes, nr_extents, nr_dirents, size), None if not loaded", NULL},
     {NULL, NULL, 0, NULL, NULL}  /* Sentinel */
 };
 
@@ -190,7 +1507,15 @@ static PyObject *PyBcachefs_iterator_next(PyBcachefs_iterator *self)
     if (bch_val && iter->type == BTREE_ID_extents)
     {
         Bcachefs_extent extent = Bcachefs_iter_make_extent(fs, iter);
-        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+        uint64_t inline_size = 0;
+        const uint8_t *inline_data = Bcachefs_iter_inline_data(fs, iter, &inline_size);
+        if (inline_data == NULL)
+        {
+            return Py_BuildValue("KKKKIO", extent.inode, extent.file_offset, extent.offset, extent.size,
+                                 (uint32_t)extent.compression_type, Py_None);
+        }
+        return Py_BuildValue("KKKKIy#", extent.inode, extent.file_offset, extent.offset, extent.size,
+                             (uint32_t)extent.compression_type, inline_data, (Py_ssize_t)inline_size);
     }
     else if (bch_val && iter->type == BTREE_ID_dirents)
     {
@@ -208,15 +1533,206 @@ static PyObject *PyBcachefs_iterator_next(PyBcachefs_iterator *self)
         return Py_BuildValue("KKIU", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name);
     }
 
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_iterator_seek(PyBcachefs_iterator *self, PyObject *args)
+{
+    struct bpos start = POS_MIN;
+    struct bpos end = POS_MAX;
+    unsigned long long start_inode = 0, start_offset = 0;
+    unsigned long long end_inode = (uint64_t)-1, end_offset = (uint64_t)-1;
+    if (!PyArg_ParseTuple(args, "(KK)|(KK)", &start_inode, &start_offset, &end_inode, &end_offset))
+    {
+        return NULL;
+    }
+    start = SPOS(start_inode, start_offset, 0);
+    end = SPOS(end_inode, end_offset, (uint32_t)-1);
+    Bcachefs_iter_seek(&self->_pyfs->_fs, &self->_iter, start, end);
+    Py_INCREF(Py_None);
     return Py_None;
 }
 
+/**
+ * @brief List the pointers of the current extent as
+ * (dev, offset, gen, cached, stripe) tuples
+ */
+
+static PyObject *PyBcachefs_iterator_ptrs(PyBcachefs_iterator *self)
+{
+    const Bcachefs *fs = &self->_pyfs->_fs;
+    Bcachefs_iterator *iter = &self->_iter;
+    Bcachefs_extent_ptr ptrs[BCH_BKEY_PTRS_MAX];
+    if (iter->type != BTREE_ID_extents)
+    {
+        PyErr_SetString(PyExc_TypeError, "Not an extents iterator");
+        return NULL;
+    }
+    const uint32_t nr_ptrs = Bcachefs_iter_extent_ptrs(fs, iter, ptrs, BCH_BKEY_PTRS_MAX);
+    PyObject *list = PyList_New(nr_ptrs < BCH_BKEY_PTRS_MAX ? nr_ptrs : BCH_BKEY_PTRS_MAX);
+    for (uint32_t i = 0; list && i < nr_ptrs && i < BCH_BKEY_PTRS_MAX; ++i)
+    {
+        PyObject *ptr = Py_BuildValue("IKIOO", (uint32_t)ptrs[i].dev, ptrs[i].offset, (uint32_t)ptrs[i].gen,
+                                      ptrs[i].cached ? Py_True : Py_False, ptrs[i].stripe ? Py_True : Py_False);
+        if (ptr == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, ptr);
+    }
+    return list;
+}
+
+/**
+ * @brief Decodes up to n items at once into a tuple of bytes columns of
+ * native integers: (inode, file_offset, offset, size) u64, compression_type
+ * u8, inline_offset u32 and the packed inline data for extents,
+ * (inode, size) u64 for inodes and (parent_inode, inode) u64, type u8,
+ * name_offset u32 and the packed names for dirents. Empty columns mean the
+ * iteration is over
+ */
+
+static PyObject *PyBcachefs_iterator_next_batch(PyBcachefs_iterator *self, PyObject *arg)
+{
+    const Bcachefs *fs = &self->_pyfs->_fs;
+    Bcachefs_iterator *iter = &self->_iter;
+    PyObject *columns[7] = {NULL};
+    Py_ssize_t sizes[7] = {0};
+    int nr_columns = 0;
+    uint32_t count = 0;
+    unsigned long n = PyLong_AsUnsignedLong(arg);
+    if (n == (unsigned long)-1 && PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (n > (1UL << 24))
+    {
+        n = 1UL << 24;
+    }
+    switch ((int)iter->type)
+    {
+    case BTREE_ID_extents:
+        nr_columns = 7;
+        sizes[0] = sizes[1] = sizes[2] = sizes[3] = n * sizeof(uint64_t);
+        sizes[4] = n * sizeof(uint8_t);
+        sizes[5] = (n + 1) * sizeof(uint32_t);
+        // Most extents are not inline, leave room for at least one which is
+        sizes[6] = n * 64 + BCACHEFS_INLINE_DATA_MAX;
+        break;
+    case BTREE_ID_inodes:
+        nr_columns = 2;
+        sizes[0] = sizes[1] = n * sizeof(uint64_t);
+        break;
+    case BTREE_ID_dirents:
+        nr_columns = 5;
+        sizes[0] = sizes[1] = n * sizeof(uint64_t);
+        sizes[2] = n * sizeof(uint8_t);
+        sizes[3] = (n + 1) * sizeof(uint32_t);
+        // Room for 64 bytes per name on average and for at least one name
+        sizes[4] = n * 64 + 255;
+        break;
+    default:
+        PyErr_SetString(PyExc_RuntimeError, "Batches are not supported on this btree");
+        return NULL;
+    }
+    for (int i = 0; i < nr_columns; ++i)
+    {
+        columns[i] = PyBytes_FromStringAndSize(NULL, sizes[i]);
+        if (columns[i] == NULL)
+        {
+            goto error;
+        }
+    }
+
+#define COLUMN(i, type) ((type*)(void*)PyBytes_AS_STRING(columns[i]))
+    switch ((int)iter->type)
+    {
+    case BTREE_ID_extents:
+    {
+        const Bcachefs_extent_batch batch = {.inode = COLUMN(0, uint64_t),
+                                             .file_offset = COLUMN(1, uint64_t),
+                                             .offset = COLUMN(2, uint64_t),
+                                             .size = COLUMN(3, uint64_t),
+                                             .compression_type = COLUMN(4, uint8_t),
+                                             .inline_offset = COLUMN(5, uint32_t),
+                                             .inline_data = COLUMN(6, uint8_t),
+                                             .inline_data_size = (uint32_t)sizes[6]};
+        count = Bcachefs_iter_next_batch_extents(fs, iter, n, &batch);
+        sizes[0] = sizes[1] = sizes[2] = sizes[3] = count * sizeof(uint64_t);
+        sizes[4] = count * sizeof(uint8_t);
+        sizes[5] = (count + 1) * sizeof(uint32_t);
+        sizes[6] = batch.inline_offset[count];
+        break;
+    }
+    case BTREE_ID_inodes:
+    {
+        const Bcachefs_inode_batch batch = {.inode = COLUMN(0, uint64_t),
+                                            .size = COLUMN(1, uint64_t)};
+        count = Bcachefs_iter_next_batch_inodes(fs, iter, n, &batch);
+        sizes[0] = sizes[1] = count * sizeof(uint64_t);
+        break;
+    }
+    case BTREE_ID_dirents:
+    {
+        const Bcachefs_dirent_batch batch = {.parent_inode = COLUMN(0, uint64_t),
+                                             .inode = COLUMN(1, uint64_t),
+                                             .type = COLUMN(2, uint8_t),
+                                             .name_offset = COLUMN(3, uint32_t),
+                                             .names = COLUMN(4, uint8_t),
+                                             .names_size = (uint32_t)sizes[4]};
+        count = Bcachefs_iter_next_batch_dirents(fs, iter, n, &batch);
+        sizes[0] = sizes[1] = count * sizeof(uint64_t);
+        sizes[2] = count * sizeof(uint8_t);
+        sizes[3] = (count + 1) * sizeof(uint32_t);
+        sizes[4] = batch.name_offset[count];
+        break;
+    }
+    }
+#undef COLUMN
+
+    PyObject *ret = PyTuple_New(nr_columns);
+    if (ret == NULL)
+    {
+        goto error;
+    }
+    for (int i = 0; i < nr_columns; ++i)
+    {
+        if (_PyBytes_Resize(&columns[i], sizes[i]) < 0)
+        {
+            Py_DECREF(ret);
+            goto error;
+        }
+        PyTuple_SET_ITEM(ret, i, columns[i]);
+        columns[i] = NULL;
+    }
+    return ret;
+
+error:
+    for (int i = 0; i < nr_columns; ++i)
+    {
+        Py_XDECREF(columns[i]);
+    }
+    return NULL;
+}
+
 /**
  * Table of methods.
  */
 
 static PyMethodDef PyBcachefs_iterator_methods[] = {
     {"next", (PyCFunction)PyBcachefs_iterator_next, METH_NOARGS, "Iterate to next item"},
+    {"seek", (PyCFunction)PyBcachefs_iterator_seek, METH_VARARGS,
+     "Restrict the iteration to the keys in [(inode, offset), (inode, offset)]"},
+    {"next_batch", (PyCFunction)PyBcachefs_iterator_next_batch, METH_O,
+     "Decode up to n items into a tuple of bytes columns"},
+    {"ptrs", (PyCFunction)PyBcachefs_iterator_ptrs, METH_NOARGS,
+     "List the pointers of the current extent as (dev, offset, gen, cached, stripe)"},
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -261,12 +1777,305 @@ static PyTypeObject PyBcachefs_iteratorType = {
     PyBcachefs_iterator_new,         /* tp_new */
 };
 
+/**
+ * @brief Slot tp_dealloc, closes the image if it was closed while the file
+ * pointed in it
+ */
+
+static void PyBcachefs_file_dealloc(PyBcachefs_file* self)
+{
+    PyBcachefs *pyfs = self->_pyfs;
+    if (self->_map && --pyfs->_exports == 0 && pyfs->_close_pending)
+    {
+        _PyBcachefs_close(pyfs);
+    }
+    Bcachefs_read_plan_free(&self->_plan);
+    PyMem_Free(self->_data);
+    Py_XDECREF((PyObject*)pyfs);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * @brief Slot tp_new
+ */
+
+static PyObject* PyBcachefs_file_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    (void)args;
+    (void)kwargs;
+    return type->tp_alloc(type, 0);
+}
+
+/**
+ * @brief Copy the content of the file in `buffer` of at least the size of the
+ * file, reading it from the image unless it is mapped or was already read
+ */
+
+static int _PyBcachefs_file_fill(PyBcachefs_file *self, uint8_t *buffer)
+{
+    const Bcachefs *fs = &self->_pyfs->_fs;
+    Bcachefs_read_plan *plan = &self->_plan;
+    const uint8_t *content = self->_map ? self->_map : self->_data;
+    int read = 0;
+    if (content)
+    {
+        memcpy(buffer, content, plan->arena_size);
+        return 1;
+    }
+    if (fs->sb == NULL || self->_pyfs->_close_pending)
+    {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed Bcachefs image");
+        return 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    read = Bcachefs_read_plan_exec(fs, plan, buffer, 0);
+    Py_END_ALLOW_THREADS
+    if (plan->nr_csum_errors)
+    {
+        PyErr_Format(PyExc_IOError, "Checksum mismatch in %u extents", plan->nr_csum_errors);
+        return 0;
+    }
+    if (plan->nr_decode_errors)
+    {
+        PyErr_Format(PyExc_IOError, "Could not decompress %u extents", plan->nr_decode_errors);
+        return 0;
+    }
+    if (!read)
+    {
+        PyErr_SetString(PyExc_IOError, "Could not read file");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Slot bf_getbuffer, read-only view of the content of the file. Files
+ * whose extents are contiguous in a mapped image are viewed in place, the
+ * others are read once into a buffer of the file
+ */
+
+static int PyBcachefs_file_getbuffer(PyBcachefs_file *self, Py_buffer *view, int flags)
+{
+    const uint64_t size = self->_plan.arena_size;
+    if (self->_map == NULL && self->_data == NULL)
+    {
+        uint8_t *data = PyMem_Malloc(size ? size : 1);
+        if (data == NULL)
+        {
+            PyErr_NoMemory();
+            view->obj = NULL;
+            return -1;
+        }
+        if (!_PyBcachefs_file_fill(self, data))
+        {
+            PyMem_Free(data);
+            view->obj = NULL;
+            return -1;
+        }
+        self->_data = data;
+    }
+    void *buf = (void*)(self->_map ? self->_map : self->_data);
+    return PyBuffer_FillInfo(view, (PyObject*)self, buf, (Py_ssize_t)size, 1, flags);
+}
+
+/**
+ * @brief Read the whole file in a writable buffer at least as large as the
+ * file, returns the size of the file
+ */
+
+static PyObject *PyBcachefs_file_readinto(PyBcachefs_file *self, PyObject *arg)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_WRITABLE) < 0)
+    {
+        return NULL;
+    }
+    PyObject *ret = NULL;
+    if ((uint64_t)view.len < self->_plan.arena_size)
+    {
+        PyErr_Format(PyExc_ValueError, "Buffer of %zd bytes is smaller than the file", view.len);
+    }
+    else if (_PyBcachefs_file_fill(self, view.buf))
+    {
+        ret = PyLong_FromUnsignedLongLong(self->_plan.arena_size);
+    }
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+/**
+ * @brief Read the whole file in new bytes
+ */
+
+static PyObject *PyBcachefs_file_read(PyBcachefs_file *self)
+{
+    PyObject *bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)self->_plan.arena_size);
+    if (bytes && !_PyBcachefs_file_fill(self, (uint8_t*)PyBytes_AS_STRING(bytes)))
+    {
+        Py_CLEAR(bytes);
+    }
+    return bytes;
+}
+
+/**
+ * @brief Getter for the size of the file
+ */
+
+static PyObject* PyBcachefs_file_getsize(PyBcachefs_file* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLongLong(self->_plan.arena_size);
+}
+
+/**
+ * @brief Getter for whether the buffers of the file point in the image
+ */
+
+static PyObject* PyBcachefs_file_getmapped(PyBcachefs_file* self, void* closure)
+{
+    (void)closure;
+    return PyBool_FromLong(self->_map != NULL);
+}
+
+/**
+ * Table of methods.
+ */
+
+static PyMethodDef PyBcachefs_file_methods[] = {
+    {"read", (PyCFunction)PyBcachefs_file_read, METH_NOARGS, "Read the whole file in bytes"},
+    {"readinto", (PyCFunction)PyBcachefs_file_readinto, METH_O,
+     "Read the whole file in a buffer at least as large as the file"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+/**
+ * Table of getter-setters.
+ */
+
+static PyGetSetDef PyBcachefs_file_getsetters[] = {
+    {"size", (getter)PyBcachefs_file_getsize, 0, "Size of the file", NULL},
+    {"mapped", (getter)PyBcachefs_file_getmapped, 0,
+     "Whether the buffers of the file point in the image mapping", NULL},
+    {NULL, NULL, 0, NULL, NULL}  /* Sentinel */
+};
+
+static PyBufferProcs PyBcachefs_file_as_buffer = {
+    (getbufferproc)PyBcachefs_file_getbuffer,        /* bf_getbuffer */
+    0,                                             /* bf_releasebuffer */
+};
+
+static PyTypeObject PyBcachefs_fileType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "benzina.c_bcachefs.Bcachefs_file",   /* tp_name */
+    sizeof(PyBcachefs_file),         /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)PyBcachefs_file_dealloc,  /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash  */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    &PyBcachefs_file_as_buffer,      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Bcachefs_file object",          /* tp_doc */
+    0,                               /* tp_traverse */
+    0,                               /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    PyBcachefs_file_methods,         /* tp_methods */
+    0,                               /* tp_members */
+    PyBcachefs_file_getsetters,      /* tp_getset */
+    0,                               /* tp_base */
+    0,                               /* tp_dict */
+    0,                               /* tp_descr_get */
+    0,                               /* tp_descr_set */
+    0,                               /* tp_dictoffset */
+    0,                               /* tp_init */
+    0,                               /* tp_alloc */
+    PyBcachefs_file_new,             /* tp_new */
+};
+
+/**
+ * @brief Checksum of `data` as bcachefs computes it for the extents of
+ * `csum_type`. The encrypted checksum types are not supported
+ */
+
+static PyObject *c_bcachefs_checksum(PyObject *module, PyObject *args)
+{
+    unsigned char csum_type = 0;
+    Py_buffer view;
+    struct bch_csum csum;
+    if (!PyArg_ParseTuple(args, "by*", &csum_type, &view))
+    {
+        return NULL;
+    }
+    const int ret = benz_bch_checksum(csum_type, view.buf, (uint64_t)view.len, &csum);
+    PyBuffer_Release(&view);
+    if (!ret)
+    {
+        PyErr_Format(PyExc_ValueError, "Unsupported checksum type %u", csum_type);
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(csum.lo);
+}
+
+/**
+ * @brief Decompresses the data of an extent of `compression_type`, padding
+ * included, into `size` bytes like the batched reads do. Raises IOError if
+ * the data does not decompress to exactly `size` bytes
+ */
+
+static PyObject *c_bcachefs_decompress(PyObject *module, PyObject *args)
+{
+    unsigned char compression_type = 0;
+    unsigned long long size = 0;
+    Py_buffer view;
+    if (!PyArg_ParseTuple(args, "by*K", &compression_type, &view, &size))
+    {
+        return NULL;
+    }
+    PyObject *ret = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+    int decompressed = 0;
+    if (ret)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        decompressed = benz_bch_decompress(compression_type, view.buf, (uint64_t)view.len,
+                                           (uint8_t*)PyBytes_AS_STRING(ret), size);
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&view);
+    if (ret && !decompressed)
+    {
+        Py_CLEAR(ret);
+        PyErr_Format(PyExc_IOError, "Could not decompress extent of compression type %u", compression_type);
+    }
+    return ret;
+}
+
+static PyMethodDef c_bcachefs_methods[] = {
+    {"checksum", (PyCFunction)c_bcachefs_checksum, METH_VARARGS,
+     "Checksum of data as bcachefs computes it for a checksum type"},
+    {"decompress", (PyCFunction)c_bcachefs_decompress, METH_VARARGS,
+     "Decompress the data of an extent of a compression type into size bytes"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
 static PyModuleDef c_bcachefs_module_def = {
     PyModuleDef_HEAD_INIT,
     "c_bcachefs",          /* m_name */
     "bcachefs C module",   /* m_doc */
     -1,                    /* m_size */
-    NULL,                  /* m_methods */
+    c_bcachefs_methods,    /* m_methods */
     NULL,                  /* m_reload */
     NULL,                  /* m_traverse */
     NULL,                  /* m_clear */
@@ -291,7 +2100,35 @@ PyMODINIT_FUNC PyInit_c_bcachefs(void)
         }while(0)
     ADDTYPE(PyBcachefs);
     ADDTYPE(PyBcachefs_iterator);
+    ADDTYPE(PyBcachefs_file);
     #undef ADDTYPE
 
+    // Compression types the decompressor was built with
+    static const uint8_t codecs[] = {
+        BCH_COMPRESSION_TYPE_none,
+        BCH_COMPRESSION_TYPE_incompressible,
+#ifdef BENZ_HAVE_ZLIB
+        BCH_COMPRESSION_TYPE_gzip,
+#endif
+#ifdef BENZ_HAVE_ZSTD
+        BCH_COMPRESSION_TYPE_zstd,
+#endif
+#ifdef BENZ_HAVE_LZ4
+        BCH_COMPRESSION_TYPE_lz4_old,
+        BCH_COMPRESSION_TYPE_lz4,
+#endif
+    };
+    PyObject *types = PyTuple_New(sizeof(codecs));
+    for (Py_ssize_t i = 0; types && i < (Py_ssize_t)sizeof(codecs); ++i)
+    {
+        PyTuple_SET_ITEM(types, i, PyLong_FromLong(codecs[i]));
+    }
+    if (types == NULL || PyModule_AddObject(module, "CODECS", types) < 0)
+    {
+        Py_XDECREF(types);
+        Py_DECREF(module);
+        return NULL;
+    }
+
     return module;
 }
@@ -14,9 +14,22 @@
 typedef struct {
     PyObject_HEAD
     Bcachefs _fs;
+    Bcachefs_index _index;
+    Py_buffer _memory;      /* image opened with open_memory, obj is NULL otherwise */
+    Py_ssize_t _exports;    /* files pointing in place in the mapped image */
+    int _close_pending;     /* closed while files pointed in the image, done with the last one */
 } PyBcachefs;
 static PyTypeObject PyBcachefsType;
 
+typedef struct {
+    PyObject_HEAD
+    PyBcachefs *_pyfs;
+    Bcachefs_read_plan _plan;
+    const uint8_t *_map;    /* content of the file in the image, NULL if it has to be read */
+    uint8_t *_data;         /* content read for the buffers of files which are not mapped */
+} PyBcachefs_file;
+static PyTypeObject PyBcachefs_fileType;
+
 typedef struct {
     PyObject_HEAD
     PyBcachefs *_pyfs;
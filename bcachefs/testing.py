@@ -1,4 +1,8 @@
+import itertools
 import os
+import random
+import struct
+import zlib
 
 this = os.path.dirname(os.path.abspath(__file__))
 project_root = os.path.abspath(os.path.join(this, ".."))
@@ -6,3 +10,355 @@ project_root = os.path.abspath(os.path.join(this, ".."))
 
 def filepath(path):
     return os.path.join(project_root, path)
+
+
+# Synthetic images
+# ----------------
+#
+# make_image() writes a small filesystem holding the files of a directory
+# with the features the committed images lack: checksummed and compressed
+# extents, reflinked files and filesystems spread over two members. The
+# layout is the one of bcachefs, reduced to what the reader consults.
+
+SECTOR = 512
+BLOCK_SECTORS = 8
+BLOCK = BLOCK_SECTORS * SECTOR
+NODE_SECTORS = 32
+NODE_SIZE = NODE_SECTORS * SECTOR
+
+_U64_MAX = (1 << 64) - 1
+_U32_MAX = (1 << 32) - 1
+
+_KEY_TYPE_INODE = 8
+_KEY_TYPE_DIRENT = 10
+_KEY_TYPE_EXTENT = 6
+_KEY_TYPE_REFLINK_P = 15
+_KEY_TYPE_REFLINK_V = 16
+_KEY_TYPE_INLINE_DATA = 17
+_KEY_TYPE_BTREE_PTR_V2 = 18
+_KEY_TYPE_INDIRECT_INLINE_DATA = 19
+
+_BTREE_ID_EXTENTS = 0
+_BTREE_ID_INODES = 1
+_BTREE_ID_DIRENTS = 2
+_BTREE_ID_REFLINK = 7
+
+_CSUM_TYPES = {None: 0, "crc32c": 1}
+_COMPRESSION_TYPES = {None: 0, "gzip": 2}
+
+_BCACHE_MAGIC = bytes.fromhex("c68573f64e1a45ca8265f57f48ba6d81")
+_FS_UUID = bytes(range(16))
+MEMBER_UUIDS = (bytes([0xA0] * 16), bytes([0xA1] * 16))
+
+# Small files are stored inline in the btree
+_INLINE_MAX = 64
+
+
+def _crc32c_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+
+_CRC32C_TABLE = _crc32c_table()
+
+
+def crc32c(data, crc=_U32_MAX):
+    """Castagnoli crc of `data` with the pre and post inversion of the
+    crc32c_nonzero checksums"""
+    for byte in data:
+        crc = _CRC32C_TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8)
+    return crc ^ _U32_MAX
+
+
+def _rotl(x, b):
+    return ((x << b) | (x >> (64 - b))) & _U64_MAX
+
+
+def _siphash24(k0, k1, data):
+    v = [k0 ^ 0x736F6D6570736575, k1 ^ 0x646F72616E646F6D, k0 ^ 0x6C7967656E657261, k1 ^ 0x7465646279746573]
+
+    def rounds(n):
+        for _ in range(n):
+            v[0] = (v[0] + v[1]) & _U64_MAX
+            v[1] = _rotl(v[1], 13) ^ v[0]
+            v[0] = _rotl(v[0], 32)
+            v[2] = (v[2] + v[3]) & _U64_MAX
+            v[3] = _rotl(v[3], 16) ^ v[2]
+            v[0] = (v[0] + v[3]) & _U64_MAX
+            v[3] = _rotl(v[3], 21) ^ v[0]
+            v[2] = (v[2] + v[1]) & _U64_MAX
+            v[1] = _rotl(v[1], 17) ^ v[2]
+            v[2] = _rotl(v[2], 32)
+
+    end = len(data) // 8 * 8
+    words = [struct.unpack_from("<Q", data, i)[0] for i in range(0, end, 8)]
+    words.append(int.from_bytes(data[end:].ljust(8, b"\0"), "little") | (len(data) & 0xFF) << 56)
+    for m in words:
+        v[3] ^= m
+        rounds(2)
+        v[0] ^= m
+    v[2] ^= 0xFF
+    rounds(4)
+    return v[0] ^ v[1] ^ v[2] ^ v[3]
+
+
+def _dirent_hash(seed, name):
+    return max(_siphash24(seed, 0, name.encode()) >> 1, 2)
+
+
+def _pad8(data):
+    return data + b"\0" * (-len(data) % 8)
+
+
+def _bpos(inode, offset, snapshot=0):
+    return struct.pack("<IQQ", snapshot, offset, inode)
+
+
+def _bkey(ktype, inode, offset, val, size=0):
+    # Unpacked key: u64s, format, type, pad, version, size and position
+    u64s = 5 + len(val) // 8
+    return struct.pack("<BBBBIQI", u64s, 1, ktype, 0, 0, 0, size) + _bpos(inode, offset) + val
+
+
+def _extent_ptr(sector, dev=0):
+    return struct.pack("<Q", 1 | sector << 4 | dev << 48)
+
+
+def _crc32_entry(compressed_sectors, sectors, csum, csum_type, compression_type, offset=0):
+    bits = (0b10 | (compressed_sectors - 1) << 2 | (sectors - 1) << 9 | offset << 16 |
+            csum_type << 24 | compression_type << 28)
+    return struct.pack("<II", bits, csum)
+
+
+def _varint(value):
+    nbytes = (max(value | 1, 1).bit_length() + 6) // 7
+    value = value << nbytes | ((1 << (nbytes - 1)) - 1)
+    return value.to_bytes(8, "little")[:nbytes]
+
+
+def _inode_val(seed, mode, size):
+    # Packed inode with the siphash string hash and 5 fields, bi_size last
+    flags = 5 << 24 | 1 << 31 | 3 << 20
+    return _pad8(struct.pack("<QIH", seed, flags, mode) + b"".join(_varint(0) for _ in range(8)) + _varint(size))
+
+
+# Format of the nodes of the inodes btree, whose keys are packed
+_FORMAT_SHORT = struct.pack("<BB6B6Q", 3, 6, 64, 64, 32, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+
+
+def _inode_key(inode, val):
+    return struct.pack("<BBBB", 3 + len(val) // 8, 0, _KEY_TYPE_INODE, 0) + _bpos(0, inode) + val
+
+
+def _btree_node(magic, min_key, max_key, keys, level=0):
+    header = struct.pack("<16sQQ", bytes(16), magic, level) + min_key + max_key + bytes(8) + _FORMAT_SHORT
+    data = b"".join(keys)
+    node = header + struct.pack("<QQIHH", 1, 1, 0, 0, len(data) // 8) + data
+    node += b"\0" * (-len(node) % BLOCK)
+    assert len(node) <= NODE_SIZE, "too many keys for a single node"
+    return node
+
+
+class _Device:
+    def __init__(self):
+        self.data = bytearray(64 * 1024)
+
+    def alloc(self, size, align=SECTOR):
+        self.data += b"\0" * (-len(self.data) % align)
+        offset = len(self.data)
+        self.data += b"\0" * size
+        return offset
+
+    def write(self, data, align=SECTOR):
+        offset = self.alloc(len(data) + (-len(data) % SECTOR), align)
+        self.data[offset : offset + len(data)] = data
+        return offset
+
+
+class SyntheticImage:
+    """Locations of what make_image() wrote, as (dev, offset, size) in bytes"""
+
+    def __init__(self):
+        self.files = {}
+        self.nodes = []
+        self.extents = []
+
+
+def make_image(
+    path,
+    content=None,
+    members=None,
+    csum=None,
+    compression=None,
+    reflink=False,
+    extent_sectors=16,
+    split=False,
+):
+    """Writes a filesystem holding the files of the `content` directory
+
+    `csum` is None or "crc32c" and `compression` None or "gzip". With
+    `reflink`, the data of the files lives in indirect extents and the
+    largest file is cloned to "/copy". With `members`, the path of a second
+    member image, btree nodes are written on both members and data extents
+    alternate between member 1, member 0 and both. With `split`, the data
+    extents of the files are referenced by two keys each, as left by a
+    partial overwrite.
+    """
+    content = content or filepath("testdata/mini_content")
+    rnd = random.Random(1234)
+    devices = [_Device(), _Device()] if members else [_Device()]
+    image = SyntheticImage()
+    magic = struct.unpack("<Q", _FS_UUID[:8])[0] ^ 0x90135C78B99E07F5
+
+    # Namespace
+    root, lost_found = 4096, 4097
+    inodes = {root: (0o40755, 0, 0x1234), lost_found: (0o40755, 0, 0x77)}
+    dirents = [(root, "lost+found", lost_found, 4)]
+    directories = {"": root}
+    files = {}
+    for dirpath, dirnames, filenames in sorted(os.walk(content)):
+        dirnames.sort()
+        rel = os.path.relpath(dirpath, content)
+        rel = "" if rel == "." else rel
+        for name in dirnames:
+            inode = len(inodes) + 4096
+            inodes[inode] = (0o40755, 0, rnd.getrandbits(64))
+            dirents.append((directories[rel], name, inode, 4))
+            directories[os.path.join(rel, name)] = inode
+        for name in sorted(filenames):
+            with open(os.path.join(dirpath, name), "rb") as f:
+                data = f.read()
+            inode = len(inodes) + 4096
+            inodes[inode] = (0o100644, len(data), 0)
+            dirents.append((directories[rel], name, inode, 8))
+            files[inode] = data
+            image.files["/" + os.path.join(rel, name)] = data
+    clones = {}
+    if reflink:
+        source = max(files, key=lambda inode: len(files[inode]))
+        inode = len(inodes) + 4096
+        inodes[inode] = inodes[source]
+        dirents.append((root, "copy", inode, 8))
+        clones[inode] = source
+        image.files["/copy"] = files[source]
+
+    # Data, either extents of the files or indirect extents
+    def write_extent(data, sectors, offsets=(0,)):
+        entries = [b""] * len(offsets)
+        compressed = data
+        if compression == "gzip":
+            codec = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+            compressed = codec.compress(data) + codec.flush()
+        compressed = compressed.ljust(-(-len(compressed) // SECTOR) * SECTOR, b"\0")
+        on = [(1,), (0,), (1, 0)][next(nth) % 3] if members else (0,)
+        ptrs = b""
+        for dev in on:
+            offset = devices[dev].write(compressed)
+            image.extents.append((dev, offset, len(compressed)))
+            ptrs += _extent_ptr(offset // SECTOR, dev)
+        if csum or compression or len(offsets) > 1:
+            checksum = crc32c(compressed) if csum else 0
+            entries = [_crc32_entry(len(compressed) // SECTOR, sectors, checksum, _CSUM_TYPES[csum],
+                                    _COMPRESSION_TYPES[compression], offset) for offset in offsets]
+        return [entry + ptrs for entry in entries]
+
+    nth = itertools.count()
+    extent_keys = []
+    reflink_keys = []
+    indirect = {}
+    for inode, data in sorted(files.items()):
+        sectors = -(-len(data) // SECTOR)
+        if reflink:
+            start = sum(n for _, n in indirect.values())
+            indirect[inode] = (start, sectors)
+            if len(data) < _INLINE_MAX:
+                val = _pad8(struct.pack("<Q", 1) + data)
+                reflink_keys.append(_bkey(_KEY_TYPE_INDIRECT_INLINE_DATA, 0, start + sectors, val, sectors))
+                continue
+            for first in range(0, sectors, extent_sectors):
+                n = min(extent_sectors, sectors - first)
+                chunk = data[first * SECTOR : (first + n) * SECTOR].ljust(n * SECTOR, b"\0")
+                val = struct.pack("<Q", 1) + write_extent(chunk, n)[0]
+                reflink_keys.append(_bkey(_KEY_TYPE_REFLINK_V, 0, start + first + n, val, n))
+        elif len(data) < _INLINE_MAX:
+            extent_keys.append(((inode, sectors), _bkey(_KEY_TYPE_INLINE_DATA, inode, sectors, _pad8(data), sectors)))
+        else:
+            for first in range(0, sectors, extent_sectors):
+                n = min(extent_sectors, sectors - first)
+                chunk = data[first * SECTOR : (first + n) * SECTOR].ljust(n * SECTOR, b"\0")
+                pieces = [(0, n // 2), (n // 2, n - n // 2)] if split and n > 1 else [(0, n)]
+                vals = write_extent(chunk, n, [start for start, _ in pieces])
+                for (start, m), val in zip(pieces, vals):
+                    key = _bkey(_KEY_TYPE_EXTENT, inode, first + start + m, val, m)
+                    extent_keys.append(((inode, first + start + m), key))
+    if reflink:
+        for inode in sorted(list(files) + list(clones)):
+            start, sectors = indirect[clones.get(inode, inode)]
+            key = _bkey(_KEY_TYPE_REFLINK_P, inode, sectors, struct.pack("<QII", start, 0, 0), sectors)
+            extent_keys.append(((inode, sectors), key))
+    extent_keys.sort()
+
+    # Btrees, every node is written on every member, member 1 first
+    def write_node(min_key, max_key, keys, level=0, seq=1):
+        node = _btree_node(magic, min_key, max_key, keys, level)
+        ptrs = b""
+        for dev in reversed(range(len(devices))):
+            offset = devices[dev].write(node, NODE_SIZE)
+            image.nodes.append((dev, offset, len(node)))
+            ptrs += _extent_ptr(offset // SECTOR, dev)
+        return struct.pack("<QQHH", 0, seq, len(node) // SECTOR, 0) + min_key + ptrs
+
+    full = _bpos(_U64_MAX, _U64_MAX, _U32_MAX)
+    roots = {}
+    # The extents btree has two leaves under an interior root
+    half = len(extent_keys) // 2
+    split = extent_keys[half - 1][0]
+    leaves = [
+        (_bpos(0, 0), _bpos(*split), extent_keys[:half]),
+        (_bpos(split[0], split[1] + 1), full, extent_keys[half:]),
+    ]
+    children = []
+    for seq, (min_key, max_key, keys) in enumerate(leaves, 10):
+        val = write_node(min_key, max_key, [key for _, key in keys], seq=seq)
+        max_pos = split if max_key != full else (_U64_MAX, _U64_MAX)
+        children.append(_bkey(_KEY_TYPE_BTREE_PTR_V2, *max_pos, val))
+    roots[_BTREE_ID_EXTENTS] = (1, write_node(_bpos(0, 0), full, children, level=1, seq=99))
+    if reflink:
+        roots[_BTREE_ID_REFLINK] = (0, write_node(_bpos(0, 0), full, reflink_keys, seq=77))
+    inode_keys = [_inode_key(inode, _inode_val(seed, mode, size)) for inode, (mode, size, seed) in sorted(inodes.items())]
+    roots[_BTREE_ID_INODES] = (0, write_node(_bpos(0, 0), full, inode_keys))
+    dirent_keys = []
+    for parent, name, inode, dtype in dirents:
+        offset = _dirent_hash(inodes[parent][2], name)
+        val = _pad8(struct.pack("<QB", inode, dtype) + name.encode())
+        dirent_keys.append(((parent, offset), _bkey(_KEY_TYPE_DIRENT, parent, offset, val)))
+    roots[_BTREE_ID_DIRENTS] = (0, write_node(_bpos(0, 0), full, [key for _, key in sorted(dirent_keys)]))
+
+    # Superblock with the btree roots in the clean field
+    entries = b""
+    for btree_id, (level, val) in sorted(roots.items()):
+        key = _bkey(_KEY_TYPE_BTREE_PTR_V2, _U64_MAX, _U64_MAX, val)
+        entries += struct.pack("<HBBB3s", len(key) // 8, btree_id, level, 1, bytes(3)) + key
+    clean = struct.pack("<IIIHHQ", (24 + len(entries)) // 8, 6, 0, 0, 0, 0) + entries
+    slots = b"".join(uuid + bytes(40) for uuid in MEMBER_UUIDS[: len(devices)])
+    members_field = struct.pack("<II", (8 + len(slots)) // 8, 1) + slots
+    filler = struct.pack("<II", (8 + 1024) // 8, 5) + bytes(1024)
+    fields = clean + members_field + filler
+    for dev, device in enumerate(devices):
+        sb = struct.pack(
+            "<16sHH4s16s16s16s32sQQHBBI", bytes(16), 14, 14, bytes(4), _BCACHE_MAGIC, _FS_UUID, _FS_UUID,
+            b"synthetic".ljust(32, b"\0"), 8, 42, BLOCK_SECTORS, dev, len(devices), len(fields) // 8,
+        )
+        sb += struct.pack("<QII", 0, 0, 1) + struct.pack("<8Q", NODE_SECTORS << 12, 0, 0, 0, 0, 0, 0, 0)
+        sb += bytes(32 + 512) + fields
+        device.data[4096 : 4096 + len(sb)] = sb
+
+    for dev, out in enumerate([path, members][: len(devices)]):
+        with open(out, "wb") as f:
+            f.write(devices[dev].data)
+    return image
@@ -1,8 +1,14 @@
 # setup.py
 from setuptools import Extension, find_packages, setup
+from distutils.ccompiler import new_compiler
+from distutils.errors import CompileError, LinkError
+from distutils.sysconfig import customize_compiler
+import os
 import sys
+import tempfile
 
-extra_compile_args = []
+extra_compile_args = ["-pthread"]
+extra_link_args = ["-pthread"]
 libraries = []
 
 # call python setup.py -coverage install to install with coverage enabled.
@@ -12,14 +18,54 @@ if "-coverage" in sys.argv:
     print("Compiling with coverage")
     sys.argv.remove("-coverage")
 
-    extra_compile_args = ["-coverage", "-g3", "-O0"]
+    extra_compile_args += ["-coverage", "-g3", "-O0"]
     libraries = ["gcov"]
 
+
+def have_library(header, library, function):
+    """Compiles and links a call of `function` from `header` against `library`
+    with the compiler and flags the extension is built with"""
+    compiler = new_compiler()
+    customize_compiler(compiler)
+    with tempfile.TemporaryDirectory() as tmp:
+        source = os.path.join(tmp, "probe.c")
+        with open(source, "w") as f:
+            f.write(f"#include <{header}>\nint main(void) {{ return (int)(long)&{function}; }}\n")
+        try:
+            objects = compiler.compile([source], output_dir=tmp)
+            compiler.link_executable(objects, os.path.join(tmp, "probe"), libraries=[library])
+        except (CompileError, LinkError):
+            return False
+    return True
+
+
+# Codecs of compressed extents are built in when their library is installed
+define_macros = []
+for header, library, function, macro in (
+    ("zlib.h", "z", "inflate", "BENZ_HAVE_ZLIB"),
+    ("zstd.h", "zstd", "ZSTD_decompress", "BENZ_HAVE_ZSTD"),
+    ("lz4.h", "lz4", "LZ4_decompress_safe", "BENZ_HAVE_LZ4"),
+):
+    if have_library(header, library, function):
+        define_macros.append((macro, None))
+        libraries.append(library)
+    else:
+        print(
+            f"warning: {header} or lib{library} not found, extents compressed "
+            f"with it will fail to read",
+            file=sys.stderr,
+        )
+
+# shm_open is in librt before glibc 2.34
+libraries.append("rt")
+
 bcachefs_module = Extension(
     name="bcachefs.c_bcachefs",
     sources=["bcachefs/bcachefs.c", "bcachefs/bcachefsmodule.c"],
     include_dirs=["bcachefs/"],
+    define_macros=define_macros,
     extra_compile_args=extra_compile_args,
+    extra_link_args=extra_link_args,
     libraries=libraries,
 )
 
@@ -1,11 +1,14 @@
 import os
+import pickle
+from concurrent.futures import ThreadPoolExecutor
 
+import numpy as np
 import pytest
 import multiprocessing as mp
 
 import bcachefs.bcachefs as bchfs
 from bcachefs import Bcachefs
-from bcachefs.testing import filepath
+from bcachefs.testing import MEMBER_UUIDS, SECTOR, crc32c, filepath, make_image
 
 
 MINI = "testdata/mini_bcachefs.img"
@@ -266,3 +269,1031 @@ def test_multiprocess(image):
             sizes = p.starmap(count_size, [(fs, n) for n in files])
 
     assert sum(sizes) > 1
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_mmap(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=False) as fs, Bcachefs(image, mmap=True) as mfs:
+        assert mfs.size == fs.size
+        assert mfs._extents_map == fs._extents_map
+        assert mfs._inode_map == fs._inode_map
+        assert mfs._inodes_tree == fs._inodes_tree
+        assert mfs.read_file("file1") == b"File content 1\n"
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_concurrent_reads(image):
+    from concurrent.futures import ThreadPoolExecutor
+
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        files = fs.namelist() * 8
+        expected = [fs.read_file(name) for name in files]
+
+        with ThreadPoolExecutor(4) as pool:
+            assert list(pool.map(fs.read_file, files)) == expected
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_node_cache(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=False) as fs:
+        stats = fs.cache_stats
+        assert stats["misses"] > 0
+        assert 0 < stats["size"] <= stats["capacity"]
+
+        # Re-scanning reuses the cached nodes
+        misses = stats["misses"]
+        assert len(list(bchfs.BcachefsIterExtent(fs._filesystem))) > 0
+        assert fs.cache_stats["misses"] == misses
+        assert fs.cache_stats["hits"] > stats["hits"]
+
+    with Bcachefs(image, mmap=False, cache_size=0) as fs:
+        assert fs.cache_stats["size"] == 0
+        assert fs.read_file("file1") == b"File content 1\n"
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [False, True])
+def test_readahead(image, mmap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=mmap) as fs:
+        expected = fs._extents_map
+
+    for readahead in (0, 1, 64):
+        with Bcachefs(image, mmap=mmap, readahead=readahead) as fs:
+            assert fs._extents_map == expected
+            assert list(bchfs.BcachefsIterExtent(fs._filesystem)) == [
+                e for extents in expected.values() for e in extents
+            ]
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("io_uring", [False, True])
+def test_pread_many(image, io_uring):
+    from bcachefs.c_bcachefs import PyBcachefs
+
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with open(image, "rb") as f:
+        data = f.read()
+
+    raw = PyBcachefs()
+    raw.open(image, False)
+    if io_uring:
+        # pread is used when io_uring is not available
+        raw.enable_io_uring(8)
+    requests = [(offset, bytearray(size)) for offset, size in
+                [(0, 4096), (4096, 100), (len(data) - 10, 10), (len(data) - 10, 20)] * 5]
+    assert raw.pread_many(requests) == [min(len(b), len(data) - o) for o, b in requests]
+    for offset, buffer in requests:
+        assert buffer[: len(data) - offset] == data[offset : offset + len(buffer)]
+
+    # children are prefetched in the node cache a window at a time
+    with Bcachefs(image) as fs:
+        expected = [e for extents in fs._extents_map.values() for e in extents]
+    raw.set_readahead(4)
+    assert list(bchfs.BcachefsIterExtent(raw)) == expected
+    raw.close()
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_io_uring_fork(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=False, io_uring=True) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = fs.read_many(names)[0].tobytes()
+
+        # The child reads with pread while the parent keeps using the ring
+        pid = os.fork()
+        if pid == 0:
+            ok = all(fs.read_many(names)[0].tobytes() == expected for _ in range(200))
+            os._exit(0 if ok else 1)
+        for _ in range(200):
+            assert fs.read_many(names)[0].tobytes() == expected
+        _, status = os.waitpid(pid, 0)
+        assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0
+        assert fs.read_many(names)[0].tobytes() == expected
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+@pytest.mark.parametrize("gap", [0, None])
+def test_read_many(image, mmap, gap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=mmap) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        names = names[::-1] + names[:1]
+        arena, offsets = fs.read_many(names, gap)
+        assert len(offsets) == len(names) + 1
+        for i, name in enumerate(names):
+            assert arena[offsets[i] : offsets[i + 1]] == fs.read_file(name)
+
+        # files are looked up by inode in the btrees
+        arena, offsets = pickle.loads(pickle.dumps(fs)).read_many([fs.find_dirent(names[0]).inode])
+        assert arena[offsets[0] : offsets[1]] == fs.read_file(names[0])
+        inode = fs.find_dirent(names[0]).inode
+
+    # a closed image does not reopen itself behind the caller's back
+    for closed in (fs, Bcachefs(image, mmap=mmap), Bcachefs(image, mmap=mmap).cd()):
+        with pytest.raises(ValueError, match="closed image"):
+            closed.read_many([inode])
+        assert closed._filesystem is None
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_verify(image, mmap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=mmap) as fs:
+        expected = {
+            name: fs.read_file(name)
+            for name in (os.path.join(root, f.name) for root, _, files in fs.walk() for f in files)
+        }
+
+    with Bcachefs(image, mmap=mmap, verify=True) as fs:
+        stats = fs.verify(threads=2)
+        assert stats["errors"] == 0 and stats["bad_extents"] == []
+        assert stats["verified"] + stats["skipped"] == stats["extents"]
+        assert stats["extents"] <= sum(len(extents) for extents in fs._extents_map.values())
+        for name, data in expected.items():
+            assert fs.read_file(name) == data
+            with fs.open(name) as f:
+                assert f.read() == data
+
+    for closed in (fs, Bcachefs(image, mmap=mmap)):
+        with pytest.raises(ValueError, match="closed image"):
+            closed.verify()
+        assert closed._filesystem is None
+
+
+def test_checksum():
+    from bcachefs.c_bcachefs import checksum
+
+    check = b"123456789"
+    # none, crc32c_nonzero, crc64_nonzero, crc32c, crc64 and xxhash
+    assert checksum(0, check) == 0
+    assert checksum(1, check) == 0xE3069283
+    assert checksum(2, check) == 0x62EC59E3F1A4F00A
+    assert checksum(5, check) == 0x58E3FA20
+    assert checksum(6, check) == 0x6C40DF5F0B497347
+    assert checksum(7, b"") == 0xEF46DB3751D8E999
+    assert checksum(7, b"abc") == 0x44BC2CF5AD770999
+    assert checksum(7, bytes(range(100))) == 0x6AC1E58032166597
+
+    # the hardware crc32c agrees with the table on long unaligned buffers
+    data = np.random.RandomState(0).bytes(4099)
+    assert checksum(1, memoryview(data)[3:]) == crc32c(data[3:])
+
+    # chacha20_poly1305 needs the filesystem key
+    for csum_type in (3, 4, 8):
+        with pytest.raises(ValueError):
+            checksum(csum_type, check)
+
+
+@pytest.mark.parametrize("mmap", [True, False])
+def test_verify_corrupted(tmp_path, mmap):
+    path = str(tmp_path / "csum.img")
+    image = make_image(path, csum="crc32c")
+
+    with Bcachefs(path, mmap=mmap, verify=True) as fs:
+        stats = fs.verify(threads=2)
+        assert stats["errors"] == 0 and stats["bad_extents"] == []
+        assert stats["verified"] == len(image.extents)
+        for name, data in image.files.items():
+            assert bytes(fs.read_file(name)) == data
+
+    # flip a byte of the first extent, which is the first one of its file
+    _, offset, size = image.extents[0]
+    with open(path, "r+b") as f:
+        f.seek(offset + size // 2)
+        byte = f.read(1)
+        f.seek(offset + size // 2)
+        f.write(bytes([byte[0] ^ 0xFF]))
+
+    with Bcachefs(path, mmap=mmap) as fs:
+        corrupted = [name for name in image.files if bytes(fs.read_file(name)) != image.files[name]]
+        assert len(corrupted) == 1
+        inode = fs.find_dirent(corrupted[0]).inode
+
+    with Bcachefs(path, mmap=mmap, verify=True) as fs:
+        stats = fs.verify(threads=2)
+        assert stats["errors"] == 1
+        assert stats["bad_extents"] == [(inode, 0)]
+        with pytest.raises(IOError):
+            fs.read_file(corrupted[0])
+        with pytest.raises(IOError):
+            fs.read_many(sorted(image.files))
+        for name in set(image.files) - set(corrupted):
+            assert bytes(fs.read_file(name)) == image.files[name]
+
+
+@pytest.mark.parametrize("compression", [None, "gzip"])
+@pytest.mark.parametrize("threads", [1, 4])
+def test_verify_split(tmp_path, compression, threads):
+    path = str(tmp_path / "split.img")
+    image = make_image(path, csum="crc32c", compression=compression, split=True)
+
+    with Bcachefs(path, verify=True) as fs:
+        for name, data in image.files.items():
+            assert bytes(fs.read_file(name)) == data
+        # every region is referenced by two keys but checked once
+        keys = sum(len(extents) for extents in fs._extents_map.values())
+        assert keys > len(image.extents)
+        stats = fs.verify(threads=threads)
+        assert stats["extents"] == stats["verified"] == len(image.extents)
+        assert stats["bytes"] == sum(size for _, _, size in image.extents)
+
+    _, offset, size = image.extents[0]
+    with open(path, "r+b") as f:
+        f.seek(offset)
+        byte = f.read(1)
+        f.seek(offset)
+        f.write(bytes([byte[0] ^ 0xFF]))
+
+    with Bcachefs(path, verify=True) as fs:
+        stats = fs.verify(threads=threads)
+        assert stats["errors"] == 1 and len(stats["bad_extents"]) == 1
+        assert stats["verified"] == len(image.extents) - 1
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("decode_threads", [1, 4])
+def test_compressed_extents(image, decode_threads):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+        compression_type = bchfs.BcachefsIterExtent.scan(fs._filesystem)[4]
+        assert compression_type.dtype == np.uint8
+        assert set(compression_type.tolist()) <= {0, 1, 2, 3, 4}
+
+    # compressed extents are decompressed by the pool of decode threads
+    with Bcachefs(image, mmap=False, decode_threads=decode_threads) as fs:
+        arena, offsets = fs.read_many(names, 0)
+        for i, data in enumerate(expected):
+            assert arena[offsets[i] : offsets[i + 1]] == data
+
+
+# Compressed extents as bcachefs writes them, padded to the end of their
+# last sector. The zstd frame is prefixed by its length and made of a raw and
+# an rle block, the lz4 block of a match between two runs of literals
+ZSTD_FRAME = bytes([0x28, 0xB5, 0x2F, 0xFD, 0x20, 16, 0x30, 0, 0]) + b"hello " + bytes([0x53, 0, 0]) + b"a"
+COMPRESSED = {
+    4: (len(ZSTD_FRAME).to_bytes(4, "little") + ZSTD_FRAME, b"hello " + b"a" * 10),
+    3: (bytes([0x8C]) + b"abcdefgh" + bytes([8, 0, 0x50]) + b"tail!", b"abcdefgh" * 3 + b"tail!"),
+}
+
+
+@pytest.mark.parametrize("compression_type", [0, 5, 2, 1, 3, 4])
+def test_decompress(compression_type):
+    import zlib
+    from bcachefs.c_bcachefs import CODECS, decompress
+
+    if compression_type not in CODECS:
+        pytest.skip("codec not built in")
+    data = np.random.RandomState(0).bytes(3000) * 4
+    if compression_type == 2:
+        codec = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+        compressed = codec.compress(data) + codec.flush()
+    elif compression_type in (1, 3, 4):
+        # lz4_old blocks are decoded like lz4 ones
+        compressed, data = COMPRESSED[max(compression_type, 3)]
+    else:
+        compressed = data
+    padded = compressed.ljust(-(-len(compressed) // 512) * 512, b"\0")
+    assert decompress(compression_type, padded, len(data)) == data
+
+    # truncated data, a corrupted header and a wrong size never decompress
+    with pytest.raises(IOError, match="Could not decompress"):
+        decompress(compression_type, padded[: len(compressed) // 2], len(data))
+    if compression_type in (0, 5):
+        return
+    # a reserved deflate block type, a bad zstd magic and an lz4 match
+    # reaching before the start of the output
+    corrupted = bytearray(padded)
+    corrupted[{2: 0, 4: 4}.get(compression_type, 9)] = 0xFF
+    with pytest.raises(IOError, match="Could not decompress"):
+        decompress(compression_type, bytes(corrupted), len(data))
+    # the zeros padding an lz4 block decode as empty sequences
+    if compression_type not in (1, 3):
+        with pytest.raises(IOError, match="Could not decompress"):
+            decompress(compression_type, padded, len(data) + 1)
+
+
+@pytest.mark.parametrize("mmap", [True, False])
+@pytest.mark.parametrize("decode_threads", [1, 4])
+def test_compressed_image(tmp_path, mmap, decode_threads):
+    from bcachefs.c_bcachefs import CODECS
+
+    if 2 not in CODECS:
+        pytest.skip("zlib not built in")
+    path = str(tmp_path / "gzip.img")
+    image = make_image(path, compression="gzip", csum="crc32c")
+    names = sorted(image.files)
+    expected = [image.files[name] for name in names]
+
+    with Bcachefs(path, mmap=mmap, decode_threads=decode_threads) as fs:
+        compression_type = bchfs.BcachefsIterExtent.scan(fs._filesystem)[4]
+        assert set(compression_type.tolist()) == {0, 2}
+        assert [bytes(fs.read_file(name)) for name in names] == expected
+        for name, data in zip(names, expected):
+            with fs.open(name) as f:
+                assert f.read() == data
+        arena, offsets = fs.read_many(names, 0)
+        assert [arena[offsets[i] : offsets[i + 1]] for i in range(len(names))] == expected
+        assert fs.verify()["errors"] == 0
+
+    # a corrupted extent fails to decompress
+    _, offset, size = image.extents[0]
+    with open(path, "r+b") as f:
+        f.seek(offset)
+        f.write(bytes(size // 2))
+    with Bcachefs(path, mmap=mmap, decode_threads=decode_threads) as fs:
+        with pytest.raises(IOError, match="Could not decompress"):
+            fs.read_many(names, 0)
+        failed = 0
+        for name in names:
+            try:
+                fs.read_file(name)
+            except IOError as error:
+                assert "Could not decompress" in str(error)
+                failed += 1
+        assert failed == 1
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize(
+    "read_policy",
+    [bchfs.READ_POLICY_FIRST, bchfs.READ_POLICY_LEAST_LOADED, bchfs.READ_POLICY_ROUND_ROBIN],
+)
+def test_read_policy(image, read_policy):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+
+        it = fs._filesystem.iter(bchfs.EXTENT_TYPE)
+        while it.next() is not None:
+            for dev, offset, gen, cached, stripe in it.ptrs():
+                assert isinstance(cached, bool) and isinstance(stripe, bool)
+
+    with Bcachefs(image, read_policy=read_policy) as fs:
+        arena, offsets = fs.read_many(names)
+        for i, data in enumerate(expected):
+            assert arena[offsets[i] : offsets[i + 1]] == data
+        assert [fs.read_file(name) for name in names] == expected
+
+    with pytest.raises(ValueError):
+        with Bcachefs(image, read_policy=3):
+            pass
+
+
+@pytest.mark.parametrize("mmap", [True, False])
+@pytest.mark.parametrize(
+    "read_policy",
+    [bchfs.READ_POLICY_FIRST, bchfs.READ_POLICY_LEAST_LOADED, bchfs.READ_POLICY_ROUND_ROBIN],
+)
+def test_read_policy_replicas(tmp_path, read_policy, mmap):
+    member0, member1 = str(tmp_path / "member0.img"), str(tmp_path / "member1.img")
+    image = make_image(member0, members=member1, extent_sectors=1)
+    names = sorted(image.files)
+
+    with Bcachefs(member0, devices=[member1], read_policy=read_policy, mmap=mmap) as fs:
+        arena, offsets = fs.read_many(names)
+        assert [arena[offsets[i] : offsets[i + 1]] for i in range(len(names))] == [image.files[n] for n in names]
+
+    # overwrite the data on member 0 to tell which replica each sector of
+    # the files was read from
+    data = bytearray(open(member0, "rb").read())
+    for dev, offset, size in image.extents:
+        if dev == 0:
+            data[offset : offset + size] = b"\xA5" * size
+    marked0 = str(tmp_path / "marked0.img")
+    open(marked0, "wb").write(data)
+
+    # a sector per extent, a third of which are on both members
+    sectors = sum(-(-len(content) // SECTOR) for content in image.files.values() if len(content) >= 64)
+    replicated = len(image.extents) - sectors
+    only0 = sum(dev == 0 for dev, _, _ in image.extents) - replicated
+    assert replicated > 0 and only0 > 0
+
+    with Bcachefs(marked0, devices=[member1], read_policy=read_policy, mmap=mmap) as fs:
+        arena, offsets = fs.read_many(names)
+        from0 = 0
+        for i, name in enumerate(names):
+            got, expected = arena[offsets[i] : offsets[i + 1]], image.files[name]
+            for o in range(0, len(expected), SECTOR):
+                from0 += got[o : o + SECTOR] != expected[o : o + SECTOR]
+
+    if read_policy == bchfs.READ_POLICY_FIRST:
+        # the first pointer of the replicated extents is on member 1
+        assert from0 == only0
+    else:
+        # the replicated extents are spread over both members
+        assert only0 < from0 < only0 + replicated
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_open_multi(image, mmap):
+    from bcachefs.c_bcachefs import PyBcachefs
+
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+        inodes = [fs.find_dirent(name).inode for name in names]
+
+    # a filesystem with a single member
+    raw = PyBcachefs()
+    raw.open_multi([image], mmap)
+    arena, offsets = raw.read_many(inodes)
+    offsets = np.frombuffer(offsets, dtype=np.uint64)
+    for i, data in enumerate(expected):
+        assert arena[offsets[i] : offsets[i + 1]] == data
+    raw.close()
+
+    # the same member can not be given twice
+    with pytest.raises(RuntimeError):
+        PyBcachefs().open_multi([image, image], mmap)
+
+
+@pytest.mark.parametrize("mmap", [True, False])
+def test_open_multi_members(tmp_path, mmap):
+    from bcachefs.c_bcachefs import PyBcachefs
+
+    member0, member1 = str(tmp_path / "member0.img"), str(tmp_path / "member1.img")
+    image = make_image(member0, members=member1)
+    names = sorted(image.files)
+    expected = [image.files[name] for name in names]
+
+    # members are given in any order, reads are routed by device and the
+    # reads of a batch are issued on each device concurrently
+    for paths in ([member0, member1], [member1, member0]):
+        for io_uring in (False, True):
+            with Bcachefs(paths[0], devices=paths[1:], mmap=mmap, io_uring=io_uring) as fs:
+                assert [bytes(fs.read_file(name)) for name in names] == expected
+                arena, offsets = fs.read_many(names)
+                assert [arena[offsets[i] : offsets[i + 1]] for i in range(len(names))] == expected
+
+    raw = PyBcachefs()
+    raw.open_multi([member0, member1], mmap)
+    buffers = [bytearray(size) for _, _, size in image.extents]
+    reads = [(offset, buffer, dev) for (dev, offset, _), buffer in zip(image.extents, buffers)]
+    assert raw.pread_many(reads) == [len(buffer) for buffer in buffers]
+    for (dev, offset, size), buffer in zip(image.extents, buffers):
+        with open([member0, member1][dev], "rb") as f:
+            f.seek(offset)
+            assert buffer == f.read(size)
+    raw.close()
+
+    # btree nodes are read from the first of their replicas which is present,
+    # the copies on member 0 are not used while member 1 is there
+    stale0 = tmp_path / "stale0.img"
+    data = bytearray((tmp_path / "member0.img").read_bytes())
+    for dev, offset, size in image.nodes:
+        if dev == 0:
+            data[offset : offset + size] = bytes(size)
+    stale0.write_bytes(data)
+    with Bcachefs(str(stale0), devices=[member1], mmap=mmap) as fs:
+        assert [bytes(fs.read_file(name)) for name in names] == expected
+
+    # without member 1, the nodes are read from member 0 and only the files
+    # with an extent on member 1 alone can not be read
+    with Bcachefs(member0, mmap=mmap) as fs:
+        assert sorted(os.path.join(root, f.name) for root, _, files in fs.walk() for f in files) == names
+        readable = 0
+        for name, data in zip(names, expected):
+            try:
+                assert bytes(fs.read_file(name)) == data
+                readable += 1
+            except IOError:
+                pass
+        assert 0 < readable < len(names)
+
+    def modified(path, name, old, new):
+        data = open(path, "rb").read()
+        assert old in data
+        (tmp_path / name).write_bytes(data.replace(old, new, 1))
+        return str(tmp_path / name)
+
+    # a member of another filesystem, a member whose slot does not match and
+    # a member given twice fail the open
+    fs_uuid = bytes(range(16))
+    foreign = modified(member1, "foreign.img", fs_uuid + fs_uuid, bytes(reversed(fs_uuid)) * 2)
+    slot = modified(member1, "slot.img", MEMBER_UUIDS[1], bytes([0xB1] * 16))
+    for paths in ([member0, foreign], [member0, slot], [member0, member1, member1], [member1, member1]):
+        with pytest.raises(RuntimeError):
+            PyBcachefs().open_multi(paths, mmap)
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_reflink_cache(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        hits, misses, size, capacity = fs._filesystem.reflink_cache_stats
+        assert (hits, misses, size) == (0, 0, 0)
+        assert capacity > 0
+
+        # files without reflink_p extents never go through the reflink btree
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        assert [fs.read_file(name) for name in names]
+        assert fs._filesystem.reflink_cache_stats[:3] == (0, 0, 0)
+        assert fs.verify()["errors"] == 0
+
+
+@pytest.mark.parametrize("mmap", [True, False])
+def test_reflink(tmp_path, mmap):
+    path = str(tmp_path / "reflink.img")
+    image = make_image(path, reflink=True, csum="crc32c")
+    names = sorted(image.files)
+    expected = [image.files[name] for name in names]
+    # the clone and its source share their indirect extents
+    source = next(name for name in names if name != "/copy" and image.files[name] == image.files["/copy"])
+
+    with Bcachefs(path, mmap=mmap, lazy=True) as fs:
+        assert fs._filesystem.reflink_cache_stats[:3] == (0, 0, 0)
+        # the source spans two indirect extents, both found with one lookup
+        assert bytes(fs.read_file(source)) == image.files[source]
+        hits, misses, size, _ = fs._filesystem.reflink_cache_stats
+        assert misses == 1 and size > 0
+        assert len(fs._file_extents(fs.find_dirent(source).inode)) == 2
+
+        # reading the clone is served by the cache
+        assert bytes(fs.read_file("/copy")) == bytes(fs.read_file(source))
+        assert fs._filesystem.reflink_cache_stats[1] == misses
+        assert fs._filesystem.reflink_cache_stats[0] > hits
+
+        # small files live in indirect_inline_data keys
+        assert [bytes(fs.read_file(name)) for name in names] == expected
+        arena, offsets = fs.read_many(names)
+        assert [arena[offsets[i] : offsets[i + 1]] for i in range(len(names))] == expected
+
+        # indirect extents are verified once however many files share them
+        stats = fs.verify()
+        assert stats["errors"] == 0
+        assert stats["verified"] == stats["extents"] == len(image.extents)
+
+    # indirect extents belong to no inode, they are reported as inode 0
+    _, offset, _ = image.extents[0]
+    with open(path, "r+b") as f:
+        f.seek(offset)
+        byte = f.read(1)
+        f.seek(offset)
+        f.write(bytes([byte[0] ^ 0xFF]))
+    with Bcachefs(path, mmap=mmap, verify=True) as fs:
+        bad_extents = fs.verify()["bad_extents"]
+        assert len(bad_extents) == 1 and bad_extents[0][0] == 0
+        failed = []
+        for name in names:
+            try:
+                fs.read_file(name)
+            except IOError:
+                failed.append(name)
+        assert len(failed) == 1 and failed[0] not in (source, "/copy")
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_inline_data(image, mmap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image, mmap=mmap) as fs:
+        inline = {
+            inode: extents
+            for inode, extents in fs._extents_map.items()
+            if all(e.data is not None for e in extents)
+        }
+        assert inline
+        assert list(bchfs.BcachefsIterExtent(fs._filesystem)) == [
+            e for extents in fs._extents_map.values() for e in extents
+        ]
+
+        it = fs._filesystem.iter(bchfs.EXTENT_TYPE)
+        for item in iter(it.next, None):
+            assert bchfs.Extent(*item) in fs._extents_map[item[0]]
+
+        arena, offsets = fs.read_many(list(inline))
+        for i, (inode, extents) in enumerate(inline.items()):
+            size = fs._inode_map[inode]
+            assert arena[offsets[i] : offsets[i + 1]] == extents[0].data[:size]
+
+            # inline files are served from the extents, the image is not read
+            with open(os.devnull, "rb") as devnull:
+                f = bchfs._BcachefsFileBinary(inode, extents, devnull, inode, size)
+                assert f.read() == fs.read_file(inode)
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_zero_copy(image, mmap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with open(image, "rb") as f:
+        data = f.read()
+
+    fs = Bcachefs(image, mmap=mmap)
+    fs._open()
+    views = {}
+    for name in fs.namelist():
+        extents = fs._file_extents(fs.find_dirent(name).inode)
+        view = fs.read_file(name)
+        assert view.readonly
+        contiguous = all(
+            e.data is None and not e.compression_type and e.offset - extents[0].offset == e.file_offset
+            for e in extents
+        )
+        # Files contiguous in a mapped image are viewed in place
+        assert view.obj.mapped == (mmap and contiguous)
+        if contiguous:
+            assert view == data[extents[0].offset : extents[0].offset + len(view)]
+
+        buffer = bytearray(len(view) + 8)
+        with fs.open(name) as f:
+            # files of an unmapped image are read from their extents
+            assert (f._cfile is not None) == mmap
+            assert f.readinto(buffer) == len(view)
+        assert buffer[: len(view)] == view
+        with fs.open(name) as f:
+            assert f.read() == view
+        views[name] = view
+
+    assert any(v.obj.mapped for v in views.values()) == mmap
+    # The image stays mapped until the views are released
+    fs.close()
+    assert all(len(bytes(v)) == v.obj.size for v in views.values())
+    for view in views.values():
+        view.release()
+
+    # Mapped files keep the image mapped once it is closed, the others can not
+    # be read anymore
+    fs = Bcachefs(image, mmap=mmap)
+    fs._open()
+    files = {name: fs._filesystem.file(fs.find_dirent(name).inode) for name in fs.namelist()}
+    expected = {name: bytes(fs.read_file(name)) for name in files}
+    fs.close()
+    assert any(f.mapped for f in files.values()) == mmap
+    for name, f in files.items():
+        if f.mapped:
+            assert f.read() == bytes(memoryview(f)) == expected[name]
+        else:
+            with pytest.raises(ValueError, match="closed"):
+                f.read()
+    files.clear()
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_index(image, mmap, tmp_path):
+    image = filepath(image)
+    assert os.path.exists(image)
+    index = str(tmp_path / "image.index")
+
+    with Bcachefs(image, mmap=mmap) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+        dirents = sorted(fs, key=str)
+        inode_map = fs._inode_map
+
+    # The first open builds and saves the index, the next ones map it
+    for _ in range(2):
+        with Bcachefs(image, mmap=mmap, index=index) as fs:
+            assert os.path.exists(index)
+            # Only the path of the index is pickled
+            assert len(pickle.dumps(fs)) < 1024
+            nr_inodes, nr_extents, nr_dirents, size = fs._filesystem.index_stats
+            assert nr_inodes >= len(inode_map) and nr_dirents == len(dirents)
+            assert size == os.path.getsize(index)
+
+            assert [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files] == names
+            assert [fs.read_file(name) for name in names] == expected
+            assert sorted(fs, key=str) == dirents
+            assert fs.find_dirent("/dir/subdir/nope") is None
+
+            # Workers map the same index instead of unpickling the namespace
+            worker = pickle.loads(pickle.dumps(fs))
+            assert [worker.read_file(name) for name in names] == expected
+            worker.close()
+
+    # An index which does not match the image is rebuilt
+    with open(index, "r+b") as f:
+        f.write(b"garbage!")
+    with Bcachefs(image, mmap=mmap, index=index) as fs:
+        assert [fs.read_file(name) for name in names] == expected
+    with open(index, "rb") as f:
+        assert f.read(8) == b"BCHINDEX"
+
+    # Threads saving the same index each write their own temporary file
+    os.remove(index)
+    with Bcachefs(image, mmap=mmap) as fs, ThreadPoolExecutor(4) as pool:
+        list(pool.map(lambda _: fs._filesystem.save_index(index), range(16)))
+    assert os.listdir(tmp_path) == ["image.index"]
+    assert os.stat(index).st_mode & 0o777 == 0o644
+    with Bcachefs(image, mmap=mmap, index=index) as fs:
+        assert [fs.read_file(name) for name in names] == expected
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_namespace_index(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        assert fs.find_dirent("/") == bchfs.ROOT_DIRENT
+        assert fs.find_dirent("//dir//subdir/") == fs.cd("dir").find_dirent("subdir")
+        assert fs.find_dirent("dir/nope/file") is None
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+        extents_map = fs._extents_map
+
+        # The index is pickled as a single blob
+        state = pickle.dumps(fs)
+        assert b"BCHINDEX" in state
+
+        worker = pickle.loads(state)
+        assert worker._extents_map == extents_map
+        assert [worker.read_file(name) for name in names] == expected
+        worker.close()
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_lazy(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+        dirents = sorted(fs, key=str)
+        extents_map = fs._extents_map
+
+    with Bcachefs(image, lazy=True) as fs:
+        # Nothing is loaded at open
+        assert fs._filesystem.index_stats is None
+        assert [fs.read_file(name) for name in names] == expected
+        assert fs._lazy_inode.cache_info().currsize == len(names)
+        assert [fs.read_file(name) for name in names] == expected
+        assert fs._lazy_inode.cache_info().hits >= len(names)
+
+        assert fs.find_dirent("/") == bchfs.ROOT_DIRENT
+        assert fs.find_dirent("dir/nope") is None
+        assert [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files] == names
+        assert sorted(fs, key=str) == dirents
+        assert fs._extents_map == extents_map
+        with pytest.raises(FileNotFoundError):
+            fs.open(2**40)
+
+        worker = pickle.loads(pickle.dumps(fs))
+        assert [worker.read_file(name) for name in names] == expected
+        worker.close()
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_open_unmappable(image, tmp_path):
+    import resource
+    import shutil
+
+    image = filepath(image)
+    assert os.path.exists(image)
+    with Bcachefs(image) as fs:
+        expected = {name: bytes(fs.read_file(name)) for name in fs.namelist()}
+
+    # an image larger than the address space left to the process, which the
+    # size of a sparse file makes it
+    large = str(tmp_path / "large.img")
+    shutil.copyfile(image, large)
+    os.truncate(large, 1 << 34)
+
+    pid = os.fork()
+    if pid == 0:
+        code = 1
+        try:
+            with open("/proc/self/status") as f:
+                vm_size = next(int(line.split()[1]) for line in f if line.startswith("VmSize"))
+            limit = vm_size * 1024 + (1 << 30)
+            resource.setrlimit(resource.RLIMIT_AS, (limit, limit))
+            with Bcachefs(large, mmap=True) as fs:
+                # read with pread, through the node cache
+                assert fs.cache_stats["capacity"] > 0
+                assert {name: bytes(fs.read_file(name)) for name in fs.namelist()} == expected
+            code = 0
+        finally:
+            os._exit(code)
+    _, status = os.waitpid(pid, 0)
+    assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_open_block_device(image):
+    import subprocess
+
+    image = filepath(image)
+    assert os.path.exists(image)
+    try:
+        device = subprocess.run(
+            ["losetup", "--read-only", "--find", "--show", image],
+            check=True, capture_output=True, text=True,
+        ).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        pytest.skip("loop devices are not available")
+
+    try:
+        with Bcachefs(image) as fs:
+            expected = {name: bytes(fs.read_file(name)) for name in fs.namelist()}
+            size = fs.size
+        # the size of a block device is not the one of its inode
+        for mmap in (True, False):
+            with Bcachefs(device, mmap=mmap) as fs:
+                assert fs.size == size
+                assert {name: bytes(fs.read_file(name)) for name in fs.namelist()} == expected
+    finally:
+        subprocess.run(["losetup", "--detach", device])
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+@pytest.mark.parametrize("mmap", [True, False])
+def test_open_fd_memory(image, mmap):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+    with open(image, "rb") as f:
+        data = f.read()
+
+    fd = os.memfd_create("bcachefs")
+    try:
+        os.write(fd, data)
+        with Bcachefs(fd, mmap=mmap) as fs:
+            assert fs.size == len(data)
+            assert [fs.read_file(name) for name in names] == expected
+        # The descriptor stays open
+        assert os.pread(fd, 8, 0) == data[:8]
+    finally:
+        os.close(fd)
+
+    with Bcachefs(memoryview(data)) as fs:
+        assert fs.size == len(data)
+        assert [bytes(fs.read_file(name)) for name in names] == expected
+        worker = pickle.loads(pickle.dumps(fs))
+        assert [bytes(worker.read_file(name)) for name in names] == expected
+        worker.close()
+
+    with pytest.raises(RuntimeError):
+        with Bcachefs(b"\0" * 8192):
+            pass
+
+
+def read_shared(fs, names):
+    # Spawned workers only receive the name of the shared index
+    assert fs._filesystem.index_stats is not None
+    return [bytes(fs.read_file(name)) for name in names]
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_shared_index(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        names = [os.path.join(root, f.name) for root, _, files in fs.walk() for f in files]
+        expected = [fs.read_file(name) for name in names]
+
+    with Bcachefs(image, shared_index=True) as fs:
+        shm = "/dev/shm" + fs._shm_name
+        assert os.path.exists(shm)
+        assert [fs.read_file(name) for name in names] == expected
+
+        state = pickle.dumps(fs)
+        assert len(state) < 1024
+
+        with mp.get_context("spawn").Pool(2) as p:
+            assert p.starmap(read_shared, [(fs, names)] * 2) == [expected] * 2
+
+    assert not os.path.exists(shm)
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_iter_seek(image):
+    from bcachefs.c_bcachefs import PyBcachefs
+
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        extents_map = fs._extents_map
+        inode_map = fs._inode_map
+        inode = max(extents_map)
+
+    raw = PyBcachefs()
+    raw.open(image, False)
+    extents = list(bchfs.BcachefsIterExtent(raw, (inode, 0), (inode, 2**64 - 1)))
+    assert extents == extents_map[inode]
+    # only the nodes on the path to the inode extents are read
+    hits, misses, _, _ = raw.cache_stats
+    assert misses <= 2
+
+    inodes = list(bchfs.BcachefsIterInode(raw, (0, inode), (0, inode)))
+    assert inodes == [bchfs.Inode(inode, inode_map[inode])]
+
+    assert list(bchfs.BcachefsIterInode(raw, (1, 0))) == []
+    raw.close()
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_iter_merge(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        # keys rewritten in later bsets come out once, in key order
+        extents = [(e.inode, e.file_offset) for e in bchfs.BcachefsIterExtent(fs._filesystem)]
+        assert extents == sorted(set(extents))
+
+        dirents = [(d.parent_inode, d.name) for d in bchfs.BcachefsIterDirEnt(fs._filesystem)]
+        assert len(dirents) == len(set(dirents))
+
+        inodes = [i.inode for i in bchfs.BcachefsIterInode(fs._filesystem)]
+        assert inodes == sorted(set(inodes))
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_iter_batch(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        for t, cls, item_cls in (
+            (bchfs.EXTENT_TYPE, bchfs.BcachefsIterExtent, bchfs.Extent),
+            (bchfs.INODE_TYPE, bchfs.BcachefsIterInode, bchfs.Inode),
+            (bchfs.DIRENT_TYPE, bchfs.BcachefsIterDirEnt, bchfs.DirEnt),
+        ):
+            single = []
+            it = fs._filesystem.iter(t)
+            for item in iter(it.next, None):
+                single.append(item)
+
+            batched = []
+            it = cls(fs._filesystem)
+            columns = it.next_batch(3)
+            while len(columns[0]):
+                assert len(columns[0]) <= 3
+                batched.extend(it.items(columns))
+                columns = it.next_batch(3)
+
+            assert batched == [item_cls(*item) for item in single]
+            assert list(cls(fs._filesystem)) == batched
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_scan(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        for cls in (bchfs.BcachefsIterExtent, bchfs.BcachefsIterInode, bchfs.BcachefsIterDirEnt):
+            expected = list(cls(fs._filesystem))
+            for threads in (0, 1, 4):
+                # results of the partitions are merged back in key order
+                assert list(cls.items(cls.scan(fs._filesystem, threads))) == expected
+
+
+@pytest.mark.parametrize("image", TEST_IMAGES)
+def test_lookup(image):
+    image = filepath(image)
+    assert os.path.exists(image)
+
+    with Bcachefs(image) as fs:
+        for name in fs.namelist() + ["dir", "dir/subdir", "lost+found"]:
+            assert fs.lookup(name) == fs.find_dirent(name)
+        assert fs.lookup("/") == bchfs.ROOT_DIRENT
+        assert fs.lookup("dir/missing") is None
+        assert fs.lookup("missing/file1") is None